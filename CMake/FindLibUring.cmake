@@ -0,0 +1,28 @@
+# Find the liburing includes and library
+#
+#  LIBURING_INCLUDE_DIR - where to find liburing.h, etc.
+#  LIBURING_LIBRARIES   - List of libraries when using liburing.
+#  LIBURING_FOUND       - True if liburing is found.
+
+# check if already in cache, be silent
+IF (LIBURING_INCLUDE_DIR)
+    SET (LIBURING_FIND_QUIETLY TRUE)
+ENDIF (LIBURING_INCLUDE_DIR)
+
+# find includes
+FIND_PATH (LIBURING_INCLUDE_DIR liburing.h
+        /usr/local/include
+        /usr/include
+        )
+
+# find lib
+FIND_LIBRARY(LIBURING_LIBRARIES
+        NAMES uring
+        PATHS /lib64 /lib /usr/lib64 /usr/lib /usr/local/lib64 /usr/local/lib /usr/lib/x86_64-linux-gnu
+        )
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("LibUring" DEFAULT_MSG
+        LIBURING_INCLUDE_DIR LIBURING_LIBRARIES)
+
+mark_as_advanced (LIBURING_INCLUDE_DIR LIBURING_LIBRARIES)
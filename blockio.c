@@ -0,0 +1,444 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "blockio.h"
+#include "scratch.h"
+
+/*
+ * Batches of block I/Os are executed by io_uring(if imgFS is built with liburing
+ * and kernel supports it) or by a pool of threads doing preadv/pwritev.
+ * Without engine(NULL) I/Os are done one after another in the calling thread.
+ * I/Os of a batch, that are adjacent in the file, are coalesced into one vectored I/O.
+ *
+ * Requests(batches or transfers outside the engine, ex. splices) take slots of queueDepth before
+ * they start. Metadata is executed by the calling thread, so it doesn't wait for batches of data,
+ * and waiting requests are dispatched by weight: META_WEIGHT of metadata per one of data.
+ * Data never takes the last slots, so bulk streams leave room for metadata.
+ * Classes only order requests, that run concurrently: block moves of the migrator beside requests
+ * of the mount, reads of "-o ro" mounts. Read-write mounts are served by one thread, so there
+ * metadata of the mount waits for its running write anyway, only its batches are spread over queueDepth.
+ */
+
+#define META_WEIGHT 4
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/** adjacent I/Os of a batch, that are transferred by one vectored I/O */
+typedef struct {
+    BlockIO *ios;
+    int n;
+    struct iovec *iov;
+} IORun;
+
+/** request, that waits for a slot, it lives on the stack of the waiting thread */
+typedef struct IOWaiter {
+    int admitted;
+    struct IOWaiter *next;
+} IOWaiter;
+
+struct BlockIOEngine {
+    int queueDepth;
+#ifdef HAVE_LIBURING
+    int useRing;
+    struct io_uring ring;
+#endif
+    pthread_t *workers;
+    int workersN;
+    pthread_mutex_t submitLock;   // batches of different threads are executed one by one
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    IORun *batch;
+    int batchN;
+    int next;
+    int pending;
+    int stopping;
+    pthread_mutex_t schedLock;    // guards slots, waiting requests and stats
+    pthread_cond_t admitted;
+    int slotsN;
+    int dataSlotsN;
+    int busy[IO_CLASSES];
+    IOWaiter *waiting[IO_CLASSES]; // the first waiting request of class
+    IOWaiter *lastWaiting[IO_CLASSES];
+    int metaStreak;               // requests of metadata, that are dispatched since the last one of data
+    IOClassStats stats[IO_CLASSES];
+};
+
+static size_t runSize(IORun *run) {
+    size_t size = 0;
+    for (int i = 0; i < run->n; i++) {
+        size += run->ios[i].size;
+    }
+    return size;
+}
+
+/** skips transferred bytes in iovecs */
+static void advanceIovec(struct iovec **iov, int *iovcnt, size_t transferred) {
+    while (*iovcnt > 0 && transferred >= (*iov)->iov_len) {
+        transferred -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + transferred;
+        (*iov)->iov_len -= transferred;
+    }
+}
+
+/** done is number of transferred bytes of the run, -1 if it failed */
+static void completeRun(IORun *run, ssize_t done) {
+    for (int i = 0; i < run->n; i++) {
+        BlockIO *io = &run->ios[i];
+        if (done == -1) {
+            io->result = -1;
+        } else {
+            io->result = (size_t)done > io->size ? (ssize_t)io->size : done;
+            done -= io->result;
+        }
+    }
+}
+
+/**
+ * Repeats preadv/pwritev until everything is transferred, EOF or error.
+ * done is number of bytes, that are already transferred.
+ */
+static void transferRun(IORun *run, size_t done) {
+    BlockIO *first = &run->ios[0];
+    size_t size = runSize(run);
+    struct iovec *iov = run->iov;
+    int iovcnt = run->n;
+    advanceIovec(&iov, &iovcnt, done);
+    while (done < size) {
+        ssize_t result;
+        if (first->type == IO_READ) {
+            result = preadv(first->fd, iov, iovcnt, first->offset + done);
+        } else {
+            result = pwritev(first->fd, iov, iovcnt, first->offset + done);
+        }
+        if (result <= 0) {
+            if (result == -1 && done == 0) {
+                completeRun(run, -1);
+                return;
+            }
+            break;
+        }
+        done += result;
+        advanceIovec(&iov, &iovcnt, result);
+    }
+    completeRun(run, done);
+}
+
+/**
+ * Splits batch into runs of adjacent I/Os of the same type and file.
+ * iovecs points to size >= n.
+ * return: number of runs
+ */
+static int makeRuns(BlockIO *ios, int n, IORun *runs, struct iovec *iovecs) {
+    int runsN = 0;
+    for (int i = 0; i < n; i++) {
+        IORun *last = runsN > 0 ? &runs[runsN - 1] : NULL;
+        BlockIO *prev = i > 0 ? &ios[i - 1] : NULL;
+        if (last == NULL || last->n == IOV_MAX || prev->type != ios[i].type || prev->fd != ios[i].fd
+                || prev->offset + (off_t)prev->size != ios[i].offset) {
+            last = &runs[runsN++];
+            last->ios = &ios[i];
+            last->n = 0;
+            last->iov = &iovecs[i];
+        }
+        iovecs[i].iov_base = ios[i].buf;
+        iovecs[i].iov_len = ios[i].size;
+        last->n++;
+    }
+    return runsN;
+}
+
+static void *worker(void *arg) {
+    BlockIOEngine *engine = arg;
+    pthread_mutex_lock(&engine->lock);
+    while (!engine->stopping) {
+        if (engine->next < engine->batchN) {
+            IORun *run = &engine->batch[engine->next++];
+            pthread_mutex_unlock(&engine->lock);
+            transferRun(run, 0);
+            pthread_mutex_lock(&engine->lock);
+            if (--engine->pending == 0) {
+                pthread_cond_signal(&engine->done);
+            }
+        } else {
+            pthread_cond_wait(&engine->work, &engine->lock);
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+/**
+ * queueDepth is maximum number of I/Os in flight, 1 or less means synchronous I/O.
+ * return: created engine, or NULL for synchronous I/O.
+ */
+BlockIOEngine *createIOEngine(int queueDepth) {
+    if (queueDepth <= 1) {
+        return NULL;
+    }
+    BlockIOEngine *engine = calloc(1, sizeof(BlockIOEngine));
+    engine->queueDepth = queueDepth;
+    pthread_mutex_init(&engine->submitLock, NULL);
+    pthread_mutex_init(&engine->schedLock, NULL);
+    pthread_cond_init(&engine->admitted, NULL);
+    engine->slotsN = queueDepth;
+    engine->dataSlotsN = queueDepth - (queueDepth / 4 > 1 ? queueDepth / 4 : 1);
+#ifdef HAVE_LIBURING
+    engine->useRing = io_uring_queue_init(queueDepth, &engine->ring, 0) == 0;
+    if (engine->useRing) {
+        return engine;
+    }
+#endif
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->work, NULL);
+    pthread_cond_init(&engine->done, NULL);
+    // submitting thread takes part in I/O too
+    engine->workersN = queueDepth - 1;
+    engine->workers = malloc(engine->workersN*sizeof(pthread_t));
+    for (int i = 0; i < engine->workersN; i++) {
+        pthread_create(&engine->workers[i], NULL, worker, engine);
+    }
+    return engine;
+}
+
+void destroyIOEngine(BlockIOEngine *engine) {
+    if (engine == NULL) {
+        return;
+    }
+#ifdef HAVE_LIBURING
+    if (engine->useRing) {
+        io_uring_queue_exit(&engine->ring);
+        pthread_mutex_destroy(&engine->submitLock);
+        pthread_mutex_destroy(&engine->schedLock);
+        pthread_cond_destroy(&engine->admitted);
+        free(engine);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&engine->lock);
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->work);
+    pthread_mutex_unlock(&engine->lock);
+    for (int i = 0; i < engine->workersN; i++) {
+        pthread_join(engine->workers[i], NULL);
+    }
+    pthread_cond_destroy(&engine->work);
+    pthread_cond_destroy(&engine->done);
+    pthread_mutex_destroy(&engine->lock);
+    pthread_mutex_destroy(&engine->submitLock);
+    pthread_mutex_destroy(&engine->schedLock);
+    pthread_cond_destroy(&engine->admitted);
+    free(engine->workers);
+    free(engine);
+}
+
+#ifdef HAVE_LIBURING
+static void submitToRing(BlockIOEngine *engine, IORun *runs, int n) {
+    int submitted = 0;
+    int completed = 0;
+    while (completed < n) {
+        // keeping queue full
+        while (submitted < n && submitted - completed < engine->queueDepth) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&engine->ring);
+            if (sqe == NULL) {
+                break;
+            }
+            IORun *run = &runs[submitted++];
+            BlockIO *first = &run->ios[0];
+            if (first->type == IO_READ) {
+                io_uring_prep_readv(sqe, first->fd, run->iov, run->n, first->offset);
+            } else {
+                io_uring_prep_writev(sqe, first->fd, run->iov, run->n, first->offset);
+            }
+            io_uring_sqe_set_data(sqe, run);
+        }
+        io_uring_submit(&engine->ring);
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&engine->ring, &cqe) == 0) {
+            IORun *run = io_uring_cqe_get_data(cqe);
+            if (cqe->res > 0) {
+                // short transfer is finished synchronously
+                transferRun(run, cqe->res);
+            } else {
+                completeRun(run, cqe->res == 0 ? 0 : -1);
+            }
+            io_uring_cqe_seen(&engine->ring, cqe);
+            completed++;
+        }
+    }
+}
+#endif
+
+static int64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+/** schedLock must be held */
+static int canStart(BlockIOEngine *engine, IOClass ioClass) {
+    return engine->busy[IO_META] + engine->busy[IO_DATA] < engine->slotsN
+           && (ioClass == IO_META || engine->busy[IO_DATA] < engine->dataSlotsN);
+}
+
+/** Gives free slots to waiting requests by weight. schedLock must be held */
+static void dispatchWaiting(BlockIOEngine *engine) {
+    int granted = 0;
+    while (1) {
+        int metaReady = engine->waiting[IO_META] != NULL && canStart(engine, IO_META);
+        int dataReady = engine->waiting[IO_DATA] != NULL && canStart(engine, IO_DATA);
+        IOClass next;
+        if (metaReady && (!dataReady || engine->metaStreak < META_WEIGHT)) {
+            next = IO_META;
+            engine->metaStreak++;
+        } else if (dataReady) {
+            next = IO_DATA;
+            engine->metaStreak = 0;
+        } else {
+            break;
+        }
+        IOWaiter *waiter = engine->waiting[next];
+        engine->waiting[next] = waiter->next;
+        if (waiter->next == NULL) {
+            engine->lastWaiting[next] = NULL;
+        }
+        engine->stats[next].queued--;
+        engine->stats[next].inFlight++;
+        engine->busy[next]++;
+        waiter->admitted = 1;
+        granted = 1;
+    }
+    if (granted) {
+        pthread_cond_broadcast(&engine->admitted);
+    }
+}
+
+/**
+ * Waits for a slot of request. Request, that is admitted, must be completed by completeIO.
+ * Requests mustn't be admitted, while the thread keeps a slot: it may wait for itself.
+ * return: time of submit, that completeIO takes. 0 without engine, there is nothing to wait for then
+ */
+int64_t admitIO(BlockIOEngine *engine, IOClass ioClass) {
+    if (engine == NULL) {
+        return 0;
+    }
+    int64_t submitted = nowNs();
+    pthread_mutex_lock(&engine->schedLock);
+    if (engine->waiting[ioClass] == NULL && canStart(engine, ioClass)) {
+        engine->stats[ioClass].inFlight++;
+        engine->busy[ioClass]++;
+    } else {
+        IOWaiter waiter = { 0, NULL };
+        if (engine->lastWaiting[ioClass] != NULL) {
+            engine->lastWaiting[ioClass]->next = &waiter;
+        } else {
+            engine->waiting[ioClass] = &waiter;
+        }
+        engine->lastWaiting[ioClass] = &waiter;
+        engine->stats[ioClass].queued++;
+        while (!waiter.admitted) {
+            pthread_cond_wait(&engine->admitted, &engine->schedLock);
+        }
+    }
+    pthread_mutex_unlock(&engine->schedLock);
+    return submitted;
+}
+
+/** frees the slot of request, submitted is the result of admitIO */
+void completeIO(BlockIOEngine *engine, IOClass ioClass, int64_t submitted) {
+    if (engine == NULL) {
+        return;
+    }
+    int64_t latency = nowNs() - submitted;
+    pthread_mutex_lock(&engine->schedLock);
+    IOClassStats *stats = &engine->stats[ioClass];
+    stats->inFlight--;
+    stats->completed++;
+    stats->totalLatencyNs += latency;
+    if (latency > stats->maxLatencyNs) {
+        stats->maxLatencyNs = latency;
+    }
+    engine->busy[ioClass]--;
+    dispatchWaiting(engine);
+    pthread_mutex_unlock(&engine->schedLock);
+}
+
+/** stats are zeroes without engine */
+void getIOStats(BlockIOEngine *engine, IOClass ioClass, IOClassStats *stats) {
+    if (engine == NULL) {
+        memset(stats, 0, sizeof(IOClassStats));
+        return;
+    }
+    pthread_mutex_lock(&engine->schedLock);
+    *stats = engine->stats[ioClass];
+    pthread_mutex_unlock(&engine->schedLock);
+}
+
+/**
+ * Executes batch of I/Os and waits for all of them. Order of I/Os isn't kept,
+ * so they must not overlap.
+ * return: 0 if all I/Os are complete, -1 if some of them failed or were short.
+ */
+int submitIO(BlockIOEngine *engine, BlockIO *ios, int n, IOClass ioClass) {
+    ScratchMark mark = scratchMark();
+    IORun *runs = scratchAlloc(n*sizeof(IORun));
+    struct iovec *iovecs = scratchAlloc(n*sizeof(struct iovec));
+    int runsN = makeRuns(ios, n, runs, iovecs);
+    int64_t submitted = admitIO(engine, ioClass);
+    if (engine == NULL || runsN == 1 || ioClass == IO_META) {
+        // metadata is small, it isn't queued behind the batch of data, that the engine executes
+        for (int i = 0; i < runsN; i++) {
+            transferRun(&runs[i], 0);
+        }
+#ifdef HAVE_LIBURING
+    } else if (engine->useRing) {
+        pthread_mutex_lock(&engine->submitLock);
+        submitToRing(engine, runs, runsN);
+        pthread_mutex_unlock(&engine->submitLock);
+#endif
+    } else {
+        pthread_mutex_lock(&engine->submitLock);
+        pthread_mutex_lock(&engine->lock);
+        engine->batch = runs;
+        engine->batchN = runsN;
+        engine->next = 0;
+        engine->pending = runsN;
+        pthread_cond_broadcast(&engine->work);
+        while (engine->next < engine->batchN) {
+            IORun *run = &engine->batch[engine->next++];
+            pthread_mutex_unlock(&engine->lock);
+            transferRun(run, 0);
+            pthread_mutex_lock(&engine->lock);
+            engine->pending--;
+        }
+        while (engine->pending > 0) {
+            pthread_cond_wait(&engine->done, &engine->lock);
+        }
+        engine->batchN = 0;
+        pthread_mutex_unlock(&engine->lock);
+        pthread_mutex_unlock(&engine->submitLock);
+    }
+    completeIO(engine, ioClass, submitted);
+    scratchRelease(mark);
+    int returnCode = 0;
+    for (int i = 0; i < n; i++) {
+        if (ios[i].result != (ssize_t)ios[i].size) {
+            returnCode = -1;
+        }
+    }
+    return returnCode;
+}
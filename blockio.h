@@ -0,0 +1,40 @@
+#ifndef _BLOCKIO_H_
+#define _BLOCKIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum { IO_READ=0, IO_WRITE } IOType;
+
+/** metadata(directories, symlinks) is dispatched ahead of bulk data */
+typedef enum { IO_META=0, IO_DATA, IO_CLASSES } IOClass;
+
+typedef struct {
+    IOType type;
+    int fd;
+    off_t offset;
+    void *buf;
+    size_t size;
+    ssize_t result;   // transferred size, or -1 if I/O failed
+} BlockIO;
+
+/** Counters of requests of one class, latency is counted from submit to completion */
+typedef struct {
+    int64_t queued;           // requests, that wait for a slot
+    int64_t inFlight;
+    int64_t completed;
+    int64_t totalLatencyNs;
+    int64_t maxLatencyNs;
+} IOClassStats;
+
+typedef struct BlockIOEngine BlockIOEngine;
+
+BlockIOEngine *createIOEngine(int queueDepth);
+void destroyIOEngine(BlockIOEngine *engine);
+int submitIO(BlockIOEngine *engine, BlockIO *ios, int n, IOClass ioClass);
+int64_t admitIO(BlockIOEngine *engine, IOClass ioClass);
+void completeIO(BlockIOEngine *engine, IOClass ioClass, int64_t submitted);
+void getIOStats(BlockIOEngine *engine, IOClass ioClass, IOClassStats *stats);
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+/*
+ * LZF-like codec. Compressed stream is a sequence of:
+ *   000LLLLL <L+1 literal bytes>
+ *   LLLooooo oooooooo                  - back reference of L+2 bytes (L < 7)
+ *   111ooooo LLLLLLLL oooooooo         - back reference of L+9 bytes
+ * where o is (distance - 1).
+ */
+
+#define HASH_LOG 13
+#define MAX_LITERAL (1 << 5)
+#define MAX_DISTANCE (1 << 13)
+#define MAX_REF ((1 << 8) + (1 << 3))
+
+static uint32_t hash3(const uint8_t *p) {
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return ((v * 2654435761u) >> (32 - HASH_LOG)) & ((1 << HASH_LOG) - 1);
+}
+
+/**
+ * return: size of compressed data,
+ *         0 means, that it doesn't fit in outLimit bytes.
+ */
+int compressBlock(const void *in, int inSize, void *out, int outLimit) {
+    const uint8_t *src = in;
+    uint8_t *dst = out;
+    uint32_t htab[1 << HASH_LOG]; // position + 1, 0 means empty
+    memset(htab, 0, sizeof(htab));
+    int ip = 0;
+    int op = 1; // dst[0] is reserved for the control byte of literal run
+    int lit = 0;
+    while (ip < inSize) {
+        int len = 0;
+        int distance = 0;
+        if (ip + 2 < inSize) {
+            uint32_t h = hash3(src + ip);
+            int ref = (int)htab[h] - 1;
+            htab[h] = ip + 1;
+            distance = ip - ref - 1;
+            if (ref >= 0 && distance < MAX_DISTANCE && src[ref] == src[ip]
+                    && src[ref+1] == src[ip+1] && src[ref+2] == src[ip+2]) {
+                int maxLen = inSize - ip < MAX_REF ? inSize - ip : MAX_REF;
+                len = 3;
+                while (len < maxLen && src[ref+len] == src[ip+len]) {
+                    len++;
+                }
+            }
+        }
+        if (len > 0) {
+            // closing literal run or giving back its unused control byte
+            if (lit > 0) {
+                dst[op - lit - 1] = lit - 1;
+            } else {
+                op--;
+            }
+            if (op + 3 > outLimit) {
+                return 0;
+            }
+            int encodedLen = len - 2;
+            if (encodedLen < 7) {
+                dst[op++] = (distance >> 8) + (encodedLen << 5);
+            } else {
+                dst[op++] = (distance >> 8) + (7 << 5);
+                dst[op++] = encodedLen - 7;
+            }
+            dst[op++] = distance & 0xff;
+            ip += len;
+            lit = 0;
+            op++;
+        } else {
+            if (op >= outLimit) {
+                return 0;
+            }
+            dst[op++] = src[ip++];
+            lit++;
+            if (lit == MAX_LITERAL) {
+                dst[op - lit - 1] = lit - 1;
+                lit = 0;
+                op++;
+            }
+        }
+    }
+    if (lit > 0) {
+        dst[op - lit - 1] = lit - 1;
+    } else {
+        op--;
+    }
+    return op;
+}
+
+/**
+ * return: size of decompressed data,
+ *         -1 means, that data is corrupted or doesn't fit in outLimit bytes.
+ */
+int decompressBlock(const void *in, int inSize, void *out, int outLimit) {
+    const uint8_t *src = in;
+    uint8_t *dst = out;
+    int ip = 0;
+    int op = 0;
+    while (ip < inSize) {
+        unsigned int ctrl = src[ip++];
+        if (ctrl < MAX_LITERAL) {
+            int len = ctrl + 1;
+            if (ip + len > inSize || op + len > outLimit) {
+                return -1;
+            }
+            memcpy(dst + op, src + ip, len);
+            ip += len;
+            op += len;
+        } else {
+            int len = ctrl >> 5;
+            if (len == 7) {
+                if (ip >= inSize) {
+                    return -1;
+                }
+                len += src[ip++];
+            }
+            len += 2;
+            if (ip >= inSize) {
+                return -1;
+            }
+            int ref = op - (int)((ctrl & 0x1f) << 8) - src[ip++] - 1;
+            if (ref < 0 || op + len > outLimit) {
+                return -1;
+            }
+            // byte by byte, because reference may overlap the output
+            for (int i = 0; i < len; i++) {
+                dst[op++] = dst[ref++];
+            }
+        }
+    }
+    return op;
+}
\ No newline at end of file
@@ -0,0 +1,7 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+int compressBlock(const void *in, int inSize, void *out, int outLimit);
+int decompressBlock(const void *in, int inSize, void *out, int outLimit);
+
+#endif
\ No newline at end of file
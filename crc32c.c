@@ -0,0 +1,91 @@
+#include <string.h>
+
+#include "crc32c.h"
+
+/*
+ * CRC32C(Castagnoli). SSE 4.2 crc32 instruction is used when processor has it,
+ * otherwise table-driven slicing-by-8, that handles 8 bytes per step.
+ */
+
+#define POLY 0x82f63b78 // reflected 0x1edc6f41
+
+static uint32_t table[8][256];
+
+static void initTable(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? POLY : 0);
+        }
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32cSoft(uint32_t crc, const uint8_t *p, size_t size) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t));
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff]
+            ^ table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff]
+            ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff]
+            ^ table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        p += 8;
+        size -= 8;
+    }
+#endif
+    while (size > 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        size--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HARD
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHard(uint32_t crc, const uint8_t *p, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        size--;
+    }
+    return crc;
+}
+#endif
+
+/** crc is a checksum of preceding data, 0 for the first call */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    static int hardware = -1;
+    if (hardware == -1) {
+        initTable();
+#ifdef HAVE_CRC32C_HARD
+        hardware = __builtin_cpu_supports("sse4.2");
+#else
+        hardware = 0;
+#endif
+    }
+    crc = ~crc;
+#ifdef HAVE_CRC32C_HARD
+    if (hardware) {
+        return ~crc32cHard(crc, data, size);
+    }
+#endif
+    return ~crc32cSoft(crc, data, size);
+}
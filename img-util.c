@@ -1,39 +1,254 @@
+#define _GNU_SOURCE // fallocate
 #define HEADER_OFFSET 0
+#define HEADER_SIZE 512 // reserved for the header, so new fields don't move the descriptors
+#define COPY_CHUNK (1024*1024)
+#define GROUP_BLOCKS 8192 // blocks per allocation group of new images
+#define FAT_WINDOW 512    // FAT entries, that chain walks read at once
+#define DESCR_WINDOW 16   // descriptors, that search of free descriptor reads at once
+#define HEAT_PINNED 0x80  // block of directory, it leaves the fast tier only for other directories
+#define HEAT_COUNT 0x7f
+#define PROMOTE_HEAT 4    // accesses between decays, that make block candidate for the fast tier
+#define MAX_CANDIDATES 4096
+#define CHANGED_ENTRIES 0x1 // FAT entry, stored size, shared references or checksum of block was written
+#define CHANGED_DATA 0x2    // contents of block were written
+#define CHANGE_BITS 2       // bits of each block in the table of changes
+#define BLOCKS_PER_BYTE (8 / CHANGE_BITS)
+#define DELTA_MAGIC 0x44464d49 // "IMFD"
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "img-util.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "scratch.h"
 
 static void initFAT(FSContext *context);
-static BlockID allocateBlock(FSContext *context);
+static BlockID allocateBlock(int group, FSContext *context);
+static int64_t takeFreeBlocks(int group, BlockID *blocks, int64_t blocksN, FSContext *context);
+static void linkBlocks(BlockID prevBlock, BlockID *blocks, int64_t blocksN, BlockID tail, FSContext *context);
 static BlockID addBlockFor(FileDescriptor *descr, FSContext *context);
-static void removeBlocksFrom(FileDescriptor *descr, int blockN, FSContext *context);
+static int64_t appendBlocks(FileDescriptor *descr, int64_t blocksN, bool zero, FSContext *context);
+static void zeroBlocks(BlockID *blocks, int64_t blocksN, FSContext *context);
+static void removeBlocksFrom(FileDescriptor *descr, int64_t blockN, FSContext *context);
 static void releaseBlocksChain(BlockID startBlock, FSContext *context);
-static int getBlocksChain(BlockID startBlock, BlockID *blockArr, FSContext *context);
-static BlockID getBlockInChain(BlockID startBlock, int blockIndex, FSContext *context);
+static void releaseBlocks(BlockID *blocks, int64_t blocksN, FSContext *context);
+static void releaseBlock(BlockID block, FSContext *context);
+static int64_t getBlocksChain(BlockID startBlock, BlockID *blockArr, FSContext *context);
+static BlockID getBlockInChain(BlockID startBlock, int64_t blockIndex, FSContext *context);
 
-static int findLinkIn(FileDescriptor *dirDescr, char name[MAX_FNAME_LEN], long *deOffset, FSContext *context);
+/** Part of FAT, that is read at once: chains mostly go through neighbouring blocks */
+typedef struct {
+    BlockID first;              // block, which entry is entries[0]
+    int64_t entriesN;           // 0 means, that nothing is read yet
+    BlockID entries[FAT_WINDOW];
+} FatWindow;
+
+static BlockID getNextBlock(BlockID block, FSContext *context);
+static void setNextBlock(BlockID block, BlockID nextBlock, FSContext *context);
+static BlockID walkChain(FatWindow *window, BlockID block, FSContext *context);
+static void chainFreeBlocks(BlockID from, BlockID to, BlockID *heads, FSContext *layout);
+
+static int getGroupsN(BlockID blocksN, FSContext *context);
+static int groupOf(BlockID block, FSContext *context);
+static off_t groupHeadOffset(int group, FSContext *context);
+static void saveGroupHead(int group, FSContext *context);
+static void loadGroups(FSContext *context);
+static void destroyGroups(AllocGroup *groups, int groupsN);
+
+static void loadTiers(FSContext *context);
+static void growTiers(TierMap *tiers, BlockID blocksN, BlockID newBlocksN);
+static void destroyTiers(TierMap *tiers);
+static void lockTiers(FSContext *context);
+static void unlockTiers(FSContext *context);
+static void noteAccess(BlockID block, bool pinned, FSContext *context);
+static uint8_t getHeat(BlockID block, TierMap *tiers);
+static void setHeat(BlockID block, uint8_t heat, TierMap *tiers);
+static bool copyBlockData(int fromFd, off_t from, int toFd, off_t to, char *data, FSContext *context);
+static bool moveBlock(BlockID block, int64_t slot, FSContext *context);
+static int64_t pickSlot(bool pinned, FSContext *context);
+static void *runMigrator(void *arg);
+
+static void loadChanges(FSContext *context);
+static void growChanges(ChangeMap *changes, BlockID blocksN, BlockID newBlocksN);
+static void destroyChanges(ChangeMap *changes);
+static void markBlock(BlockID block, int bits, FSContext *context);
+static void markBlocks(BlockID from, BlockID to, int bits, FSContext *context);
+static void markDescriptor(int fdId, FSContext *context);
+static void saveChangeBits(uint8_t *bits, int64_t index, off_t tableOffset, FSContext *context);
+static void beginGeneration(int64_t generation, FSContext *context);
+static off_t getBlockChangesSize(BlockID blocksN, FSContext *context);
+static off_t getDescrChangesSize(FSContext *context);
+
+static ssize_t readTable(void *buf, size_t size, off_t offset, FSContext *context);
+static ssize_t writeTable(const void *buf, size_t size, off_t offset, FSContext *context);
+static uint32_t getStoredSize(BlockID block, FSContext *context);
+static void setStoredSize(BlockID block, uint32_t storedSize, FSContext *context);
+static uint32_t getChecksum(BlockID block, FSContext *context);
+static void setChecksum(BlockID block, uint32_t checksum, FSContext *context);
+static off_t locateBlock(BlockID block, int *fd, FSContext *context);
+static off_t locateHome(BlockID block, int *fd, FSContext *context);
+static int getDataMembersN(FSContext *context);
+static bool transferBlock(IOType type, void *buf, BlockID block, FSContext *context);
+
+/** part of block, that is read or written by request to the file */
+typedef struct {
+    BlockID block;
+    int offsetInBlock;
+    char *buf;        // part of the caller's buffer
+    size_t size;
+    uint32_t storedSize;
+    char *stored;     // whole stored block, NULL if data is transferred right from/to buf
+    bool failed;
+} BlockPart;
+
+static ssize_t readBlockParts(BlockPart *parts, int64_t partsN, IOClass ioClass, FSContext *context);
+static ssize_t readBlockPart(BlockID block, int offsetInBlock, void *buf, size_t size, IOClass ioClass, FSContext *context);
+static IOClass classOf(FileDescriptor *descr);
+static size_t writeBlockParts(FileDescriptor *descr, BlockPart *parts, int64_t partsN, FSContext *context);
+
+static uint32_t getSharedRefs(BlockID block, FSContext *context);
+static void setSharedRefs(BlockID block, uint32_t refs, FSContext *context);
+static void addSharedRefs(BlockID *blocks, int64_t blocksN, int delta, FSContext *context);
+static BlockID unshareBlock(FileDescriptor *descr, int64_t blockIndex, BlockID prevBlock, BlockID block, FSContext *context);
+static int64_t countNeededBlocks(FileDescriptor *descr, int64_t blockIndex, int64_t lastBlockIndex, FSContext *context);
+
+static OpenFile *getOpenFile(int fdId, FSContext *context);
+static OpenFile *getMappedFile(FileDescriptor *descr, FSContext *context);
+static void dropBlockMap(OpenFile *file);
+static void touchDescriptor(FileDescriptor *descr, FSContext *context);
+
+static int findLinkIn(FileDescriptor *dirDescr, const char *name, int64_t *deOffset, FileDescriptor *snapshot, FSContext *context);
+static int lookupPath(FileDescriptor *descr, const char *path, FileDescriptor *snapshot, FSContext *context);
+static void readEntryAt(FileDescriptor *dirDescr, DirEntry *entry, int64_t offset, FileDescriptor *snapshot, FSContext *context);
+
+/**
+ * Record of compact directory, its name follows it without terminating zero.
+ * Records don't cross blocks, space after the last record of a block is zeroed.
+ */
+typedef struct {
+    int32_t fdId;
+    uint32_t hash;          // CRC32C of the name, names are compared only if hashes match
+    uint16_t recordLen;     // with the name and padding, 0 means, that the rest of the block is free
+    uint8_t nameLen;        // 0 means, that record is free
+    uint8_t reserved;
+} DirRecord;
+
+#define RECORD_ALIGN 4
+#define MAX_RECORD_LEN (sizeof(DirRecord) + MAX_FNAME_LEN)
+
+/** Walks records of directory, that are read by windows within one block */
+typedef struct {
+    FileDescriptor *dirDescr;
+    FileDescriptor *snapshot;   // NULL for live directory
+    int64_t offset;             // of the next record
+    char *window;               // contents from windowOffset, DirEntry records are converted into it
+    ScratchMark mark;           // window is taken from scratch memory after it
+    int64_t windowOffset;
+    int windowLen;
+    int windowSize;
+    int gapNeed;                // free space at ends of blocks is searched, if it's > 0
+    int64_t gapOffset;          // the first one, that fits gapNeed bytes, -1 if there is no such
+} DirCursor;
+
+static void openDirCursor(DirCursor *cursor, FileDescriptor *dirDescr, FileDescriptor *snapshot, int64_t offset,
+        int windowSize, FSContext *context);
+static void closeDirCursor(DirCursor *cursor);
+static DirRecord *nextDirRecord(DirCursor *cursor, int64_t *recordOffset, FSContext *context);
+static bool fillDirWindow(DirCursor *cursor, int64_t offset, FSContext *context);
+static int recordSize(int nameLen);
+static void fillRecord(DirRecord *record, const char *name, int fdId, int recordLen);
 
 static void detachName(const char *path, char *dirPath, char *lastName);
 
+static FSContext *openMembers(char **imgPaths, int membersN, const char *mode);
+static void initZeroBlock(FSContext *context);
 static void fillHeaderIn(FSContext *context);
 static void defineOffsets(FSContext *context);
-static void grindFile(FILE *file, long size);
+static void defineTablesOffsets(FSContext *context);
+static int64_t getMemberBlocks(BlockID blocksN, FSContext *context);
+static off_t getDataEnd(FSContext *context);
+static void releaseOrphans(FSContext *context);
+static void extendFile(FILE *file, off_t size);
+static bool copyRange(FILE *file, off_t from, off_t to, off_t size);
+static void grindFile(FILE *file, int64_t size);
 
 
 /** return created context*/
-FSContext *createImgFile(char *imgPath, long devSize, int blockSize, int maxFileN) {
-    FILE *imgFile = fopen(imgPath, "wb+");
+FSContext *createImgFile(char *imgPath, int64_t devSize, int blockSize, int maxFileN, uint32_t flags) {
+    return createStripedImgFile(&imgPath, 1, 1, devSize, blockSize, maxFileN, flags);
+}
+
+/**
+ * Creates image, which data region is striped across membersN backing files by stripes
+ * of stripeBlocks blocks. Header, descriptors, FAT and other tables are kept in the first one.
+ * return: created context, or NULL if some backing file can't be created
+ */
+FSContext *createStripedImgFile(char **imgPaths, int membersN, int stripeBlocks, int64_t devSize,
+        int blockSize, int maxFileN, uint32_t flags) {
+    return createTieredImgFile(imgPaths, membersN, stripeBlocks, devSize, 0, blockSize, maxFileN, flags);
+}
+
+/**
+ * The same as createStripedImgFile, but with fastSize > 0 the first backing file is the fast tier:
+ * it keeps header, tables and fastSize bytes of hot blocks, data is striped across the others.
+ * return: created context, or NULL if some backing file can't be created or there is no file for data
+ */
+FSContext *createTieredImgFile(char **imgPaths, int membersN, int stripeBlocks, int64_t devSize, int64_t fastSize,
+        int blockSize, int maxFileN, uint32_t flags) {
+    int64_t fastSlotsN = fastSize / blockSize;
+    if (fastSlotsN > INT32_MAX || (fastSlotsN > 0 && membersN < 2)) {
+        return NULL;
+    }
+    FILE **members = malloc(membersN*sizeof(FILE *));
+    for (int i = 0; i < membersN; i++) {
+        members[i] = fopen(imgPaths[i], "wb+");
+        if (members[i] == NULL) {
+            while (--i >= 0) {
+                fclose(members[i]);
+            }
+            free(members);
+            return NULL;
+        }
+    }
+    FILE *imgFile = members[0];
     FSContext *context = malloc(sizeof(FSContext));
     context->imgFile = imgFile;
+    context->membersN = membersN;
+    context->stripeBlocks = stripeBlocks > 0 ? stripeBlocks : 1;
+    context->members = members;
     context->devSize = devSize;
     context->blockSize = blockSize;
     context->maxFileN = maxFileN;
+    context->flags = flags;
+    context->snapshotsFdId = 0;
+    context->ioEngine = NULL;
+    context->openFiles = calloc(maxFileN, sizeof(OpenFile *));
+    context->fdGenerations = calloc(maxFileN, sizeof(uint32_t));
+    pthread_mutex_init(&context->openFilesLock, NULL);
+    context->fatOffset = 0;
+    context->groupBlocks = GROUP_BLOCKS;
+    context->fastSlotsN = fastSlotsN;
+    context->generation = 1;
+    context->generationDevSize = devSize;
+    initZeroBlock(context);
     defineOffsets(context);
-    grindFile(imgFile, devSize);
+    // fast tier keeps no stripes, its slots are free, while table of slots is zeroed
+    grindFile(imgFile, getDataEnd(context));
+    // other members keep only their stripes of data region
+    int64_t memberBlocks = getMemberBlocks(devSize / blockSize, context);
+    for (int i = 1; i < membersN; i++) {
+        grindFile(members[i], memberBlocks*blockSize);
+    }
     fillHeaderIn(context);
     initFAT(context);
+    loadGroups(context);
+    loadTiers(context);
+    loadChanges(context);
     // making root dir descr
     FileDescriptor *root = malloc(sizeof(FileDescriptor));
     context->root = root;
@@ -45,59 +260,464 @@ FSContext *createImgFile(char *imgPath, long devSize, int blockSize, int maxFile
 }
 
 void closeContext(FSContext *context) {
+    stopMigrator(context);
+    for (int fdId = 0; fdId < context->maxFileN; fdId++) {
+        OpenFile *file = context->openFiles[fdId];
+        if (file != NULL) {
+            flushFile(file, context);
+            free(file->blockMap);
+            free(file);
+        }
+    }
+    free(context->openFiles);
+    free(context->fdGenerations);
+    pthread_mutex_destroy(&context->openFilesLock);
+    destroyGroups(context->groups, context->groupsN);
+    destroyTiers(context->tiers);
+    destroyChanges(context->changes);
+    destroyIOEngine(context->ioEngine);
+    for (int i = 1; i < context->membersN; i++) {
+        fclose(context->members[i]);
+    }
+    free(context->members);
     fclose(context->imgFile);
     free(context->root);
+    free((void *)context->zeroBlock);
     free(context);
 }
 
+/**
+ * return: opened context, or NULL if image can't be opened or has format
+ *         of other version (older images must be upgraded with upgradeImgFile).
+ */
 FSContext *openContext(char* imgPath) {
+    return openStripedContext(&imgPath, 1);
+}
+
+/**
+ * Opens image, that is striped across membersN backing files. Files must be listed
+ * in the same order, as they were given to createStripedImgFile.
+ * return: opened context, or NULL if image can't be opened, has format of other version
+ *         or other number of backing files.
+ */
+FSContext *openStripedContext(char **imgPaths, int membersN) {
+    return openMembers(imgPaths, membersN, "rb+");
+}
+
+/**
+ * Opens image for reading only(ex. to serve it by many readers), it mustn't be changed through the context.
+ * return: the same as openStripedContext
+ */
+FSContext *openReadOnlyContext(char **imgPaths, int membersN) {
+    return openMembers(imgPaths, membersN, "rb");
+}
+
+/** mode is the mode of fopen for all backing files */
+static FSContext *openMembers(char **imgPaths, int membersN, const char *mode) {
+    FILE *imgFile = fopen(imgPaths[0], mode);
+    if (imgFile == NULL) {
+        return NULL;
+    }
+    uint32_t magic = 0, version = 0;
+    fseeko(imgFile, HEADER_OFFSET, SEEK_SET);
+    fread(&magic, sizeof(uint32_t), 1, imgFile);
+    fread(&version, sizeof(uint32_t), 1, imgFile);
+    if (magic != IMG_MAGIC || version != IMG_VERSION) {
+        fclose(imgFile);
+        return NULL;
+    }
     FSContext *context = malloc(sizeof(FSContext));
-    FILE *imgFile = fopen(imgPath, "rb+");
     context->imgFile = imgFile;
-    fseek(imgFile, HEADER_OFFSET, SEEK_SET);
-    fread(&(context->devSize), sizeof(long),1, imgFile);
-    fread(&(context->blockSize), sizeof(int),1, imgFile);
-    fread(&(context->maxFileN), sizeof(int), 1, imgFile);
+    fread(&(context->devSize), sizeof(int64_t), 1, imgFile);
+    fread(&(context->blockSize), sizeof(int32_t), 1, imgFile);
+    fread(&(context->maxFileN), sizeof(int32_t), 1, imgFile);
+    fread(&(context->flags), sizeof(uint32_t), 1, imgFile);
+    fread(&(context->snapshotsFdId), sizeof(int32_t), 1, imgFile);
+    fread(&(context->membersN), sizeof(int32_t), 1, imgFile);
+    fread(&(context->stripeBlocks), sizeof(int32_t), 1, imgFile);
+    fread(&(context->fatOffset), sizeof(int64_t), 1, imgFile);
+    fread(&(context->dataOffset), sizeof(int64_t), 1, imgFile);
+    fread(&(context->groupBlocks), sizeof(int32_t), 1, imgFile);
+    fread(&(context->fastSlotsN), sizeof(int64_t), 1, imgFile);
+    fread(&(context->generation), sizeof(int64_t), 1, imgFile);
+    fread(&(context->generationDevSize), sizeof(int64_t), 1, imgFile);
+    // images made before striping have zeroes there
+    if (context->membersN == 0) {
+        context->membersN = 1;
+        context->stripeBlocks = 1;
+    }
+    if (context->membersN != membersN || context->stripeBlocks <= 0 || (context->fastSlotsN > 0 && membersN < 2)) {
+        fclose(imgFile);
+        free(context);
+        return NULL;
+    }
+    context->members = malloc(membersN*sizeof(FILE *));
+    context->members[0] = imgFile;
+    for (int i = 1; i < membersN; i++) {
+        context->members[i] = fopen(imgPaths[i], mode);
+        if (context->members[i] == NULL) {
+            while (--i >= 0) {
+                fclose(context->members[i]);
+            }
+            free(context->members);
+            free(context);
+            return NULL;
+        }
+    }
+    context->ioEngine = NULL;
+    context->openFiles = calloc(context->maxFileN, sizeof(OpenFile *));
+    context->fdGenerations = calloc(context->maxFileN, sizeof(uint32_t));
+    pthread_mutex_init(&context->openFilesLock, NULL);
+    initZeroBlock(context);
     defineOffsets(context);
+    if (strchr(mode, '+') != NULL) {
+        // images made before were shorter than their data region, blocks of the tail weren't written yet
+        extendFile(imgFile, getDataEnd(context));
+    }
+    loadGroups(context);
+    loadTiers(context);
+    loadChanges(context);
     FileDescriptor *descr = malloc(sizeof(FileDescriptor));
     getDescriptor(descr, 0, context);
     context->root = descr;
+    if (strchr(mode, '+') != NULL) {
+        releaseOrphans(context);
+    }
     return context;
 }
 
+/** zero block is allocated once, so writers of zeroes don't allocate their own */
+static void initZeroBlock(FSContext *context) {
+    char *zeroBlock = calloc(context->blockSize, 1);
+    context->zeroBlock = zeroBlock;
+    context->zeroChecksum = crc32c(0, zeroBlock, context->blockSize);
+}
+
+/**
+ * queueDepth is maximum number of block I/Os of one request, that are executed
+ * concurrently. 1 or less means synchronous I/O, striped images get at least one
+ * I/O per backing file. It's also the number of requests, that engine runs at once:
+ * blocks of directories and symlinks are dispatched ahead of data(see blockio.c).
+ */
+void setQueueDepth(FSContext *context, int queueDepth) {
+    // stripes of large requests are transferred to all members at once
+    if (queueDepth < context->membersN) {
+        queueDepth = context->membersN;
+    }
+    destroyIOEngine(context->ioEngine);
+    context->ioEngine = createIOEngine(queueDepth);
+}
+
+/**
+ * Grows mounted image up to newDevSize. Backing files are extended, FAT and per-block
+ * tables are copied behind the new end of data region(in the first backing file),
+ * so block ids and data stay in place. New blocks are pushed to free lists of their groups.
+ * Header is switched to the new tables last, so image stays valid, if growth is interrupted.
+ * Descriptors aren't moved: number of files is fixed. Growth must not run concurrently
+ * with allocation of blocks: groups are replaced. Copy of image grows once per delta(see importChanges),
+ * so free lists of new blocks are exported, if image grows more than once during a generation.
+ * return: 0 if success, -1 means, that newDevSize isn't larger than the current size,
+ *         -2 means, that tables can't be copied
+ */
+int growImgFile(FSContext *context, int64_t newDevSize) {
+    FILE *imgFile = context->imgFile;
+    BlockID blocksN = context->devSize / context->blockSize;
+    BlockID newBlocksN = newDevSize / context->blockSize;
+    if (newBlocksN <= blocksN) {
+        return -1;
+    }
+    off_t tablesSize = context->dataOffset > context->fatOffset ? context->dataOffset - context->fatOffset
+            : (off_t)blocksN*(sizeof(BlockID) + 2*sizeof(uint32_t)
+                + ((context->flags & IMG_CHECKSUMS) ? sizeof(uint32_t) : 0)) + context->fastSlotsN*sizeof(BlockID)
+              + getBlockChangesSize(blocksN, context) + getDescrChangesSize(context);
+    off_t tablesEnd = context->fatOffset + tablesSize;
+    int64_t memberBlocks = getMemberBlocks(newBlocksN, context);
+    FSContext grownData = *context;
+    grownData.devSize = newDevSize;
+    off_t dataEnd = getDataEnd(&grownData);
+
+    FSContext grown = *context;
+    grown.devSize = newDevSize;
+    // heads of free lists of groups are placed right before FAT
+    grown.fatOffset = (dataEnd > tablesEnd ? dataEnd : tablesEnd) + getGroupsN(newBlocksN, context)*sizeof(BlockID);
+    defineTablesOffsets(&grown);
+    off_t grownEnd = grown.descrChangesOffset + getDescrChangesSize(context);
+    // migrator doesn't move blocks, while the table of slots is copied
+    lockTiers(context);
+    extendFile(imgFile, grownEnd);
+    for (int i = 1; i < context->membersN; i++) {
+        extendFile(context->members[i], memberBlocks*context->blockSize);
+    }
+    // entries of new blocks are zeroes in the extended file, except of FAT
+    bool success = copyRange(imgFile, context->fatOffset, grown.fatOffset, blocksN*sizeof(BlockID))
+            && copyRange(imgFile, context->storedSizesOffset, grown.storedSizesOffset, blocksN*sizeof(uint32_t))
+            && copyRange(imgFile, context->sharedRefsOffset, grown.sharedRefsOffset, blocksN*sizeof(uint32_t));
+    if (success && (context->flags & IMG_CHECKSUMS)) {
+        success = copyRange(imgFile, context->checksumsOffset, grown.checksumsOffset, blocksN*sizeof(uint32_t));
+    }
+    if (success && context->fastSlotsN > 0) {
+        success = copyRange(imgFile, context->tierTableOffset, grown.tierTableOffset, context->fastSlotsN*sizeof(BlockID));
+    }
+    if (success && context->changes != NULL) {
+        success = copyRange(imgFile, context->blockChangesOffset, grown.blockChangesOffset, getBlockChangesSize(blocksN, context))
+                && copyRange(imgFile, context->descrChangesOffset, grown.descrChangesOffset, getDescrChangesSize(context));
+    }
+    if (!success) {
+        unlockTiers(context);
+        return -2;
+    }
+    // new blocks go in front of free lists of their groups
+    AllocGroup *groups = malloc(grown.groupsN*sizeof(AllocGroup));
+    BlockID *heads = malloc(grown.groupsN*sizeof(BlockID));
+    for (int group = 0; group < grown.groupsN; group++) {
+        pthread_mutex_init(&groups[group].lock, NULL);
+        heads[group] = group < context->groupsN ? context->groups[group].firstFree : -1;
+        groups[group].freeBlocksN = group < context->groupsN ? context->groups[group].freeBlocksN : 0;
+    }
+    chainFreeBlocks(blocksN, newBlocksN, heads, &grown);
+    writeTable(heads, grown.groupsN*sizeof(BlockID), groupHeadOffset(0, &grown), &grown);
+    for (int group = 0; group < grown.groupsN; group++) {
+        groups[group].firstFree = heads[group];
+    }
+    for (BlockID block = blocksN; block < newBlocksN; block++) {
+        groups[groupOf(block, &grown)].freeBlocksN++;
+    }
+    free(heads);
+    fillHeaderIn(&grown);
+    fflush(imgFile);
+    destroyGroups(context->groups, context->groupsN);
+    context->groups = groups;
+    bool grownBefore = context->devSize != context->generationDevSize;
+    context->devSize = grown.devSize;
+    context->fatOffset = grown.fatOffset;
+    defineTablesOffsets(context);
+    growTiers(context->tiers, blocksN, newBlocksN);
+    growChanges(context->changes, blocksN, newBlocksN);
+    if (grownBefore) {
+        markBlocks(context->generationDevSize / context->blockSize, newBlocksN, CHANGED_ENTRIES, context);
+    }
+    unlockTiers(context);
+    return 0;
+}
+
+/** Layout of descriptors in version 1 images: 32-bit sizes and block ids */
+typedef struct {
+    int32_t fdId;
+    FileType type;
+    int32_t size;
+    int32_t nlink;
+    int32_t firstBlock;
+    int32_t occupiedBlocks;
+} FileDescriptorV1;
+
+/** Layout of descriptors in version 2 images: no inline data */
+typedef struct {
+    int fdId;
+    FileType type;
+    int64_t size;
+    int nlink;
+    BlockID firstBlock;
+    int64_t occupiedBlocks;
+} FileDescriptorV2;
+
+/**
+ * Converts image of older version (1 has no magic, 2 has no inline data,
+ * 3 has no descriptor flags and stored sizes of blocks, 4 has no shared
+ * references of blocks) into
+ * image of current version with the same size, block size, flags and maximum number
+ * of files. Block ids are kept, so data region and directories are copied as is.
+ * return: 0 if success, else -1.
+ */
+int upgradeImgFile(char *oldImgPath, char *newImgPath) {
+    FILE *oldFile = fopen(oldImgPath, "rb");
+    if (oldFile == NULL) {
+        return -1;
+    }
+    uint32_t magic = 0, version = 1;
+    fread(&magic, sizeof(uint32_t), 1, oldFile);
+    if (magic == IMG_MAGIC) {
+        fread(&version, sizeof(uint32_t), 1, oldFile);
+    } else {
+        fseeko(oldFile, HEADER_OFFSET, SEEK_SET);
+    }
+    int64_t devSize;
+    int32_t blockSize, maxFileN;
+    fread(&devSize, sizeof(int64_t), 1, oldFile);
+    fread(&blockSize, sizeof(int32_t), 1, oldFile);
+    if (fread(&maxFileN, sizeof(int32_t), 1, oldFile) != 1 || version >= IMG_VERSION
+            || blockSize <= 0 || maxFileN <= 0) {
+        fclose(oldFile);
+        return -1;
+    }
+    uint32_t flags = 0;
+    if (version >= 4) {
+        // 4 keeps flags right after maximum number of files, only compression was known then
+        fread(&flags, sizeof(uint32_t), 1, oldFile);
+        flags &= IMG_COMPRESSED;
+    }
+    off_t oldDescriptorsOffset;
+    size_t oldDescrSize, oldFatEntrySize;
+    if (version == 1) {
+        oldDescriptorsOffset = HEADER_OFFSET + 2*sizeof(int32_t) + sizeof(int64_t);
+        oldDescrSize = sizeof(FileDescriptorV1);
+        oldFatEntrySize = sizeof(int32_t);
+    } else {
+        oldDescriptorsOffset = HEADER_OFFSET + HEADER_SIZE;
+        oldDescrSize = version == 2 ? sizeof(FileDescriptorV2) : sizeof(FileDescriptor);
+        oldFatEntrySize = sizeof(BlockID);
+    }
+    off_t oldFatOffset = oldDescriptorsOffset + (off_t)maxFileN*oldDescrSize + oldFatEntrySize;
+    BlockID blocksN = devSize / blockSize;
+    off_t oldStoredSizesOffset = oldFatOffset + blocksN*oldFatEntrySize;
+    off_t oldDataOffset = oldStoredSizesOffset + (version >= 4 ? blocksN*sizeof(uint32_t) : 0);
+
+    FSContext context;
+    context.imgFile = fopen(newImgPath, "wb+");
+    if (context.imgFile == NULL) {
+        fclose(oldFile);
+        return -1;
+    }
+    context.devSize = devSize;
+    context.blockSize = blockSize;
+    context.maxFileN = maxFileN;
+    context.flags = flags;
+    context.snapshotsFdId = 0;
+    context.root = NULL;
+    context.ioEngine = NULL;
+    context.openFiles = NULL;
+    context.fdGenerations = NULL;
+    context.membersN = 1;
+    context.stripeBlocks = 1;
+    context.members = &context.imgFile;
+    context.fatOffset = 0;
+    context.groupBlocks = 0; // free list of the old image is kept as is
+    context.fastSlotsN = 0;
+    context.tiers = NULL;
+    context.generation = 1;
+    context.generationDevSize = devSize;
+    context.changes = NULL;
+    defineOffsets(&context);
+    grindFile(context.imgFile, getDataEnd(&context));
+    fillHeaderIn(&context);
+
+    FileDescriptorV1 descrV1;
+    FileDescriptorV2 descrV2;
+    FileDescriptor descr;
+    fseeko(oldFile, oldDescriptorsOffset, SEEK_SET);
+    for (int fdId = 0; fdId < maxFileN; fdId++) {
+        memset(&descr, 0, sizeof(FileDescriptor));
+        if (version == 1) {
+            fread(&descrV1, sizeof(FileDescriptorV1), 1, oldFile);
+            descr.type = descrV1.type;
+            descr.size = descrV1.size;
+            descr.nlink = descrV1.nlink;
+            descr.firstBlock = descrV1.firstBlock;
+            descr.occupiedBlocks = descrV1.occupiedBlocks;
+        } else if (version == 2) {
+            fread(&descrV2, sizeof(FileDescriptorV2), 1, oldFile);
+            descr.type = descrV2.type;
+            descr.size = descrV2.size;
+            descr.nlink = descrV2.nlink;
+            descr.firstBlock = descrV2.firstBlock;
+            descr.occupiedBlocks = descrV2.occupiedBlocks;
+        } else {
+            fread(&descr, sizeof(FileDescriptor), 1, oldFile);
+            if (version == 3) {
+                // flags took place of padding, that may be uninitialized
+                descr.flags = 0;
+            }
+        }
+        descr.fdId = fdId;
+        saveDescriptor(&descr, &context);
+    }
+    // free list head and FAT entries
+    int32_t entryV1;
+    BlockID entry;
+    fseeko(oldFile, oldFatOffset - oldFatEntrySize, SEEK_SET);
+    fseeko(context.imgFile, context.fatOffset - sizeof(BlockID), SEEK_SET);
+    for (BlockID i = -1; i < blocksN; i++) {
+        if (version == 1) {
+            fread(&entryV1, sizeof(int32_t), 1, oldFile);
+            entry = entryV1;
+        } else {
+            fread(&entry, sizeof(BlockID), 1, oldFile);
+        }
+        fwrite(&entry, sizeof(BlockID), 1, context.imgFile);
+    }
+    if (version >= 4) {
+        uint32_t storedSize;
+        fseeko(oldFile, oldStoredSizesOffset, SEEK_SET);
+        fseeko(context.imgFile, context.storedSizesOffset, SEEK_SET);
+        for (BlockID i = 0; i < blocksN; i++) {
+            fread(&storedSize, sizeof(uint32_t), 1, oldFile);
+            fwrite(&storedSize, sizeof(uint32_t), 1, context.imgFile);
+        }
+    }
+    void *block = malloc(blockSize);
+    fseeko(oldFile, oldDataOffset, SEEK_SET);
+    fseeko(context.imgFile, context.dataOffset, SEEK_SET);
+    for (BlockID i = 0; i < blocksN; i++) {
+        size_t readSize = fread(block, 1, blockSize, oldFile);
+        if (readSize == 0) {
+            break;
+        }
+        fwrite(block, 1, readSize, context.imgFile);
+    }
+    free(block);
+    fclose(oldFile);
+    fclose(context.imgFile);
+    return 0;
+}
+
 /**
  * Descr must have type, size filled.
+ * No blocks are allocated: contents are kept inline until they outgrow INLINE_DATA_SIZE.
  * return fdId of created descriptor.
- * returning -2 means, that number of descriptors have reached its maximum;
- *           -1 means, that there are no free blocks.
+ * returning -2 means, that number of descriptors have reached its maximum.
  */
 int createDescriptor(FileDescriptor *descr, FSContext *context) {
-    FILE *imgFile = context->imgFile;
+    return createDescriptorFrom(descr, 0, context);
+}
+
+/**
+ * The same as createDescriptor, but free descriptor is searched from firstFdId,
+ * so bulk builders don't rescan descriptors, that they have taken.
+ */
+int createDescriptorFrom(FileDescriptor *descr, int firstFdId, FSContext *context) {
     int maxFileN = context->maxFileN;
-    int fdId = 0;
+    int fdId = firstFdId;
     bool found = false;
-    FileDescriptor *readDescr = malloc(sizeof(FileDescriptor));
-    fseek(imgFile, context->descriptorsOffset, SEEK_SET);
+    FileDescriptor window[DESCR_WINDOW];
     while(fdId < maxFileN && !found) {
-        fread(readDescr, sizeof(FileDescriptor), 1, imgFile);
-        if (readDescr->type == FT_DELETED) {
-            found = true;
-        } else {
-            fdId++;
+        int windowN = maxFileN - fdId < DESCR_WINDOW ? maxFileN - fdId : DESCR_WINDOW;
+        ssize_t readSize = readTable(window, windowN*sizeof(FileDescriptor),
+                context->descriptorsOffset + (off_t)fdId*sizeof(FileDescriptor), context);
+        windowN = readSize > 0 ? readSize / sizeof(FileDescriptor) : 0;
+        if (windowN == 0) {
+            break;
+        }
+        for (int i = 0; i < windowN && !found; i++) {
+            if (window[i].type == FT_DELETED) {
+                found = true;
+            } else {
+                fdId++;
+            }
         }
     }
-    free(readDescr);
-    if (fdId < maxFileN) {
-        BlockID freeBlock = allocateBlock(context);
-        if (freeBlock == -1) {
-            fdId = -1;
-        } else {
-            descr->fdId = fdId;
-            descr->nlink = 0;
-            descr->firstBlock = freeBlock;
-            descr->occupiedBlocks = 1;
-            saveDescriptor(descr, context);
+    if (found) {
+        if (context->fdGenerations != NULL) {
+            context->fdGenerations[fdId]++;
         }
+        descr->fdId = fdId;
+        descr->nlink = 0;
+        descr->firstBlock = -1;
+        descr->occupiedBlocks = 0;
+        descr->flags = (context->flags & IMG_COMPRESSED) ? FD_COMPRESSED : 0;
+        if (descr->type == FT_DIRECTORY) {
+            descr->flags |= FD_COMPACT_DIR;
+        }
+        memset(descr->inlineData, 0, INLINE_DATA_SIZE);
+        saveDescriptor(descr, context);
     } else {
         fdId = -2;
     }
@@ -114,23 +734,43 @@ void removeDescriptor(FileDescriptor *descr, FSContext *context) {
             result = getEntryFrom(NULL, &entry, context);
         }
     }
-    releaseBlocksChain(descr->firstBlock, context);
+    if (descr->occupiedBlocks > 0) {
+        releaseBlocksChain(descr->firstBlock, context);
+    }
     descr->type = FT_DELETED;
     saveDescriptor(descr, context);
 }
 
 void saveDescriptor(FileDescriptor *descr, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    long offset = context->descriptorsOffset + descr->fdId*sizeof(FileDescriptor);
-    fseek(imgFile, offset, SEEK_SET);
-    fwrite(descr, sizeof(FileDescriptor), 1, imgFile);
+    if (descr->fdId == 0 && descr != context->root && context->root != NULL) {
+        memcpy(context->root, descr, sizeof(FileDescriptor));
+    }
+    OpenFile *file = getOpenFile(descr->fdId, context);
+    if (file != NULL) {
+        if (descr != &file->descr) {
+            // chain might be changed without the open file
+            if (descr->type == FT_DELETED || descr->firstBlock != file->descr.firstBlock
+                    || descr->occupiedBlocks != file->descr.occupiedBlocks) {
+                dropBlockMap(file);
+            }
+            memcpy(&file->descr, descr, sizeof(FileDescriptor));
+        }
+        file->dirty = false;
+    }
+    markDescriptor(descr->fdId, context);
+    writeTable(descr, sizeof(FileDescriptor), context->descriptorsOffset + (off_t)descr->fdId*sizeof(FileDescriptor), context);
 }
 
+/** descriptor of open file is taken from memory, it may be newer than the saved one */
 void getDescriptor(FileDescriptor *descr, int fdId, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    long offset = context->descriptorsOffset + fdId*sizeof(FileDescriptor);
-    fseek(imgFile, offset, SEEK_SET);
-    fread(descr, sizeof(FileDescriptor), 1, imgFile);
+    OpenFile *file = getOpenFile(fdId, context);
+    if (file != NULL) {
+        if (descr != &file->descr) {
+            memcpy(descr, &file->descr, sizeof(FileDescriptor));
+        }
+        return;
+    }
+    readTable(descr, sizeof(FileDescriptor), context->descriptorsOffset + (off_t)fdId*sizeof(FileDescriptor), context);
 }
 
 /** 
@@ -138,13 +778,12 @@ void getDescriptor(FileDescriptor *descr, int fdId, FSContext *context) {
  * return: number of descriptors(not including deleted)
  */
 int getAllDescriptors(FileDescriptor **descriptors, FSContext *context) {
-    FILE *imgFile = context->imgFile;
     int maxFileN = context->maxFileN;
     int fdId = 0;
     int N = 0;
-    fseek(imgFile, context->descriptorsOffset, SEEK_SET);
     while (fdId < maxFileN) {
-        fread(descriptors[N], sizeof(FileDescriptor), 1, imgFile);
+        readTable(descriptors[N], sizeof(FileDescriptor), context->descriptorsOffset + (off_t)fdId*sizeof(FileDescriptor),
+                context);
         if (descriptors[N]->type != FT_DELETED) {
             N++;
         }
@@ -153,356 +792,2191 @@ int getAllDescriptors(FileDescriptor **descriptors, FSContext *context) {
     return N;
 }
 
-/** 
- * makes pFirstFree -> 2 -> 3 -> 4 etc.
- * Some of the first blocks will be occupied by header and others. 
+/** files, that were unlinked while they were open, are left by mounts, that weren't unmounted */
+static void releaseOrphans(FSContext *context) {
+    FileDescriptor window[DESCR_WINDOW];
+    for (int first = 0; first < context->maxFileN; first += DESCR_WINDOW) {
+        int windowN = context->maxFileN - first < DESCR_WINDOW ? context->maxFileN - first : DESCR_WINDOW;
+        ssize_t readSize = readTable(window, windowN*sizeof(FileDescriptor),
+                context->descriptorsOffset + (off_t)first*sizeof(FileDescriptor), context);
+        windowN = readSize > 0 ? readSize / sizeof(FileDescriptor) : 0;
+        for (int i = 0; i < windowN; i++) {
+            window[i].fdId = first + i;
+            if (window[i].type != FT_DELETED && (window[i].flags & FD_ORPHANED)) {
+                removeDescriptor(&window[i], context);
+            }
+        }
+    }
+}
+
+/**
+ * Opens file by fdId, all opens of the file share one OpenFile.
+ * Descriptor and block map of open file are kept in memory, so reading and
+ * writing of it don't touch descriptors and FAT until blocks are added.
  */
-static void initFAT(FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    int occupiedBlocks = context->dataOffset / context->blockSize +
-                     (context->dataOffset % context->blockSize) ? 1 : 0;
-    BlockID nextFree = occupiedBlocks;
-    // 
-    fseek(imgFile, context->fatOffset - sizeof(BlockID), SEEK_SET);
-    fwrite(&nextFree, sizeof(BlockID), 1, imgFile);
-    fseek(imgFile, context->fatOffset + nextFree*sizeof(BlockID), SEEK_SET);
-    nextFree++;
-    int blocksN = context->devSize / context->blockSize;
-    for (;nextFree < blocksN; nextFree++) {
-        fwrite(&nextFree, sizeof(BlockID), 1, imgFile);
+OpenFile *openFile(int fdId, FSContext *context) {
+    pthread_mutex_lock(&context->openFilesLock);
+    OpenFile *file = context->openFiles[fdId];
+    if (file == NULL) {
+        file = malloc(sizeof(OpenFile));
+        getDescriptor(&file->descr, fdId, context);
+        file->blockMap = NULL;
+        file->mapCapacity = 0;
+        file->dirty = false;
+        file->refs = 0;
+        context->openFiles[fdId] = file;
     }
-    nextFree = -1;
-    fwrite(&nextFree, sizeof(BlockID), 1, imgFile);
+    file->refs++;
+    pthread_mutex_unlock(&context->openFilesLock);
+    return file;
 }
 
-/** 
- * return: id of allocated block. Changes FAT on the disk.
- *         -1 means, that there are no free blocks
+/** saves descriptor of open file, if it has changed */
+void flushFile(OpenFile *file, FSContext *context) {
+    if (file->dirty) {
+        saveDescriptor(&file->descr, context);
+    }
+}
+
+/**
+ * Flushes file, it's forgotten after its last open is closed. Descriptor and blocks of file,
+ * that has no links anymore, are released then, so its fdId isn't reused while it's open.
  */
-static BlockID allocateBlock(FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    fseek(imgFile, context->fatOffset - sizeof(BlockID), SEEK_SET);
-    BlockID freeBlock;
-    fread(&freeBlock, sizeof(BlockID), 1, imgFile);
-    if (freeBlock != -1) {
-        // fetch freeBlock
-        fseek(imgFile, context->fatOffset + freeBlock*sizeof(BlockID), SEEK_SET);
-        BlockID nextBlock;
-        fread(&nextBlock, sizeof(BlockID), 1, imgFile);
-        fseek(imgFile, context->fatOffset + freeBlock*sizeof(BlockID), SEEK_SET);
-        BlockID endCode = -1;
-        fwrite(&endCode, sizeof(BlockID), 1, imgFile);
-        fseek(imgFile, context->fatOffset - sizeof(BlockID), SEEK_SET);
-        fwrite(&nextBlock, sizeof(BlockID), 1, imgFile);
+void closeFile(OpenFile *file, FSContext *context) {
+    pthread_mutex_lock(&context->openFilesLock);
+    flushFile(file, context);
+    file->refs--;
+    if (file->refs == 0) {
+        context->openFiles[file->descr.fdId] = NULL;
+        if (file->descr.flags & FD_ORPHANED) {
+            removeDescriptor(&file->descr, context);
+        }
+        free(file->blockMap);
+        free(file);
     }
-    return freeBlock;
+    pthread_mutex_unlock(&context->openFilesLock);
 }
 
-/** 
- * Picks free block and grinds it(fills with zeroes).
- * descr must have right firstBlock field.
- * return: id of added block.
- *         -1 means, that there are no free blocks
- * Changes FAT on the disk.
+/**
+ * The same as writeTo, but file grows up to the end of written data.
+ * return: written size(in bytes). 0 means, that there is not enough space or file is deleted
  */
-static BlockID addBlockFor(FileDescriptor *descr, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    BlockID freeBlock = allocateBlock(context);
-    if (freeBlock != -1) {
-        BlockID nextBlock = descr->firstBlock;
-        BlockID currBlock;
-        while (nextBlock != -1) {
-            currBlock = nextBlock;
-            fseek(imgFile, context->fatOffset + currBlock*sizeof(BlockID), SEEK_SET);
-            fread(&nextBlock, sizeof(BlockID), 1, imgFile);
-        }
-        fseek(imgFile, context->fatOffset + currBlock*sizeof(BlockID), SEEK_SET);
-        fwrite(&freeBlock, sizeof(BlockID), 1, imgFile);
-        descr->occupiedBlocks++;
-        saveDescriptor(descr, context);
-        void *zeroes = malloc(context->blockSize);
-        memset(zeroes, 0, context->blockSize);
-        fseek(imgFile, context->dataOffset + freeBlock*context->blockSize, SEEK_SET);
-        fwrite(zeroes, context->blockSize, 1, imgFile);
-        free(zeroes);
+size_t writeToFile(OpenFile *file, const void *buf, size_t size, int64_t offsetInFile, FSContext *context) {
+    if (file->descr.type == FT_DELETED) {
+        return 0;
     }
-    return freeBlock;
+    size_t writtenSize = writeTo(&file->descr, buf, size, offsetInFile, context);
+    if (writtenSize > 0) {
+        extendFileTo(file, offsetInFile + writtenSize);
+    }
+    return writtenSize;
 }
 
-/** 
- * Changes FAT on the disk. If blockN > descr->occupiedBlocks - removes all blocks.
- */
-static void removeBlocksFrom(FileDescriptor *descr, int blockN, FSContext *context) {
-    if (blockN > 0) {
-        if (blockN >= descr->occupiedBlocks) {
-            releaseBlocksChain(descr->firstBlock, context);
-            descr->firstBlock = -1;
-            descr->occupiedBlocks = 0;
+/**
+ * Maps range of the file to runs of raw blocks in backing files, so data may be moved
+ * between them and other fd without copying through user space(ex. by splice).
+ * forWrite allocates missing blocks and unshares blocks of snapshots, but size of the file
+ * isn't changed(see extendFileTo). Range of reading is cut by the end of the file.
+ * extents points to size >= (size/blockSize + 2)*sizeof(FileExtent). Image with fast tier
+ * must hold block locations(see holdBlockLocations), until extents are used.
+ * return: number of extents,
+ *         -1 means, that the range can't be accessed directly: it's inline, compressed or checksummed
+ *         (readFrom and writeToFile are used then);
+ *         -2 means, that there are not enough free blocks(the file stays unchanged then).
+ */
+int64_t mapFileRange(OpenFile *file, int64_t offsetInFile, size_t size, bool forWrite, FileExtent *extents, FSContext *context) {
+    FileDescriptor *descr = &file->descr;
+    if (descr->type == FT_DELETED || (context->flags & IMG_CHECKSUMS)
+            || (forWrite && (descr->flags & FD_COMPRESSED))) {
+        return -1;
+    }
+    if (!forWrite) {
+        if (offsetInFile >= descr->size) {
+            return 0;
+        }
+        if (offsetInFile + (int64_t)size > descr->size) {
+            size = descr->size - offsetInFile;
+        }
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if (descr->occupiedBlocks == 0 && (!forWrite || offsetInFile + size <= INLINE_DATA_SIZE)) {
+        return -1;
+    }
+    int64_t blockIndex = offsetInFile / context->blockSize;
+    int64_t lastBlockIndex = (offsetInFile + size - 1) / context->blockSize;
+    int64_t blocksToAdd = lastBlockIndex - descr->occupiedBlocks + 1;
+    if ((blocksToAdd > 0 && !forWrite) || getMappedFile(descr, context) == NULL) {
+        return -1;
+    }
+    for (int64_t index = blockIndex; index <= lastBlockIndex && index < descr->occupiedBlocks; index++) {
+        if (getStoredSize(file->blockMap[index], context) != 0) {
+            return -1;
+        }
+    }
+    if (forWrite && countNeededBlocks(descr, blockIndex, lastBlockIndex, context) > numberOfFreeBlocks(context)) {
+        return -2;
+    }
+    for (int64_t i = 0; i < blocksToAdd; i++) {
+        if (addBlockFor(descr, context) == -1) {
+            return -2;
+        }
+    }
+    int offsetInBlock = offsetInFile % context->blockSize;
+    int64_t extentsN = 0;
+    for (int64_t index = blockIndex; index <= lastBlockIndex; index++) {
+        BlockID block = file->blockMap[index];
+        if (forWrite) {
+            block = unshareBlock(descr, index, index > 0 ? file->blockMap[index - 1] : -1, block, context);
+            if (block == -1) {
+                return -2;
+            }
+            markBlock(block, CHANGED_DATA, context);
+        }
+        size_t portion = context->blockSize - offsetInBlock < size ? context->blockSize - offsetInBlock : size;
+        int fd;
+        off_t offset = locateBlock(block, &fd, context) + offsetInBlock;
+        noteAccess(block, false, context);
+        FileExtent *last = extentsN > 0 ? &extents[extentsN - 1] : NULL;
+        if (last != NULL && last->fd == fd && last->offset + (off_t)last->size == offset) {
+            last->size += portion;
         } else {
-            FILE *imgFile = context->imgFile;
-            int index = descr->occupiedBlocks - blockN - 1;
-            BlockID block = getBlockInChain(descr->firstBlock, index, context);
-            fseek(imgFile, context->fatOffset + block*sizeof(BlockID), SEEK_SET);
-            BlockID chainToDel;
-            fread(&chainToDel, sizeof(BlockID), 1, imgFile);
-            releaseBlocksChain(chainToDel, context);
-            fseek(imgFile, context->fatOffset + block*sizeof(BlockID), SEEK_SET);
-            BlockID endcode = -1;
-            fwrite(&endcode, sizeof(BlockID), 1, imgFile);
-            descr->occupiedBlocks = descr->occupiedBlocks - blockN;
-            saveDescriptor(descr, context);
-        }
-    }
-} // not tested!!
+            extents[extentsN].fd = fd;
+            extents[extentsN].offset = offset;
+            extents[extentsN].size = portion;
+            extentsN++;
+        }
+        size -= portion;
+        offsetInBlock = 0;
+    }
+    return extentsN;
+}
 
-/** 
- * freeBlocks points to size >= numberOfFreeBlocks*sizeof(BlockID)
- * return: number of free blocks. 
- * Doesn't modify FAT.
+/** size of the file becomes newSize, if it's larger(ex. after writing to mapped range) */
+void extendFileTo(OpenFile *file, int64_t newSize) {
+    if (newSize > file->descr.size) {
+        file->descr.size = newSize;
+        file->dirty = true;
+    }
+}
+
+/**
+ * Appends blocksN blocks to the file at once, they are taken from the group of its last block.
+ * Unlike growth by writes, blocks aren't ground: the caller must overwrite them(ex. bulk builder).
+ * return: number of added blocks, it's less than blocksN if there are not enough free blocks
  */
-int getFreeBlocks(BlockID *freeBlocks, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    fseek(imgFile, context->fatOffset - sizeof(BlockID), SEEK_SET);
-    BlockID nextFree;
-    fread(&nextFree, sizeof(BlockID), 1, imgFile);
-    return getBlocksChain(nextFree, freeBlocks, context);
+int64_t allocateFileBlocks(OpenFile *file, int64_t blocksN, FSContext *context) {
+    return appendBlocks(&file->descr, blocksN, false, context);
 }
 
-/** 
- * return: number of free blocks. 
- * Doesn't modify FAT.
+/**
+ * Allocates blocks of the range at once(see appendBlocks), so later writes don't add them one by one.
+ * Without keepSize file grows up to the end of the range.
+ * return: 0, or -1 if there are not enough free blocks(blocks, that are allocated, stay with the file)
  */
-int numberOfFreeBlocks(FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    fseek(imgFile, context->fatOffset - sizeof(BlockID), SEEK_SET);
-    BlockID nextFree;
-    fread(&nextFree, sizeof(BlockID), 1, imgFile);
-    int number = 0;
-    while (nextFree != -1) {
-        number++;
-        fseek(imgFile, context->fatOffset + nextFree*sizeof(BlockID), SEEK_SET);
-        fread(&nextFree, sizeof(BlockID), 1, imgFile);
+int preallocateFile(OpenFile *file, int64_t offsetInFile, int64_t size, bool keepSize, FSContext *context) {
+    FileDescriptor *descr = &file->descr;
+    int64_t end = offsetInFile + size;
+    int64_t blocksN = (end + context->blockSize - 1) / context->blockSize;
+    if ((descr->occupiedBlocks > 0 || end > INLINE_DATA_SIZE) && blocksN > descr->occupiedBlocks) {
+        int64_t missingN = blocksN - descr->occupiedBlocks;
+        if (appendBlocks(descr, missingN, true, context) < missingN) {
+            return -1;
+        }
     }
-    return number;
+    if (!keepSize) {
+        extendFileTo(file, end);
+    }
+    return 0;
 }
 
 /**
- * Doesn't modify FAT.
- * arr points to size >= descr->occupiedBlocks*sizeof(BlockID)
- * return: number of occupiedBlocks(== descr->occupiedBlocks)
+ * Zeroes range of the file, its size isn't changed. Whole blocks of the range become holes
+ * of backing files(see zeroBlocks), so they don't take space of the disk, but they stay in the chain:
+ * FAT can't skip blocks. Blocks, that are shared with snapshots, are replaced by zeroed copies.
+ * return: 0, or -1 if there are no free blocks for copies of shared blocks
  */
-int getBlocksOf(FileDescriptor *descr, BlockID *blockArr, FSContext *context) {
-    return getBlocksChain(descr->firstBlock, blockArr, context);
+int punchHole(OpenFile *file, int64_t offsetInFile, int64_t size, FSContext *context) {
+    FileDescriptor *descr = &file->descr;
+    int64_t end = offsetInFile + size;
+    int64_t limit = descr->occupiedBlocks > 0 ? descr->occupiedBlocks*context->blockSize : INLINE_DATA_SIZE;
+    if (end > limit) {
+        end = limit;
+    }
+    if (offsetInFile >= end) {
+        return 0;
+    }
+    if (descr->occupiedBlocks == 0) {
+        memset(descr->inlineData + offsetInFile, 0, end - offsetInFile);
+        touchDescriptor(descr, context);
+        return 0;
+    }
+    int64_t firstWhole = (offsetInFile + context->blockSize - 1) / context->blockSize;
+    int64_t lastWhole = end / context->blockSize;
+    const char *zeroes = context->zeroBlock;
+    bool success = true;
+    if (firstWhole >= lastWhole) {
+        // the range lies inside one block or two neighbouring ones
+        for (int64_t offset = offsetInFile; offset < end && success; ) {
+            int64_t portion = (offset / context->blockSize + 1)*context->blockSize - offset;
+            portion = portion < end - offset ? portion : end - offset;
+            success = writeTo(descr, zeroes, portion, offset, context) == portion;
+            offset += portion;
+        }
+        return success ? 0 : -1;
+    }
+    int64_t headSize = firstWhole*context->blockSize - offsetInFile;
+    int64_t tailSize = end - lastWhole*context->blockSize;
+    if (headSize > 0) {
+        success = writeTo(descr, zeroes, headSize, offsetInFile, context) == headSize;
+    }
+    if (tailSize > 0 && success) {
+        success = writeTo(descr, zeroes, tailSize, lastWhole*context->blockSize, context) == tailSize;
+    }
+    OpenFile *mapped = getMappedFile(descr, context);
+    ScratchMark mark = scratchMark();
+    BlockID *holes = scratchAlloc((lastWhole - firstWhole)*sizeof(BlockID));
+    int64_t holesN = 0;
+    for (int64_t i = firstWhole; i < lastWhole && success; i++) {
+        if (context->snapshotsFdId != 0 && getSharedRefs(mapped->blockMap[i], context) > 0) {
+            success = writeTo(descr, zeroes, context->blockSize, i*context->blockSize, context) == context->blockSize;
+        } else {
+            holes[holesN++] = mapped->blockMap[i];
+        }
+    }
+    zeroBlocks(holes, holesN, context);
+    scratchRelease(mark);
+    return success ? 0 : -1;
 }
 
-static void releaseBlocksChain(BlockID startBlock, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    fseek(imgFile, context->fatOffset - sizeof(BlockID), SEEK_SET);
-    BlockID pChain;
-    fread(&pChain, sizeof(BlockID), 1, imgFile);
-    // pFirstFree -> pChain
-    fseek(imgFile, context->fatOffset - sizeof(BlockID), SEEK_SET);
-    fwrite(&startBlock, sizeof(BlockID), 1, imgFile);
-    // now pFirstFree -> startBlock
-    BlockID currBlock;
-    BlockID nextBlock = startBlock;
-    while (nextBlock != -1) {
-        currBlock = nextBlock;
-        fseek(imgFile, context->fatOffset + currBlock*sizeof(BlockID), SEEK_SET);
-        fread(&nextBlock, sizeof(BlockID), 1, imgFile);
+/** flushes the image to the disk. return: 0, or -1 on error */
+int syncContext(FSContext *context) {
+    if (fflush(context->imgFile) != 0) {
+        return -1;
     }
-    fseek(imgFile, context->fatOffset + currBlock*sizeof(BlockID), SEEK_SET);
-    fwrite(&pChain, sizeof(BlockID), 1, imgFile);
-    // now pFirstFree -> startBlock ..... -> pChain
+    for (int i = 0; i < context->membersN; i++) {
+        if (fsync(fileno(context->members[i])) != 0) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-/** return: size of chain(N of blocks) */
-static int getBlocksChain(BlockID startBlock, BlockID *blockArr, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    BlockID *arr = blockArr;
-    BlockID nextFree = startBlock;
-    int blocksN = 0;
-    while (nextFree != -1) {
-        arr[blocksN] = nextFree;
-        blocksN++;
-        fseek(imgFile, context->fatOffset + nextFree*sizeof(BlockID), SEEK_SET);
-        fread(&nextFree, sizeof(BlockID), 1, imgFile);
+static OpenFile *getOpenFile(int fdId, FSContext *context) {
+    if (context->openFiles == NULL || fdId < 0 || fdId >= context->maxFileN) {
+        return NULL;
     }
-    return blocksN;
+    return context->openFiles[fdId];
 }
 
-static BlockID getBlockInChain(BlockID startBlock, int blockIndex, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    BlockID block = startBlock;
-    for (int i = 0; i < blockIndex; i++) {
-            fseek(imgFile, context->fatOffset + block*sizeof(BlockID), SEEK_SET);
-            fread(&block, sizeof(BlockID), 1, imgFile);
+/**
+ * return: open file with loaded block map, if descr is the descriptor of open file,
+ *         otherwise NULL - chain of descr is walked in FAT.
+ */
+static OpenFile *getMappedFile(FileDescriptor *descr, FSContext *context) {
+    OpenFile *file = getOpenFile(descr->fdId, context);
+    if (file == NULL || descr != &file->descr) {
+        return NULL;
+    }
+    if (file->blockMap == NULL) {
+        file->mapCapacity = descr->occupiedBlocks > 0 ? descr->occupiedBlocks : 1;
+        file->blockMap = malloc(file->mapCapacity*sizeof(BlockID));
+        if (descr->occupiedBlocks > 0) {
+            getBlocksChain(descr->firstBlock, file->blockMap, context);
+        }
+    }
+    return file;
+}
+
+static void dropBlockMap(OpenFile *file) {
+    free(file->blockMap);
+    file->blockMap = NULL;
+    file->mapCapacity = 0;
+}
+
+/** descriptor of open file is saved later by flushFile, others are saved at once */
+static void touchDescriptor(FileDescriptor *descr, FSContext *context) {
+    OpenFile *file = getOpenFile(descr->fdId, context);
+    if (file != NULL && descr == &file->descr) {
+        file->dirty = true;
+    } else {
+        saveDescriptor(descr, context);
+    }
+}
+
+/** 
+ * Chains blocks of each group in order and writes heads of free lists in front of FAT.
+ * Some of the first blocks will be occupied by header and others. 
+ */
+static void initFAT(FSContext *context) {
+    BlockID occupiedBlocks = context->dataOffset / context->blockSize +
+                     (context->dataOffset % context->blockSize) ? 1 : 0;
+    BlockID blocksN = context->devSize / context->blockSize;
+    BlockID *heads = malloc(context->groupsN*sizeof(BlockID));
+    for (int group = 0; group < context->groupsN; group++) {
+        heads[group] = -1;
+    }
+    chainFreeBlocks(occupiedBlocks, blocksN, heads, context);
+    writeTable(heads, context->groupsN*sizeof(BlockID), groupHeadOffset(0, context), context);
+    free(heads);
+}
+
+/** 
+ * Takes block from the free list of the group, or of the next ones, if the group is full.
+ * return: id of allocated block. Changes FAT on the disk.
+ *         -1 means, that there are no free blocks
+ */
+static BlockID allocateBlock(int group, FSContext *context) {
+    BlockID freeBlock;
+    if (takeFreeBlocks(group, &freeBlock, 1, context) == 0) {
+        return -1;
+    }
+    setNextBlock(freeBlock, -1, context);
+    return freeBlock;
+}
+
+/**
+ * Takes up to blocksN blocks from free lists starting with the group. FAT entries
+ * of taken blocks aren't changed, they must be linked by the caller.
+ * return: number of taken blocks
+ */
+static int64_t takeFreeBlocks(int group, BlockID *blocks, int64_t blocksN, FSContext *context) {
+    int64_t takenN = 0;
+    for (int i = 0; i < context->groupsN && takenN < blocksN; i++) {
+        int current = (group + i) % context->groupsN;
+        AllocGroup *allocGroup = &context->groups[current];
+        if (allocGroup->freeBlocksN == 0) {
+            // full groups are skipped without locking
+            continue;
+        }
+        FatWindow window = { 0, 0 };
+        pthread_mutex_lock(&allocGroup->lock);
+        while (takenN < blocksN && allocGroup->firstFree != -1) {
+            blocks[takenN++] = allocGroup->firstFree;
+            allocGroup->firstFree = walkChain(&window, allocGroup->firstFree, context);
+            allocGroup->freeBlocksN--;
+        }
+        saveGroupHead(current, context);
+        pthread_mutex_unlock(&allocGroup->lock);
+    }
+    return takenN;
+}
+
+/** Makes chain prevBlock -> blocks[0] -> ... -> tail, FAT is written by runs of neighbouring blocks */
+static void linkBlocks(BlockID prevBlock, BlockID *blocks, int64_t blocksN, BlockID tail, FSContext *context) {
+    BlockID entries[FAT_WINDOW];
+    if (prevBlock != -1) {
+        setNextBlock(prevBlock, blocks[0], context);
+    }
+    int64_t runStart = 0;
+    for (int64_t i = 0; i < blocksN; i++) {
+        bool isLast = i + 1 == blocksN;
+        markBlock(blocks[i], CHANGED_ENTRIES, context);
+        entries[i - runStart] = isLast ? tail : blocks[i + 1];
+        if (isLast || blocks[i + 1] != blocks[i] + 1 || i + 1 - runStart == FAT_WINDOW) {
+            writeTable(entries, (i + 1 - runStart)*sizeof(BlockID),
+                       context->fatOffset + blocks[runStart]*sizeof(BlockID), context);
+            runStart = i + 1;
+        }
+    }
+}
+
+/** 
+ * Picks free block and grinds it(fills with zeroes).
+ * If descr keeps its contents inline, they are moved to the picked block.
+ * descr must have right firstBlock field.
+ * return: id of added block.
+ *         -1 means, that there are no free blocks
+ * Changes FAT on the disk.
+ */
+static BlockID addBlockFor(FileDescriptor *descr, FSContext *context) {
+    OpenFile *file = getMappedFile(descr, context);
+    BlockID lastBlock = -1;
+    if (descr->occupiedBlocks > 0) {
+        lastBlock = file != NULL ? file->blockMap[descr->occupiedBlocks - 1]
+                                 : getBlockInChain(descr->firstBlock, descr->occupiedBlocks - 1, context);
+    }
+    // file grows in the group of its last block, new files are spread over groups
+    int group = lastBlock != -1 ? groupOf(lastBlock, context) : descr->fdId % context->groupsN;
+    BlockID freeBlock = allocateBlock(group, context);
+    if (freeBlock != -1) {
+        ScratchMark mark = scratchMark();
+        char *contents = (char *)context->zeroBlock;
+        if (lastBlock == -1) {
+            descr->firstBlock = freeBlock;
+            contents = scratchAlloc(context->blockSize);
+            memcpy(contents, descr->inlineData, INLINE_DATA_SIZE);
+            memset(contents + INLINE_DATA_SIZE, 0, context->blockSize - INLINE_DATA_SIZE);
+            memset(descr->inlineData, 0, INLINE_DATA_SIZE);
+        } else {
+            setNextBlock(lastBlock, freeBlock, context);
+        }
+        if (file != NULL) {
+            if (descr->occupiedBlocks == file->mapCapacity) {
+                file->mapCapacity *= 2;
+                file->blockMap = realloc(file->blockMap, file->mapCapacity*sizeof(BlockID));
+            }
+            file->blockMap[descr->occupiedBlocks] = freeBlock;
+        }
+        descr->occupiedBlocks++;
+        touchDescriptor(descr, context);
+        transferBlock(IO_WRITE, contents, freeBlock, context);
+        setStoredSize(freeBlock, 0, context);
+        if (context->flags & IMG_CHECKSUMS) {
+            setChecksum(freeBlock, lastBlock == -1 ? crc32c(0, contents, context->blockSize) : context->zeroChecksum,
+                    context);
+        }
+        scratchRelease(mark);
+    }
+    return freeBlock;
+}
+
+/**
+ * Appends blocksN blocks at once, they are taken from the group of the last block and linked
+ * by runs. With zero they read as zeroes(see zeroBlocks), otherwise the caller must overwrite them.
+ * If descr keeps its contents inline, they are moved to the first block.
+ * return: number of added blocks, it's less than blocksN if there are not enough free blocks
+ * Changes FAT on the disk.
+ */
+static int64_t appendBlocks(FileDescriptor *descr, int64_t blocksN, bool zero, FSContext *context) {
+    if (blocksN <= 0) {
+        return 0;
+    }
+    int64_t addedN = 0;
+    if (descr->occupiedBlocks == 0) {
+        if (addBlockFor(descr, context) == -1) {
+            return 0;
+        }
+        addedN++;
+    }
+    OpenFile *file = getMappedFile(descr, context);
+    BlockID lastBlock;
+    BlockID *blocks;
+    ScratchMark mark = scratchMark();
+    if (file != NULL) {
+        if (descr->occupiedBlocks + blocksN - addedN > file->mapCapacity) {
+            file->mapCapacity = descr->occupiedBlocks + blocksN - addedN;
+            file->blockMap = realloc(file->blockMap, file->mapCapacity*sizeof(BlockID));
+        }
+        lastBlock = file->blockMap[descr->occupiedBlocks - 1];
+        blocks = file->blockMap + descr->occupiedBlocks;
+    } else {
+        lastBlock = getBlockInChain(descr->firstBlock, descr->occupiedBlocks - 1, context);
+        blocks = scratchAlloc((blocksN - addedN)*sizeof(BlockID));
+    }
+    int64_t takenN = takeFreeBlocks(groupOf(lastBlock, context), blocks, blocksN - addedN, context);
+    if (takenN > 0) {
+        linkBlocks(lastBlock, blocks, takenN, -1, context);
+        if (zero) {
+            zeroBlocks(blocks, takenN, context);
+        } else {
+            for (int64_t i = 0; i < takenN; i++) {
+                setStoredSize(blocks[i], 0, context);
+            }
+        }
+        descr->occupiedBlocks += takenN;
+        touchDescriptor(descr, context);
+    }
+    scratchRelease(mark);
+    return addedN + takenN;
+}
+
+/**
+ * Blocks read as zeroes afterwards, but nothing is written: runs of blocks, that lie contiguously
+ * in a backing file, become holes there. Zeroes are written, if backing file doesn't support holes.
+ */
+static void zeroBlocks(BlockID *blocks, int64_t blocksN, FSContext *context) {
+    bool checksums = (context->flags & IMG_CHECKSUMS) != 0;
+    for (int64_t i = 0; i < blocksN; i++) {
+        markBlock(blocks[i], CHANGED_DATA, context);
+    }
+    int64_t i = 0;
+    holdBlockLocations(context);
+    while (i < blocksN) {
+        int fd, nextFd;
+        off_t start = locateBlock(blocks[i], &fd, context);
+        int64_t runN = 1;
+        while (i + runN < blocksN && locateBlock(blocks[i + runN], &nextFd, context) == start + runN*context->blockSize
+               && nextFd == fd) {
+            runN++;
+        }
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, runN*context->blockSize) != 0) {
+            for (int64_t j = 0; j < runN; j++) {
+                pwrite(fd, context->zeroBlock, context->blockSize, start + j*context->blockSize);
+            }
+        }
+        for (int64_t j = i; j < i + runN; j++) {
+            setStoredSize(blocks[j], 0, context);
+            if (checksums) {
+                setChecksum(blocks[j], context->zeroChecksum, context);
+            }
+        }
+        i += runN;
+    }
+    releaseBlockLocations(context);
+}
+
+/** 
+ * Cuts blockN last blocks off the file. Blocks of open file are taken from its block map,
+ * chains of others are walked once. If blockN >= descr->occupiedBlocks - removes all blocks.
+ * Changes FAT on the disk.
+ */
+static void removeBlocksFrom(FileDescriptor *descr, int64_t blockN, FSContext *context) {
+    if (blockN <= 0 || descr->occupiedBlocks == 0) {
+        return;
+    }
+    if (blockN > descr->occupiedBlocks) {
+        blockN = descr->occupiedBlocks;
+    }
+    int64_t keptN = descr->occupiedBlocks - blockN;
+    OpenFile *file = getMappedFile(descr, context);
+    BlockID *blocks;
+    ScratchMark mark = scratchMark();
+    if (file != NULL) {
+        blocks = file->blockMap;
+    } else {
+        blocks = scratchAlloc(descr->occupiedBlocks*sizeof(BlockID));
+        getBlocksChain(descr->firstBlock, blocks, context);
+    }
+    if (keptN > 0) {
+        setNextBlock(blocks[keptN - 1], -1, context);
+    }
+    releaseBlocks(blocks + keptN, blockN, context);
+    scratchRelease(mark);
+    descr->occupiedBlocks = keptN;
+    if (keptN == 0) {
+        // file becomes empty and keeps its contents inline again
+        descr->firstBlock = -1;
+        memset(descr->inlineData, 0, INLINE_DATA_SIZE);
+    }
+    touchDescriptor(descr, context);
+}
+
+/** 
+ * freeBlocks points to size >= numberOfFreeBlocks*sizeof(BlockID)
+ * return: number of free blocks. 
+ * Doesn't modify FAT.
+ */
+int64_t getFreeBlocks(BlockID *freeBlocks, FSContext *context) {
+    int64_t number = 0;
+    for (int group = 0; group < context->groupsN; group++) {
+        AllocGroup *allocGroup = &context->groups[group];
+        pthread_mutex_lock(&allocGroup->lock);
+        number += getBlocksChain(allocGroup->firstFree, freeBlocks + number, context);
+        pthread_mutex_unlock(&allocGroup->lock);
+    }
+    return number;
+}
+
+/** 
+ * return: number of free blocks, that groups keep count of. 
+ * Doesn't modify FAT.
+ */
+int64_t numberOfFreeBlocks(FSContext *context) {
+    int64_t number = 0;
+    for (int group = 0; group < context->groupsN; group++) {
+        AllocGroup *allocGroup = &context->groups[group];
+        pthread_mutex_lock(&allocGroup->lock);
+        number += allocGroup->freeBlocksN;
+        pthread_mutex_unlock(&allocGroup->lock);
+    }
+    return number;
+}
+
+/**
+ * Doesn't modify FAT.
+ * arr points to size >= descr->occupiedBlocks*sizeof(BlockID)
+ * return: number of occupiedBlocks(== descr->occupiedBlocks)
+ */
+int64_t getBlocksOf(FileDescriptor *descr, BlockID *blockArr, FSContext *context) {
+    return getBlocksChain(descr->firstBlock, blockArr, context);
+}
+
+/**
+ * Locates blocks of the file with their stored sizes and checksums. Locations stay valid,
+ * while the image isn't changed and blocks aren't migrated(ex. read-only image).
+ * blocks points to size >= descr->occupiedBlocks*sizeof(StoredBlock)
+ * return: number of blocks
+ */
+int64_t locateFileBlocks(FileDescriptor *descr, StoredBlock *blocks, FSContext *context) {
+    BlockID *ids = malloc((descr->occupiedBlocks > 0 ? descr->occupiedBlocks : 1)*sizeof(BlockID));
+    int64_t blocksN = getBlocksOf(descr, ids, context);
+    holdBlockLocations(context);
+    for (int64_t i = 0; i < blocksN; i++) {
+        blocks[i].offset = locateBlock(ids[i], &blocks[i].fd, context);
+        blocks[i].storedSize = getStoredSize(ids[i], context);
+        blocks[i].checksum = (context->flags & IMG_CHECKSUMS) ? getChecksum(ids[i], context) : 0;
+    }
+    releaseBlockLocations(context);
+    free(ids);
+    return blocksN;
+}
+
+/** 
+ * Frees blocks of the chain. Blocks, that are shared with snapshots, just lose one reference.
+ * Changes FAT on the disk.
+ */
+static void releaseBlocksChain(BlockID startBlock, FSContext *context) {
+    FatWindow window = { 0, 0 };
+    BlockID currBlock;
+    BlockID nextBlock = startBlock;
+    while (nextBlock != -1) {
+        currBlock = nextBlock;
+        // entry of the released block is overwritten, next ones stay valid in the window
+        nextBlock = walkChain(&window, currBlock, context);
+        releaseBlock(currBlock, context);
+    }
+}
+
+/** 
+ * Drops one reference to the block. Block, that has no references anymore,
+ * is pushed to the free list of its group.
+ */
+static void releaseBlock(BlockID block, FSContext *context) {
+    uint32_t refs = getSharedRefs(block, context);
+    if (refs > 0) {
+        setSharedRefs(block, refs - 1, context);
+    } else {
+        // heat of the file, that released the block, mustn't promote it for the next one
+        if (context->tiers != NULL) {
+            setHeat(block, 0, context->tiers);
+        }
+        int group = groupOf(block, context);
+        AllocGroup *allocGroup = &context->groups[group];
+        pthread_mutex_lock(&allocGroup->lock);
+        setNextBlock(block, allocGroup->firstFree, context);
+        allocGroup->firstFree = block;
+        allocGroup->freeBlocksN++;
+        saveGroupHead(group, context);
+        pthread_mutex_unlock(&allocGroup->lock);
+    }
+}
+
+/**
+ * Releases blocks, that are known without walking FAT(ex. tail of block map). Free blocks
+ * of a group are linked in order and spliced in front of its free list at once.
+ */
+static void releaseBlocks(BlockID *blocks, int64_t blocksN, FSContext *context) {
+    ScratchMark mark = scratchMark();
+    BlockID *freed = scratchAlloc(blocksN*sizeof(BlockID));
+    int64_t freedN = 0;
+    for (int64_t i = 0; i < blocksN; i++) {
+        // blocks are shared only since the first snapshot
+        uint32_t refs = context->snapshotsFdId != 0 ? getSharedRefs(blocks[i], context) : 0;
+        if (refs > 0) {
+            setSharedRefs(blocks[i], refs - 1, context);
+        } else {
+            freed[freedN++] = blocks[i];
+            if (context->tiers != NULL) {
+                setHeat(blocks[i], 0, context->tiers);
+            }
+        }
+    }
+    int64_t runStart = 0;
+    while (runStart < freedN) {
+        int group = groupOf(freed[runStart], context);
+        int64_t runN = 1;
+        while (runStart + runN < freedN && groupOf(freed[runStart + runN], context) == group) {
+            runN++;
+        }
+        AllocGroup *allocGroup = &context->groups[group];
+        pthread_mutex_lock(&allocGroup->lock);
+        linkBlocks(-1, freed + runStart, runN, allocGroup->firstFree, context);
+        allocGroup->firstFree = freed[runStart];
+        allocGroup->freeBlocksN += runN;
+        saveGroupHead(group, context);
+        pthread_mutex_unlock(&allocGroup->lock);
+        runStart += runN;
+    }
+    scratchRelease(mark);
+}
+
+/** return: size of chain(N of blocks) */
+static int64_t getBlocksChain(BlockID startBlock, BlockID *blockArr, FSContext *context) {
+    FatWindow window = { 0, 0 };
+    BlockID *arr = blockArr;
+    BlockID nextFree = startBlock;
+    int64_t blocksN = 0;
+    while (nextFree != -1) {
+        arr[blocksN] = nextFree;
+        blocksN++;
+        nextFree = walkChain(&window, nextFree, context);
+    }
+    return blocksN;
+}
+
+static BlockID getBlockInChain(BlockID startBlock, int64_t blockIndex, FSContext *context) {
+    FatWindow window = { 0, 0 };
+    BlockID block = startBlock;
+    for (int64_t i = 0; i < blockIndex; i++) {
+            block = walkChain(&window, block, context);
+    }
+    return block;
+}
+
+/**
+ * Descriptors, FAT and per-block tables are read and written bypassing stdio buffers, so requests,
+ * that run concurrently(ex. workers of pack), don't share position and buffer of imgFile.
+ * They are metadata for the engine: they go ahead of waiting batches of file data.
+ */
+static ssize_t readTable(void *buf, size_t size, off_t offset, FSContext *context) {
+    int64_t submitted = admitIO(context->ioEngine, IO_META);
+    ssize_t result = pread(fileno(context->imgFile), buf, size, offset);
+    completeIO(context->ioEngine, IO_META, submitted);
+    return result;
+}
+
+static ssize_t writeTable(const void *buf, size_t size, off_t offset, FSContext *context) {
+    int64_t submitted = admitIO(context->ioEngine, IO_META);
+    ssize_t result = pwrite(fileno(context->imgFile), buf, size, offset);
+    completeIO(context->ioEngine, IO_META, submitted);
+    return result;
+}
+
+/** FAT entries are read and written bypassing stdio buffers, so groups may change them concurrently */
+static BlockID getNextBlock(BlockID block, FSContext *context) {
+    BlockID nextBlock;
+    readTable(&nextBlock, sizeof(BlockID), context->fatOffset + block*sizeof(BlockID), context);
+    return nextBlock;
+}
+
+static void setNextBlock(BlockID block, BlockID nextBlock, FSContext *context) {
+    markBlock(block, CHANGED_ENTRIES, context);
+    writeTable(&nextBlock, sizeof(BlockID), context->fatOffset + block*sizeof(BlockID), context);
+}
+
+/** return: next block of the chain, FAT is read by windows of FAT_WINDOW entries */
+static BlockID walkChain(FatWindow *window, BlockID block, FSContext *context) {
+    if (block < window->first || block >= window->first + window->entriesN) {
+        BlockID blocksN = context->devSize / context->blockSize;
+        int64_t entriesN = blocksN - block < FAT_WINDOW ? blocksN - block : FAT_WINDOW;
+        ssize_t readSize = readTable(window->entries, entriesN*sizeof(BlockID),
+                                     context->fatOffset + block*sizeof(BlockID), context);
+        window->first = block;
+        window->entriesN = readSize > 0 ? readSize / sizeof(BlockID) : 0;
+        if (window->entriesN == 0) {
+            return -1;
+        }
+    }
+    return window->entries[block - window->first];
+}
+
+/**
+ * Links blocks [from, to) of layout into free lists of their groups: blocks of a group go in order
+ * in front of its list. heads are indexed by groups, they get new heads of the lists.
+ */
+static void chainFreeBlocks(BlockID from, BlockID to, BlockID *heads, FSContext *layout) {
+    int64_t chunkN = COPY_CHUNK / sizeof(BlockID);
+    BlockID *entries = malloc(COPY_CHUNK);
+    for (BlockID first = from; first < to; first += chunkN) {
+        int64_t entriesN = to - first < chunkN ? to - first : chunkN;
+        for (int64_t i = 0; i < entriesN; i++) {
+            BlockID block = first + i;
+            int group = groupOf(block, layout);
+            entries[i] = block + 1 < to && groupOf(block + 1, layout) == group ? block + 1 : heads[group];
+        }
+        writeTable(entries, entriesN*sizeof(BlockID), layout->fatOffset + first*sizeof(BlockID), layout);
+    }
+    free(entries);
+    for (BlockID block = to - 1; block >= from; block--) {
+        heads[groupOf(block, layout)] = block;
+    }
+}
+
+/** return: number of allocation groups of image, that has blocksN blocks */
+static int getGroupsN(BlockID blocksN, FSContext *context) {
+    return context->groupBlocks > 0 ? (blocksN + context->groupBlocks - 1) / context->groupBlocks : 1;
+}
+
+static int groupOf(BlockID block, FSContext *context) {
+    return context->groupBlocks > 0 ? block / context->groupBlocks : 0;
+}
+
+/** heads of free lists are kept right before FAT, the last one is at fatOffset - sizeof(BlockID) */
+static off_t groupHeadOffset(int group, FSContext *context) {
+    return context->fatOffset - (off_t)(context->groupsN - group)*sizeof(BlockID);
+}
+
+/** group must be locked */
+static void saveGroupHead(int group, FSContext *context) {
+    writeTable(&context->groups[group].firstFree, sizeof(BlockID), groupHeadOffset(group, context), context);
+}
+
+/** Reads heads of free lists and counts free blocks of each group */
+static void loadGroups(FSContext *context) {
+    FatWindow window = { 0, 0 };
+    context->groups = malloc(context->groupsN*sizeof(AllocGroup));
+    for (int group = 0; group < context->groupsN; group++) {
+        AllocGroup *allocGroup = &context->groups[group];
+        pthread_mutex_init(&allocGroup->lock, NULL);
+        readTable(&allocGroup->firstFree, sizeof(BlockID), groupHeadOffset(group, context), context);
+        allocGroup->freeBlocksN = 0;
+        for (BlockID block = allocGroup->firstFree; block != -1; block = walkChain(&window, block, context)) {
+            allocGroup->freeBlocksN++;
+        }
+    }
+}
+
+static void destroyGroups(AllocGroup *groups, int groupsN) {
+    for (int group = 0; group < groupsN; group++) {
+        pthread_mutex_destroy(&groups[group].lock);
+    }
+    free(groups);
+}
+
+/** Slots of the fast tier are read from its table, blocks kept there on close are found there again */
+static void loadTiers(FSContext *context) {
+    context->tiers = NULL;
+    if (context->fastSlotsN == 0) {
+        return;
+    }
+    BlockID blocksN = context->devSize / context->blockSize;
+    TierMap *tiers = calloc(1, sizeof(TierMap));
+    tiers->slotsN = context->fastSlotsN;
+    tiers->slotBlocks = malloc(tiers->slotsN*sizeof(BlockID));
+    tiers->blockSlots = malloc(blocksN*sizeof(int32_t));
+    tiers->heat = calloc(blocksN, sizeof(uint8_t));
+    tiers->candidates = malloc(MAX_CANDIDATES*sizeof(BlockID));
+    for (BlockID block = 0; block < blocksN; block++) {
+        tiers->blockSlots[block] = -1;
+    }
+    pread(fileno(context->imgFile), tiers->slotBlocks, tiers->slotsN*sizeof(BlockID), context->tierTableOffset);
+    for (int64_t slot = 0; slot < tiers->slotsN; slot++) {
+        BlockID block = tiers->slotBlocks[slot] - 1;
+        if (block >= 0 && block < blocksN) {
+            tiers->blockSlots[block] = slot;
+        } else {
+            block = -1;
+            tiers->freeSlotsN++;
+        }
+        tiers->slotBlocks[slot] = block;
+    }
+    pthread_mutex_init(&tiers->candidatesLock, NULL);
+    // readers are preferred(default of glibc), so I/O inside held locations doesn't wait for the migrator
+    pthread_rwlock_init(&tiers->lock, NULL);
+    pthread_mutex_init(&tiers->stopLock, NULL);
+    pthread_cond_init(&tiers->stopCond, NULL);
+    context->tiers = tiers;
+}
+
+/** new blocks are kept by the slow tier */
+static void growTiers(TierMap *tiers, BlockID blocksN, BlockID newBlocksN) {
+    if (tiers == NULL) {
+        return;
+    }
+    tiers->blockSlots = realloc(tiers->blockSlots, newBlocksN*sizeof(int32_t));
+    tiers->heat = realloc(tiers->heat, newBlocksN*sizeof(uint8_t));
+    for (BlockID block = blocksN; block < newBlocksN; block++) {
+        tiers->blockSlots[block] = -1;
+        tiers->heat[block] = 0;
+    }
+}
+
+static void destroyTiers(TierMap *tiers) {
+    if (tiers == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&tiers->candidatesLock);
+    pthread_rwlock_destroy(&tiers->lock);
+    pthread_mutex_destroy(&tiers->stopLock);
+    pthread_cond_destroy(&tiers->stopCond);
+    free(tiers->candidates);
+    free(tiers->heat);
+    free(tiers->blockSlots);
+    free(tiers->slotBlocks);
+    free(tiers);
+}
+
+/**
+ * Locations of blocks don't change, while they are held: the migrator waits.
+ * Holds may be nested by one thread. There is nothing to hold without fast tier.
+ */
+void holdBlockLocations(FSContext *context) {
+    if (context->tiers != NULL) {
+        pthread_rwlock_rdlock(&context->tiers->lock);
+    }
+}
+
+void releaseBlockLocations(FSContext *context) {
+    if (context->tiers != NULL) {
+        pthread_rwlock_unlock(&context->tiers->lock);
+    }
+}
+
+/** blocks are moved and tables of tiers are changed, while they are locked */
+static void lockTiers(FSContext *context) {
+    if (context->tiers != NULL) {
+        pthread_rwlock_wrlock(&context->tiers->lock);
+    }
+}
+
+static void unlockTiers(FSContext *context) {
+    if (context->tiers != NULL) {
+        pthread_rwlock_unlock(&context->tiers->lock);
+    }
+}
+
+/**
+ * Counts access to the block by readFrom/writeTo. Block becomes candidate for the fast tier, when it's
+ * accessed PROMOTE_HEAT times between decays, blocks of directories become candidates at once.
+ * Counts aren't locked: lost ones only delay migration.
+ */
+static void noteAccess(BlockID block, bool pinned, FSContext *context) {
+    TierMap *tiers = context->tiers;
+    if (tiers == NULL) {
+        return;
+    }
+    uint8_t heat = getHeat(block, tiers);
+    uint8_t newHeat = ((heat & HEAT_COUNT) < HEAT_COUNT ? heat + 1 : heat) | (pinned ? HEAT_PINNED : 0);
+    setHeat(block, newHeat, tiers);
+    if ((newHeat & HEAT_COUNT) == PROMOTE_HEAT || ((newHeat & ~heat) & HEAT_PINNED)) {
+        pthread_mutex_lock(&tiers->candidatesLock);
+        if (tiers->candidatesN < MAX_CANDIDATES) {
+            tiers->candidates[tiers->candidatesN++] = block;
+        }
+        pthread_mutex_unlock(&tiers->candidatesLock);
+    }
+}
+
+/** counts are changed without locks by requests and the migrator */
+static uint8_t getHeat(BlockID block, TierMap *tiers) {
+    return __atomic_load_n(&tiers->heat[block], __ATOMIC_RELAXED);
+}
+
+static void setHeat(BlockID block, uint8_t heat, TierMap *tiers) {
+    __atomic_store_n(&tiers->heat[block], heat, __ATOMIC_RELAXED);
+}
+
+/**
+ * One pass of migration: candidates, that are kept by the slow tier yet, take free slots or slots
+ * of cold blocks, which go back to their stripes. Counts of accesses are halved afterwards.
+ * return: number of blocks, that are moved to the fast tier
+ */
+int64_t migrateBlocks(FSContext *context) {
+    TierMap *tiers = context->tiers;
+    if (tiers == NULL) {
+        return 0;
+    }
+    ScratchMark mark = scratchMark();
+    BlockID *candidates = scratchAlloc(MAX_CANDIDATES*sizeof(BlockID));
+    pthread_mutex_lock(&tiers->candidatesLock);
+    int candidatesN = tiers->candidatesN;
+    memcpy(candidates, tiers->candidates, candidatesN*sizeof(BlockID));
+    tiers->candidatesN = 0;
+    pthread_mutex_unlock(&tiers->candidatesLock);
+    int64_t movedN = 0;
+    bool full = false;
+    for (int i = 0; i < candidatesN && !full; i++) {
+        // requests wait only for the move of one block
+        lockTiers(context);
+        BlockID block = candidates[i];
+        uint8_t heat = getHeat(block, tiers);
+        // freed blocks lose their counts
+        if (tiers->blockSlots[block] == -1 && heat != 0) {
+            int64_t slot = pickSlot((heat & HEAT_PINNED) != 0, context);
+            if (slot == -1) {
+                full = true;
+            } else if (moveBlock(block, slot, context)) {
+                movedN++;
+            }
+        }
+        unlockTiers(context);
+    }
+    holdBlockLocations(context);
+    BlockID blocksN = context->devSize / context->blockSize;
+    for (BlockID block = 0; block < blocksN; block++) {
+        uint8_t heat = getHeat(block, tiers);
+        setHeat(block, (heat & HEAT_PINNED) | ((heat & HEAT_COUNT) >> 1), tiers);
+    }
+    releaseBlockLocations(context);
+    scratchRelease(mark);
+    return movedN;
+}
+
+/**
+ * Free slots are taken first. Then slots are swept like by CLOCK: count of the block in the slot
+ * is halved, the first cold block gives up its slot. Blocks of directories give up slots
+ * only to other directories. Tiers must be locked.
+ * return: slot, or -1 if all blocks of the fast tier are hot
+ */
+static int64_t pickSlot(bool pinned, FSContext *context) {
+    TierMap *tiers = context->tiers;
+    for (int64_t step = 0; step < 2*tiers->slotsN; step++) {
+        int64_t slot = tiers->clockHand;
+        tiers->clockHand = (slot + 1) % tiers->slotsN;
+        BlockID block = tiers->slotBlocks[slot];
+        if (block == -1 && tiers->freeSlotsN > 0) {
+            return slot;
+        }
+        if (tiers->freeSlotsN > 0 || block == -1) {
+            continue;
+        }
+        uint8_t heat = getHeat(block, tiers);
+        if ((heat & HEAT_PINNED) && !pinned) {
+            continue;
+        }
+        if ((heat & HEAT_COUNT) == 0) {
+            return slot;
+        }
+        setHeat(block, (heat & HEAT_PINNED) | ((heat & HEAT_COUNT) >> 1), tiers);
+    }
+    return -1;
+}
+
+/**
+ * Copies a block between tiers through the engine, so migration waits behind metadata as other data does.
+ * return: true if success
+ */
+static bool copyBlockData(int fromFd, off_t from, int toFd, off_t to, char *data, FSContext *context) {
+    BlockIO io;
+    io.type = IO_READ;
+    io.fd = fromFd;
+    io.offset = from;
+    io.buf = data;
+    io.size = context->blockSize;
+    if (submitIO(context->ioEngine, &io, 1, IO_DATA) != 0) {
+        return false;
+    }
+    io.type = IO_WRITE;
+    io.fd = toFd;
+    io.offset = to;
+    return submitIO(context->ioEngine, &io, 1, IO_DATA) == 0;
+}
+
+/**
+ * Moves block into the slot, block, that the slot keeps, goes back to its stripe first.
+ * Data is copied before the table of slots is changed, so the table on the disk is always right.
+ * Tiers must be locked.
+ * return: true if success
+ */
+static bool moveBlock(BlockID block, int64_t slot, FSContext *context) {
+    TierMap *tiers = context->tiers;
+    int blockSize = context->blockSize;
+    int fastFd = fileno(context->imgFile);
+    off_t slotOffset = context->dataOffset + slot*(off_t)blockSize;
+    off_t entryOffset = context->tierTableOffset + slot*sizeof(BlockID);
+    ScratchMark mark = scratchMark();
+    char *data = scratchAlloc(blockSize);
+    int fd;
+    off_t offset;
+    bool success = true;
+    BlockID evicted = tiers->slotBlocks[slot];
+    if (evicted != -1) {
+        BlockID entry = 0;
+        offset = locateHome(evicted, &fd, context);
+        success = copyBlockData(fastFd, slotOffset, fd, offset, data, context)
+                && writeTable(&entry, sizeof(BlockID), entryOffset, context) == sizeof(BlockID);
+        if (success) {
+            tiers->slotBlocks[slot] = -1;
+            tiers->blockSlots[evicted] = -1;
+            tiers->freeSlotsN++;
+        }
+    }
+    if (success) {
+        BlockID entry = block + 1;
+        offset = locateHome(block, &fd, context);
+        success = copyBlockData(fd, offset, fastFd, slotOffset, data, context)
+                && writeTable(&entry, sizeof(BlockID), entryOffset, context) == sizeof(BlockID);
+        if (success) {
+            tiers->slotBlocks[slot] = block;
+            tiers->blockSlots[block] = slot;
+            tiers->freeSlotsN--;
+        }
+    }
+    scratchRelease(mark);
+    return success;
+}
+
+/** migrateBlocks is run every intervalMs, until stopMigrator */
+static void *runMigrator(void *arg) {
+    FSContext *context = arg;
+    TierMap *tiers = context->tiers;
+    pthread_mutex_lock(&tiers->stopLock);
+    while (!tiers->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += tiers->intervalMs / 1000;
+        deadline.tv_nsec += (long)(tiers->intervalMs % 1000)*1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&tiers->stopCond, &tiers->stopLock, &deadline);
+        if (!tiers->stopping) {
+            pthread_mutex_unlock(&tiers->stopLock);
+            migrateBlocks(context);
+            pthread_mutex_lock(&tiers->stopLock);
+        }
+    }
+    pthread_mutex_unlock(&tiers->stopLock);
+    return NULL;
+}
+
+/** Starts background migration of blocks between tiers, image without fast tier has nothing to migrate */
+void startMigrator(FSContext *context, int intervalMs) {
+    TierMap *tiers = context->tiers;
+    if (tiers == NULL || tiers->migratorRunning) {
+        return;
+    }
+    tiers->intervalMs = intervalMs > 0 ? intervalMs : 1;
+    tiers->stopping = false;
+    tiers->migratorRunning = pthread_create(&tiers->migrator, NULL, runMigrator, context) == 0;
+}
+
+/** waits for the current pass of migration */
+void stopMigrator(FSContext *context) {
+    TierMap *tiers = context->tiers;
+    if (tiers == NULL || !tiers->migratorRunning) {
+        return;
+    }
+    pthread_mutex_lock(&tiers->stopLock);
+    tiers->stopping = true;
+    pthread_cond_signal(&tiers->stopCond);
+    pthread_mutex_unlock(&tiers->stopLock);
+    pthread_join(tiers->migrator, NULL);
+    tiers->migratorRunning = false;
+}
+
+/** return: number of blocks, that are kept by the fast tier */
+int64_t numberOfFastBlocks(FSContext *context) {
+    TierMap *tiers = context->tiers;
+    return tiers != NULL ? tiers->slotsN - tiers->freeSlotsN : 0;
+}
+
+/** Bits of changes are read from their tables, image, that doesn't track changes, has no bits */
+static void loadChanges(FSContext *context) {
+    context->changes = NULL;
+    if (context->generation == 0) {
+        return;
+    }
+    BlockID blocksN = context->devSize / context->blockSize;
+    off_t blockBytes = getBlockChangesSize(blocksN, context);
+    off_t descrBytes = getDescrChangesSize(context);
+    ChangeMap *changes = malloc(sizeof(ChangeMap));
+    changes->blockBits = calloc(blockBytes, 1);
+    changes->descrBits = calloc(descrBytes, 1);
+    pread(fileno(context->imgFile), changes->blockBits, blockBytes, context->blockChangesOffset);
+    pread(fileno(context->imgFile), changes->descrBits, descrBytes, context->descrChangesOffset);
+    pthread_mutex_init(&changes->lock, NULL);
+    context->changes = changes;
+}
+
+/** new blocks have no changes */
+static void growChanges(ChangeMap *changes, BlockID blocksN, BlockID newBlocksN) {
+    if (changes == NULL) {
+        return;
+    }
+    int64_t bytesN = (blocksN + BLOCKS_PER_BYTE - 1) / BLOCKS_PER_BYTE;
+    int64_t newBytesN = (newBlocksN + BLOCKS_PER_BYTE - 1) / BLOCKS_PER_BYTE;
+    changes->blockBits = realloc(changes->blockBits, newBytesN);
+    memset(changes->blockBits + bytesN, 0, newBytesN - bytesN);
+}
+
+static void destroyChanges(ChangeMap *changes) {
+    if (changes == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&changes->lock);
+    free(changes->blockBits);
+    free(changes->descrBits);
+    free(changes);
+}
+
+/**
+ * bits are CHANGED_ENTRIES and/or CHANGED_DATA. They are saved before the change is written,
+ * so changes, that are interrupted by crash, are exported too. Bits, that are set already,
+ * aren't saved again: blocks, that are written often, cost nothing.
+ */
+static void markBlock(BlockID block, int bits, FSContext *context) {
+    ChangeMap *changes = context->changes;
+    if (changes == NULL) {
+        return;
+    }
+    int64_t index = block / BLOCKS_PER_BYTE;
+    uint8_t mask = bits << (block % BLOCKS_PER_BYTE * CHANGE_BITS);
+    if ((__atomic_load_n(&changes->blockBits[index], __ATOMIC_RELAXED) & mask) != mask) {
+        __atomic_fetch_or(&changes->blockBits[index], mask, __ATOMIC_RELAXED);
+        saveChangeBits(changes->blockBits, index, context->blockChangesOffset, context);
+    }
+}
+
+/** the same as markBlock for blocks [from, to), they are marked, when there are no concurrent writers(growth, snapshot) */
+static void markBlocks(BlockID from, BlockID to, int bits, FSContext *context) {
+    ChangeMap *changes = context->changes;
+    if (changes == NULL || from >= to) {
+        return;
+    }
+    for (BlockID block = from; block < to; block++) {
+        changes->blockBits[block / BLOCKS_PER_BYTE] |= bits << (block % BLOCKS_PER_BYTE * CHANGE_BITS);
+    }
+    int64_t first = from / BLOCKS_PER_BYTE;
+    int64_t last = (to - 1) / BLOCKS_PER_BYTE;
+    pwrite(fileno(context->imgFile), changes->blockBits + first, last - first + 1, context->blockChangesOffset + first);
+}
+
+static void markDescriptor(int fdId, FSContext *context) {
+    ChangeMap *changes = context->changes;
+    if (changes == NULL) {
+        return;
+    }
+    uint8_t mask = 1 << (fdId % 8);
+    if ((__atomic_load_n(&changes->descrBits[fdId / 8], __ATOMIC_RELAXED) & mask) == 0) {
+        __atomic_fetch_or(&changes->descrBits[fdId / 8], mask, __ATOMIC_RELAXED);
+        saveChangeBits(changes->descrBits, fdId / 8, context->descrChangesOffset, context);
+    }
+}
+
+/** byte of bits is read under the lock, so the byte, that is saved last, has all bits, that are set concurrently */
+static void saveChangeBits(uint8_t *bits, int64_t index, off_t tableOffset, FSContext *context) {
+    pthread_mutex_lock(&context->changes->lock);
+    uint8_t byte = __atomic_load_n(&bits[index], __ATOMIC_RELAXED);
+    pwrite(fileno(context->imgFile), &byte, 1, tableOffset + index);
+    pthread_mutex_unlock(&context->changes->lock);
+}
+
+/** drops all changes and saves the header, image stays at generation until the next export */
+static void beginGeneration(int64_t generation, FSContext *context) {
+    ChangeMap *changes = context->changes;
+    off_t blockBytes = getBlockChangesSize(context->devSize / context->blockSize, context);
+    off_t descrBytes = getDescrChangesSize(context);
+    memset(changes->blockBits, 0, blockBytes);
+    memset(changes->descrBits, 0, descrBytes);
+    pwrite(fileno(context->imgFile), changes->blockBits, blockBytes, context->blockChangesOffset);
+    pwrite(fileno(context->imgFile), changes->descrBits, descrBytes, context->descrChangesOffset);
+    context->generation = generation;
+    context->generationDevSize = context->devSize;
+    fillHeaderIn(context);
+}
+
+/** return: size of table of changed blocks, when image has blocksN blocks. 0 if changes aren't tracked */
+static off_t getBlockChangesSize(BlockID blocksN, FSContext *context) {
+    return context->generation > 0 ? (blocksN + BLOCKS_PER_BYTE - 1) / BLOCKS_PER_BYTE : 0;
+}
+
+static off_t getDescrChangesSize(FSContext *context) {
+    return context->generation > 0 ? (context->maxFileN + 7) / 8 : 0;
+}
+
+/** Block of delta, stored contents of the block follow it, if bits have CHANGED_DATA */
+typedef struct {
+    BlockID block;
+    BlockID nextBlock;
+    uint32_t storedSize;
+    uint32_t sharedRefs;
+    uint32_t checksum;        // 0 for image without IMG_CHECKSUMS
+    uint32_t bits;
+} ChangeRecord;
+
+/**
+ * Writes descriptors and blocks, that have changed since the beginning of sinceGeneration, to delta
+ * and begins the next generation. Delta is applied to copy of the image by importChanges.
+ * delta: magic, version, generation, devSize, blockSize, maxFileN, flags, snapshotsFdId, groupsN,
+ * heads of free lists, number of descriptors, descriptors, number of blocks, records of blocks.
+ * Image mustn't be mounted. Changes are dropped only after delta is flushed, so failed export may be repeated.
+ * return: number of exported blocks, -1 means, that image doesn't track changes or isn't at sinceGeneration,
+ *         -2 means, that delta can't be written or some block can't be read
+ */
+int64_t exportChanges(FSContext *context, int64_t sinceGeneration, FILE *delta) {
+    ChangeMap *changes = context->changes;
+    if (changes == NULL || sinceGeneration != context->generation) {
+        return -1;
+    }
+    BlockID blocksN = context->devSize / context->blockSize;
+    int64_t blockBytes = getBlockChangesSize(blocksN, context);
+    int64_t descriptorsN = 0, changedN = 0;
+    for (int fdId = 0; fdId < context->maxFileN; fdId++) {
+        descriptorsN += (changes->descrBits[fdId / 8] >> (fdId % 8)) & 1;
+    }
+    for (int64_t i = 0; i < blockBytes; i++) {
+        for (int j = 0; changes->blockBits[i] != 0 && j < BLOCKS_PER_BYTE; j++) {
+            changedN += ((changes->blockBits[i] >> (j*CHANGE_BITS)) & (CHANGED_ENTRIES | CHANGED_DATA)) != 0;
+        }
+    }
+    uint32_t magic = DELTA_MAGIC, version = IMG_VERSION;
+    fwrite(&magic, sizeof(uint32_t), 1, delta);
+    fwrite(&version, sizeof(uint32_t), 1, delta);
+    fwrite(&(context->generation), sizeof(int64_t), 1, delta);
+    fwrite(&(context->devSize), sizeof(int64_t), 1, delta);
+    fwrite(&(context->blockSize), sizeof(int32_t), 1, delta);
+    fwrite(&(context->maxFileN), sizeof(int32_t), 1, delta);
+    fwrite(&(context->flags), sizeof(uint32_t), 1, delta);
+    fwrite(&(context->snapshotsFdId), sizeof(int32_t), 1, delta);
+    fwrite(&(context->groupsN), sizeof(int32_t), 1, delta);
+    for (int group = 0; group < context->groupsN; group++) {
+        fwrite(&context->groups[group].firstFree, sizeof(BlockID), 1, delta);
+    }
+    fwrite(&descriptorsN, sizeof(int64_t), 1, delta);
+    FileDescriptor descr;
+    for (int fdId = 0; fdId < context->maxFileN; fdId++) {
+        if ((changes->descrBits[fdId / 8] >> (fdId % 8)) & 1) {
+            getDescriptor(&descr, fdId, context);
+            fwrite(&descr, sizeof(FileDescriptor), 1, delta);
+        }
+    }
+    fwrite(&changedN, sizeof(int64_t), 1, delta);
+    bool checksums = (context->flags & IMG_CHECKSUMS) != 0;
+    char *data = malloc(context->blockSize);
+    bool success = true;
+    for (BlockID block = 0; block < blocksN && success; block++) {
+        uint32_t bits = (changes->blockBits[block / BLOCKS_PER_BYTE] >> (block % BLOCKS_PER_BYTE * CHANGE_BITS))
+                        & (CHANGED_ENTRIES | CHANGED_DATA);
+        if (bits == 0) {
+            continue;
+        }
+        ChangeRecord record;
+        record.block = block;
+        record.nextBlock = getNextBlock(block, context);
+        record.storedSize = getStoredSize(block, context);
+        record.sharedRefs = getSharedRefs(block, context);
+        record.checksum = checksums ? getChecksum(block, context) : 0;
+        record.bits = bits;
+        success = fwrite(&record, sizeof(ChangeRecord), 1, delta) == 1;
+        if (success && (bits & CHANGED_DATA)) {
+            success = transferBlock(IO_READ, data, block, context)
+                    && fwrite(data, context->blockSize, 1, delta) == 1;
+        }
+    }
+    free(data);
+    if (!success || fflush(delta) != 0 || ferror(delta)) {
+        return -2;
+    }
+    // delta may be a pipe, it can't be synced
+    fsync(fileno(delta));
+    beginGeneration(context->generation + 1, context);
+    syncContext(context);
+    return changedN;
+}
+
+/**
+ * Applies delta, that was exported from the image at the same generation, to its copy(ex. backup, that was
+ * copied along with all backing files). Deltas must be applied in order of generations, copy grows, if delta
+ * was made after growth of the image. Copy mustn't be mounted. Delta, that is applied partially(ex. it's
+ * truncated), may be applied again.
+ * return: 0 if success, -1 means, that delta is damaged or made of other image,
+ *         -2 means, that copy isn't at the generation, which delta begins from
+ */
+int importChanges(FSContext *context, FILE *delta) {
+    uint32_t magic = 0, version = 0, flags = 0;
+    int64_t generation = 0, devSize = 0;
+    int32_t blockSize = 0, maxFileN = 0, snapshotsFdId = 0, groupsN = 0;
+    fread(&magic, sizeof(uint32_t), 1, delta);
+    fread(&version, sizeof(uint32_t), 1, delta);
+    fread(&generation, sizeof(int64_t), 1, delta);
+    fread(&devSize, sizeof(int64_t), 1, delta);
+    fread(&blockSize, sizeof(int32_t), 1, delta);
+    fread(&maxFileN, sizeof(int32_t), 1, delta);
+    fread(&flags, sizeof(uint32_t), 1, delta);
+    fread(&snapshotsFdId, sizeof(int32_t), 1, delta);
+    if (fread(&groupsN, sizeof(int32_t), 1, delta) != 1 || magic != DELTA_MAGIC || version != IMG_VERSION
+            || context->changes == NULL || blockSize != context->blockSize || maxFileN != context->maxFileN
+            || flags != context->flags || devSize < context->devSize) {
+        return -1;
+    }
+    if (generation != context->generation) {
+        return -2;
+    }
+    if (devSize > context->devSize && growImgFile(context, devSize) != 0) {
+        return -1;
+    }
+    if (groupsN != context->groupsN) {
+        return -1;
+    }
+    BlockID *heads = malloc(groupsN*sizeof(BlockID));
+    int64_t descriptorsN = 0, changedN = 0;
+    bool success = fread(heads, sizeof(BlockID), groupsN, delta) == groupsN
+            && fread(&descriptorsN, sizeof(int64_t), 1, delta) == 1;
+    FileDescriptor descr;
+    for (int64_t i = 0; i < descriptorsN && success; i++) {
+        success = fread(&descr, sizeof(FileDescriptor), 1, delta) == 1 && descr.fdId >= 0 && descr.fdId < maxFileN;
+        if (success) {
+            saveDescriptor(&descr, context);
+        }
+    }
+    success = success && fread(&changedN, sizeof(int64_t), 1, delta) == 1;
+    BlockID blocksN = context->devSize / context->blockSize;
+    bool checksums = (context->flags & IMG_CHECKSUMS) != 0;
+    char *data = malloc(blockSize);
+    ChangeRecord record;
+    for (int64_t i = 0; i < changedN && success; i++) {
+        success = fread(&record, sizeof(ChangeRecord), 1, delta) == 1 && record.block >= 0 && record.block < blocksN
+                && (!(record.bits & CHANGED_DATA) || fread(data, blockSize, 1, delta) == 1);
+        if (!success) {
+            break;
+        }
+        setNextBlock(record.block, record.nextBlock, context);
+        setStoredSize(record.block, record.storedSize, context);
+        setSharedRefs(record.block, record.sharedRefs, context);
+        if (checksums) {
+            setChecksum(record.block, record.checksum, context);
+        }
+        if (record.bits & CHANGED_DATA) {
+            success = transferBlock(IO_WRITE, data, record.block, context);
+        }
+    }
+    free(data);
+    if (success) {
+        for (int group = 0; group < groupsN; group++) {
+            context->groups[group].firstFree = heads[group];
+            saveGroupHead(group, context);
+        }
+        // free blocks of groups are counted again
+        destroyGroups(context->groups, context->groupsN);
+        loadGroups(context);
+        context->snapshotsFdId = snapshotsFdId;
+        beginGeneration(generation + 1, context);
+        success = syncContext(context) == 0;
+    }
+    free(heads);
+    return success ? 0 : -1;
+}
+
+/** 
+ * Adds memory as more as it is possible up to newSize.
+ * return: delta of new and old sizes. 
+ * Modifies FAT
+ */
+int64_t changeSize(FileDescriptor *descr, int64_t newSize, FSContext *context) {
+    int64_t oldSize = descr->size;
+    int64_t newBlocksN = newSize / context->blockSize + (newSize % context->blockSize > 0 ? 1 : 0);
+    if (descr->occupiedBlocks == 0 && newSize <= INLINE_DATA_SIZE) {
+        newBlocksN = 0;
+    }
+    if (oldSize > newSize) {
+        removeBlocksFrom(descr, descr->occupiedBlocks - newBlocksN, context);
+        if (descr->occupiedBlocks == 0 && newSize < INLINE_DATA_SIZE) {
+            memset(descr->inlineData + newSize, 0, INLINE_DATA_SIZE - newSize);
+        } else if (descr->occupiedBlocks > 0 && newSize % context->blockSize > 0) {
+            // cut tail of the last block must read as zeroes, if the file grows again
+            int tailSize = context->blockSize - newSize % context->blockSize;
+            writeTo(descr, context->zeroBlock, tailSize, newSize, context);
+        }
+        descr->size = newSize;
+    } else if (oldSize < newSize) {
+        appendBlocks(descr, newBlocksN - descr->occupiedBlocks, true, context);
+        descr->size = newSize;
+        if (descr->occupiedBlocks < newBlocksN) {
+            // file grows as far as there are free blocks
+            descr->size = descr->occupiedBlocks > 0 ? descr->occupiedBlocks*(int64_t)context->blockSize : oldSize;
+        }
+    }
+    saveDescriptor(descr, context);
+    return descr->size > oldSize ? descr->size - oldSize : oldSize - descr->size;
+}
+
+/** 
+ * Writes into inline data while it fits, else moves contents to blocks.
+ * return: written size(in bytes). 0 means, that there is not enough space
+ */
+size_t writeTo(FileDescriptor *descr, const void *buf, size_t size, int64_t offsetInFile, FSContext *context) {
+    if (descr->occupiedBlocks == 0 && offsetInFile + size <= INLINE_DATA_SIZE) {
+        memcpy(descr->inlineData + offsetInFile, buf, size);
+        touchDescriptor(descr, context);
+        return size;
+    }
+    int64_t blockIndex = offsetInFile / context->blockSize;
+    int offsetInBlock = offsetInFile % context->blockSize;
+
+    size_t portion;
+    if (offsetInBlock + size > context->blockSize) {
+        // manage writing with size > blockSize
+        portion = context->blockSize - offsetInBlock;
+    } else {
+        portion = size;
+    }
+    int64_t lastBlockIndex = blockIndex + (int64_t)((size - portion + context->blockSize - 1)/context->blockSize);
+    int64_t blocksToAdd = lastBlockIndex - descr->occupiedBlocks + 1;
+    size_t writtenSize;
+    bool enoughBlocks = countNeededBlocks(descr, blockIndex, lastBlockIndex, context) <= numberOfFreeBlocks(context);
+    for (int64_t i = 0; i < blocksToAdd && enoughBlocks; i++) {
+        enoughBlocks = addBlockFor(descr, context) != -1;
+    }
+    if (enoughBlocks) {
+        const char *buffer = buf;
+        OpenFile *file = getMappedFile(descr, context);
+        // previous block is tracked, because shared blocks are replaced by their copies in the chain
+        BlockID prevBlock;
+        BlockID block;
+        if (file != NULL) {
+            prevBlock = blockIndex > 0 ? file->blockMap[blockIndex - 1] : -1;
+            block = file->blockMap[blockIndex];
+        } else {
+            prevBlock = blockIndex > 0 ? getBlockInChain(descr->firstBlock, blockIndex - 1, context) : -1;
+            block = prevBlock == -1 ? descr->firstBlock : getBlockInChain(prevBlock, 1, context);
+        }
+        ScratchMark mark = scratchMark();
+        BlockPart *parts = scratchAlloc((lastBlockIndex - blockIndex + 1)*sizeof(BlockPart));
+        int64_t partsN = 0;
+        // left tail, full blocks and right tail are written by one batch
+        while (size > 0) {
+            block = unshareBlock(descr, blockIndex, prevBlock, block, context);
+            if (block == -1) {
+                break;
+            }
+            parts[partsN].block = block;
+            parts[partsN].offsetInBlock = offsetInBlock;
+            parts[partsN].buf = (char *)buffer;
+            parts[partsN].size = portion;
+            partsN++;
+            noteAccess(block, descr->type == FT_DIRECTORY, context);
+            buffer += portion;
+            size -= portion;
+            offsetInBlock = 0;
+            portion = size > context->blockSize ? context->blockSize : size;
+            if (size > 0) {
+                prevBlock = block;
+                blockIndex++;
+                block = file != NULL ? file->blockMap[blockIndex] : getBlockInChain(block, 1, context);
+            }
+        }
+        writtenSize = writeBlockParts(descr, parts, partsN, context);
+        scratchRelease(mark);
+    } else {
+        writtenSize = 0;
+    }
+    return writtenSize;
+}
+
+/** 
+ * return: read size(in bytes). 0 means, that (offsetInFile+size) is beyond size of the file.
+ *         -1 means, that some block can't be read(I/O error, checksum doesn't match).
+ *         Reading of inline data stops at the end of inline area.
+ */
+ssize_t readFrom(FileDescriptor *descr, void *buf, size_t size, int64_t offsetInFile, FSContext *context) {
+    if (descr->occupiedBlocks == 0) {
+        if (offsetInFile >= INLINE_DATA_SIZE) {
+            return 0;
+        }
+        if (offsetInFile + size > INLINE_DATA_SIZE) {
+            size = INLINE_DATA_SIZE - offsetInFile;
+        }
+        memcpy(buf, descr->inlineData + offsetInFile, size);
+        return size;
+    }
+    int64_t blockIndex = offsetInFile / context->blockSize;
+    int offsetInBlock = offsetInFile % context->blockSize;
+    
+    // manage reading with size > blockSize
+    size_t portion;
+    if (offsetInBlock + size > context->blockSize) {
+        portion = context->blockSize - offsetInBlock;
+    } else {
+        portion = size;
+    }
+    int64_t lastReadBlockIndex  = blockIndex + (int64_t)((size - portion + context->blockSize - 1)/context->blockSize);
+    ssize_t readSize;
+    if (lastReadBlockIndex < descr->occupiedBlocks) {
+        // left tail, full blocks and right tail are read by one batch
+        int64_t partsN = lastReadBlockIndex - blockIndex + 1;
+        ScratchMark mark = scratchMark();
+        BlockPart *parts = scratchAlloc(partsN*sizeof(BlockPart));
+        char *buffer = buf;
+        OpenFile *file = getMappedFile(descr, context);
+        BlockID block = file != NULL ? file->blockMap[blockIndex] : getBlockInChain(descr->firstBlock, blockIndex, context);
+        for (int64_t i = 0; i < partsN; i++) {
+            if (i > 0) {
+                block = file != NULL ? file->blockMap[blockIndex + i] : getBlockInChain(block, 1, context);
+            }
+            parts[i].block = block;
+            parts[i].offsetInBlock = offsetInBlock;
+            parts[i].buf = buffer;
+            parts[i].size = portion;
+            noteAccess(block, descr->type == FT_DIRECTORY, context);
+            buffer += portion;
+            size -= portion;
+            offsetInBlock = 0;
+            portion = size > context->blockSize ? context->blockSize : size;
+        }
+        readSize = readBlockParts(parts, partsN, classOf(descr), context);
+        scratchRelease(mark);
+    } else {
+        readSize = 0;
+    }
+    return readSize;
+}
+
+static uint32_t getStoredSize(BlockID block, FSContext *context) {
+    uint32_t storedSize;
+    readTable(&storedSize, sizeof(uint32_t), context->storedSizesOffset + block*sizeof(uint32_t), context);
+    return storedSize;
+}
+
+static void setStoredSize(BlockID block, uint32_t storedSize, FSContext *context) {
+    markBlock(block, CHANGED_ENTRIES, context);
+    writeTable(&storedSize, sizeof(uint32_t), context->storedSizesOffset + block*sizeof(uint32_t), context);
+}
+
+/** 
+ * Reads parts of blocks by one batch of I/Os. Compressed block is read by its stored size
+ * only and decompressed. With IMG_CHECKSUMS whole stored blocks are read and verified.
+ * return: read size(in bytes). -1 means, that some block can't be read: its I/O is short,
+ *         checksum doesn't match or it can't be decompressed.
+ */
+static ssize_t readBlockParts(BlockPart *parts, int64_t partsN, IOClass ioClass, FSContext *context) {
+    bool verify = (context->flags & IMG_CHECKSUMS) != 0;
+    ScratchMark mark = scratchMark();
+    BlockIO *ios = scratchAlloc(partsN*sizeof(BlockIO));
+    holdBlockLocations(context);
+    for (int64_t i = 0; i < partsN; i++) {
+        BlockPart *part = &parts[i];
+        BlockIO *io = &ios[i];
+        off_t blockOffset = locateBlock(part->block, &io->fd, context);
+        part->storedSize = getStoredSize(part->block, context);
+        io->type = IO_READ;
+        if (part->storedSize == 0 && (!verify || part->size == context->blockSize)) {
+            part->stored = NULL;
+            io->offset = blockOffset + part->offsetInBlock;
+            io->buf = part->buf;
+            io->size = part->size;
+        } else {
+            io->size = part->storedSize == 0 ? context->blockSize : part->storedSize;
+            part->stored = scratchAlloc(io->size);
+            io->offset = blockOffset;
+            io->buf = part->stored;
+        }
+    }
+    submitIO(context->ioEngine, ios, partsN, ioClass);
+    releaseBlockLocations(context);
+    ssize_t readSize = 0;
+    bool corrupted = false;
+    char *raw = NULL;
+    for (int64_t i = 0; i < partsN && !corrupted; i++) {
+        BlockPart *part = &parts[i];
+        BlockIO *io = &ios[i];
+        if (io->result != io->size) {
+            // part of the buffer would keep garbage
+            corrupted = true;
+        } else if (verify && crc32c(0, io->buf, io->size) != getChecksum(part->block, context)) {
+            corrupted = true;
+        } else if (part->storedSize != 0) {
+            if (raw == NULL) {
+                raw = scratchAlloc(context->blockSize);
+            }
+            if (decompressBlock(part->stored, part->storedSize, raw, context->blockSize) == context->blockSize) {
+                memcpy(part->buf, raw + part->offsetInBlock, part->size);
+                readSize += part->size;
+            } else {
+                corrupted = true;
+            }
+        } else {
+            if (part->stored != NULL) {
+                memcpy(part->buf, part->stored + part->offsetInBlock, part->size);
+            }
+            readSize += part->size;
+        }
+    }
+    scratchRelease(mark);
+    return corrupted ? -1 : readSize;
+}
+
+/** return: read size(in bytes). -1 means, that block can't be read(see readBlockParts). */
+static ssize_t readBlockPart(BlockID block, int offsetInBlock, void *buf, size_t size, IOClass ioClass, FSContext *context) {
+    BlockPart part;
+    part.block = block;
+    part.offsetInBlock = offsetInBlock;
+    part.buf = buf;
+    part.size = size;
+    return readBlockParts(&part, 1, ioClass, context);
+}
+
+/** blocks of directories and symlinks are metadata, their I/O is dispatched ahead of data(see blockio.c) */
+static IOClass classOf(FileDescriptor *descr) {
+    return descr->type == FT_REGULAR ? IO_DATA : IO_META;
+}
+
+/** 
+ * Writes parts of blocks by one batch of I/Os. Blocks of FD_COMPRESSED files are compressed
+ * as a whole(partial writes read and decompress the block first). Block, that doesn't shrink
+ * by 1/8 at least, is stored raw. Parts go in order of the file.
+ * return: written size(in bytes) of parts before the first one, that failed or was written short
+ */
+static size_t writeBlockParts(FileDescriptor *descr, BlockPart *parts, int64_t partsN, FSContext *context) {
+    bool compress = (descr->flags & FD_COMPRESSED) != 0;
+    bool checksums = (context->flags & IMG_CHECKSUMS) != 0;
+    ScratchMark mark = scratchMark();
+    BlockIO *ios = scratchAlloc(partsN*sizeof(BlockIO));
+    // offsets are relative to blocks, until blocks are located: writes of partial blocks read them first
+    for (int64_t i = 0; i < partsN; i++) {
+        BlockPart *part = &parts[i];
+        BlockIO *io = &ios[i];
+        part->storedSize = 0;
+        part->stored = NULL;
+        part->failed = false;
+        io->type = IO_WRITE;
+        if (!compress && !checksums && getStoredSize(part->block, context) == 0) {
+            io->offset = part->offsetInBlock;
+            io->buf = part->buf;
+            io->size = part->size;
+            continue;
+        }
+        char *raw = scratchAlloc(context->blockSize);
+        if (part->size < context->blockSize && readBlockPart(part->block, 0, raw, context->blockSize, classOf(descr), context) == -1) {
+            // corrupted block isn't covered by new checksum
+            part->failed = true;
+            io->offset = 0;
+            io->buf = NULL;
+            io->size = 0;
+            continue;
+        }
+        memcpy(raw + part->offsetInBlock, part->buf, part->size);
+        if (compress) {
+            char *stored = scratchAlloc(context->blockSize);
+            int storedSize = compressBlock(raw, context->blockSize, stored, context->blockSize - context->blockSize/8);
+            if (storedSize > 0) {
+                part->storedSize = storedSize;
+                raw = stored;
+            }
+        }
+        part->stored = raw;
+        io->offset = 0;
+        io->buf = part->stored;
+        io->size = part->storedSize > 0 ? part->storedSize : context->blockSize;
+    }
+    holdBlockLocations(context);
+    for (int64_t i = 0; i < partsN; i++) {
+        markBlock(parts[i].block, CHANGED_DATA, context);
+        ios[i].offset += locateBlock(parts[i].block, &ios[i].fd, context);
+    }
+    submitIO(context->ioEngine, ios, partsN, classOf(descr));
+    releaseBlockLocations(context);
+    // written size is the prefix of parts before the first failed one, but tables follow
+    // every part, that reached the disk whole: later ones may be written, as batch isn't ordered
+    size_t writtenSize = 0;
+    bool prefix = true;
+    for (int64_t i = 0; i < partsN; i++) {
+        BlockPart *part = &parts[i];
+        BlockIO *io = &ios[i];
+        if (part->failed || io->result != io->size) {
+            prefix = false;
+            continue;
+        }
+        if (prefix) {
+            writtenSize += part->size;
+        }
+        if (part->stored != NULL) {
+            setStoredSize(part->block, part->storedSize, context);
+            if (checksums) {
+                setChecksum(part->block, crc32c(0, part->stored, io->size), context);
+            }
+        }
+    }
+    scratchRelease(mark);
+    return writtenSize;
+}
+
+/**
+ * Block, that is kept by the fast tier, lies in its slot, others lie in their stripes.
+ * Location may change only while tiers aren't held(see holdBlockLocations).
+ * return: offset of the block in its backing file, which descriptor is written in *fd
+ */
+static off_t locateBlock(BlockID block, int *fd, FSContext *context) {
+    if (context->tiers != NULL && context->tiers->blockSlots[block] != -1) {
+        *fd = fileno(context->imgFile);
+        return context->dataOffset + context->tiers->blockSlots[block]*(off_t)context->blockSize;
+    }
+    return locateHome(block, fd, context);
+}
+
+/**
+ * Stripes of stripeBlocks blocks go round-robin over backing files, data region of the first one
+ * starts after the tables. Fast tier keeps no stripes, so they go over the others.
+ * return: offset of the block in its stripe, which backing file is written in *fd
+ */
+static off_t locateHome(BlockID block, int *fd, FSContext *context) {
+    int firstMember = context->membersN - getDataMembersN(context);
+    int dataMembersN = getDataMembersN(context);
+    int64_t stripe = block / context->stripeBlocks;
+    int member = firstMember + stripe % dataMembersN;
+    off_t offset = ((stripe / dataMembersN)*context->stripeBlocks + block % context->stripeBlocks)
+                   *(off_t)context->blockSize;
+    *fd = fileno(context->members[member]);
+    return member == 0 ? context->dataOffset + offset : offset;
+}
+
+/** return: number of backing files, that keep stripes of data region */
+static int getDataMembersN(FSContext *context) {
+    return context->fastSlotsN > 0 ? context->membersN - 1 : context->membersN;
+}
+
+/** Transfers whole block between buf and the image by the engine as data. return: true if success */
+static bool transferBlock(IOType type, void *buf, BlockID block, FSContext *context) {
+    BlockIO io;
+    io.type = type;
+    io.buf = buf;
+    io.size = context->blockSize;
+    if (type == IO_WRITE) {
+        markBlock(block, CHANGED_DATA, context);
+    }
+    holdBlockLocations(context);
+    io.offset = locateBlock(block, &io.fd, context);
+    bool success = submitIO(context->ioEngine, &io, 1, IO_DATA) == 0;
+    releaseBlockLocations(context);
+    return success;
+}
+
+static uint32_t getSharedRefs(BlockID block, FSContext *context) {
+    uint32_t refs;
+    readTable(&refs, sizeof(uint32_t), context->sharedRefsOffset + block*sizeof(uint32_t), context);
+    return refs;
+}
+
+static void setSharedRefs(BlockID block, uint32_t refs, FSContext *context) {
+    markBlock(block, CHANGED_ENTRIES, context);
+    writeTable(&refs, sizeof(uint32_t), context->sharedRefsOffset + block*sizeof(uint32_t), context);
+}
+
+/**
+ * Adds delta to shared references of blocks. References of runs of neighbouring blocks are read
+ * and written at once, so a chain, that lies contiguously, takes a couple of I/Os.
+ */
+static void addSharedRefs(BlockID *blocks, int64_t blocksN, int delta, FSContext *context) {
+    int64_t chunkN = COPY_CHUNK / sizeof(uint32_t);
+    ScratchMark mark = scratchMark();
+    uint32_t *refs = scratchAlloc((blocksN < chunkN ? blocksN : chunkN)*sizeof(uint32_t));
+    int64_t runStart = 0;
+    while (runStart < blocksN) {
+        BlockID first = blocks[runStart];
+        int64_t runN = 1;
+        while (runStart + runN < blocksN && runN < chunkN && blocks[runStart + runN] == first + runN) {
+            runN++;
+        }
+        off_t offset = context->sharedRefsOffset + first*sizeof(uint32_t);
+        readTable(refs, runN*sizeof(uint32_t), offset, context);
+        for (int64_t i = 0; i < runN; i++) {
+            refs[i] += delta;
+        }
+        markBlocks(first, first + runN, CHANGED_ENTRIES, context);
+        writeTable(refs, runN*sizeof(uint32_t), offset, context);
+        runStart += runN;
+    }
+    scratchRelease(mark);
+}
+
+static uint32_t getChecksum(BlockID block, FSContext *context) {
+    uint32_t checksum;
+    readTable(&checksum, sizeof(uint32_t), context->checksumsOffset + block*sizeof(uint32_t), context);
+    return checksum;
+}
+
+static void setChecksum(BlockID block, uint32_t checksum, FSContext *context) {
+    markBlock(block, CHANGED_ENTRIES, context);
+    writeTable(&checksum, sizeof(uint32_t), context->checksumsOffset + block*sizeof(uint32_t), context);
+}
+
+#define SCRUB_BATCH 64
+
+/** 
+ * Verifies checksums of all allocated blocks(blocks of snapshots included) in order of their ids.
+ * badBlocks points to size >= number of blocks.
+ * return: number of corrupted blocks. -1 means, that image has no checksums.
+ */
+int64_t scrubBlocks(BlockID *badBlocks, FSContext *context) {
+    if ((context->flags & IMG_CHECKSUMS) == 0) {
+        return -1;
+    }
+    BlockID blocksN = context->devSize / context->blockSize;
+    BlockID *freeBlocks = malloc(blocksN*sizeof(BlockID));
+    int64_t freeN = getFreeBlocks(freeBlocks, context);
+    bool *isFree = calloc(blocksN, sizeof(bool));
+    for (int64_t i = 0; i < freeN; i++) {
+        isFree[freeBlocks[i]] = true;
+    }
+    free(freeBlocks);
+    uint32_t *storedSizes = malloc(blocksN*sizeof(uint32_t));
+    uint32_t *checksums = malloc(blocksN*sizeof(uint32_t));
+    readTable(storedSizes, blocksN*sizeof(uint32_t), context->storedSizesOffset, context);
+    readTable(checksums, blocksN*sizeof(uint32_t), context->checksumsOffset, context);
+    char *data = malloc(SCRUB_BATCH*context->blockSize);
+    BlockIO ios[SCRUB_BATCH];
+    BlockID batch[SCRUB_BATCH];
+    int batchN = 0;
+    int64_t badN = 0;
+    // block 0 is never allocated(see initFAT)
+    holdBlockLocations(context);
+    for (BlockID block = 1; block <= blocksN; block++) {
+        if (block < blocksN && !isFree[block]) {
+            BlockIO *io = &ios[batchN];
+            io->type = IO_READ;
+            io->offset = locateBlock(block, &io->fd, context);
+            io->buf = data + batchN*context->blockSize;
+            io->size = storedSizes[block] == 0 ? context->blockSize : storedSizes[block];
+            batch[batchN++] = block;
+        }
+        if (batchN == SCRUB_BATCH || (block == blocksN && batchN > 0)) {
+            submitIO(context->ioEngine, ios, batchN, IO_DATA);
+            for (int i = 0; i < batchN; i++) {
+                if (ios[i].result != ios[i].size
+                        || crc32c(0, ios[i].buf, ios[i].size) != checksums[batch[i]]) {
+                    badBlocks[badN++] = batch[i];
+                }
+            }
+            batchN = 0;
+        }
+    }
+    releaseBlockLocations(context);
+    free(data);
+    free(checksums);
+    free(storedSizes);
+    free(isFree);
+    return badN;
+}
+
+/** 
+ * Copy-on-write: if block is shared with snapshots, it's replaced in the chain of descr
+ * by its private copy. blockIndex is its index in the chain, prevBlock is the block before it
+ * (-1 for the first one).
+ * return: block to write to. -1 means, that there are no free blocks for the copy.
+ * Changes FAT on the disk.
+ */
+/**
+ * Counts free blocks, that writing of blocks [blockIndex, lastBlockIndex] of the file takes:
+ * appended blocks and copies of blocks, that are shared with snapshots(see unshareBlock).
+ */
+static int64_t countNeededBlocks(FileDescriptor *descr, int64_t blockIndex, int64_t lastBlockIndex, FSContext *context) {
+    int64_t neededN = lastBlockIndex >= descr->occupiedBlocks ? lastBlockIndex - descr->occupiedBlocks + 1 : 0;
+    if (context->snapshotsFdId == 0 || blockIndex >= descr->occupiedBlocks) {
+        return neededN;
+    }
+    OpenFile *file = getMappedFile(descr, context);
+    FatWindow window = { 0, 0 };
+    BlockID block = file != NULL ? file->blockMap[blockIndex] : getBlockInChain(descr->firstBlock, blockIndex, context);
+    for (int64_t index = blockIndex; index <= lastBlockIndex && index < descr->occupiedBlocks; index++) {
+        if (index > blockIndex) {
+            block = file != NULL ? file->blockMap[index] : walkChain(&window, block, context);
+        }
+        if (getSharedRefs(block, context) > 0) {
+            neededN++;
+        }
+    }
+    return neededN;
+}
+
+static BlockID unshareBlock(FileDescriptor *descr, int64_t blockIndex, BlockID prevBlock, BlockID block, FSContext *context) {
+    uint32_t refs = getSharedRefs(block, context);
+    if (refs == 0) {
+        return block;
+    }
+    // copy stays near the previous block of the file
+    BlockID copy = allocateBlock(groupOf(prevBlock != -1 ? prevBlock : block, context), context);
+    if (copy != -1) {
+        ScratchMark mark = scratchMark();
+        void *data = scratchAlloc(context->blockSize);
+        transferBlock(IO_READ, data, block, context);
+        transferBlock(IO_WRITE, data, copy, context);
+        scratchRelease(mark);
+        setStoredSize(copy, getStoredSize(block, context), context);
+        if (context->flags & IMG_CHECKSUMS) {
+            setChecksum(copy, getChecksum(block, context), context);
+        }
+        // copy -> next block
+        setNextBlock(copy, getNextBlock(block, context), context);
+        // previous block -> copy
+        OpenFile *file = getOpenFile(descr->fdId, context);
+        if (file != NULL && file->blockMap != NULL) {
+            if (descr == &file->descr) {
+                file->blockMap[blockIndex] = copy;
+            } else {
+                dropBlockMap(file);
+            }
+        }
+        if (prevBlock == -1) {
+            descr->firstBlock = copy;
+            touchDescriptor(descr, context);
+        } else {
+            setNextBlock(prevBlock, copy, context);
+        }
+        setSharedRefs(block, refs - 1, context);
     }
-    return block;
+    return copy;
 }
 
 /** 
- * Adds memory as more as it is possible up to newSize.
- * return: delta of new and old sizes. 
- * Modifies FAT
+ * storedBytes gets number of bytes, that compressed blocks take on the disk.
+ * return: number of compressed blocks.
  */
-int changeSize(FileDescriptor *descr, int newSize, FSContext *context) {
-    int delta;
-    int newBlocksN = newSize / context->blockSize + (newSize % context->blockSize > 0 ? 1 : 0);
-    if (descr->size > newSize) {
-        int deltaBlocks = descr->occupiedBlocks - newBlocksN;
-        removeBlocksFrom(descr, deltaBlocks, context);
-        delta = descr->size-newSize;
-        descr->size = newSize;
-    } else if (descr->size < newSize) {
-        int deltaBlocks = newBlocksN - descr->occupiedBlocks;
-        BlockID block = 0;
-        int i = 0;
-        while (i < deltaBlocks && block != -1) {
-            block = addBlockFor(descr, context);
-            i++;
-        }
-        delta = newSize - descr->size;
-        int oldSize = descr->size;
-        descr->size = newSize;
-        if (block == -1) {
-            // нужно проверить это:
-            descr->size -= (deltaBlocks - i)*context->blockSize;
-            delta = oldSize - descr->size; 
+int64_t getCompressionStats(int64_t *storedBytes, FSContext *context) {
+    BlockID blocksN = context->devSize / context->blockSize;
+    int64_t compressedN = 0;
+    int64_t chunkN = COPY_CHUNK / sizeof(uint32_t);
+    uint32_t *storedSizes = malloc(COPY_CHUNK);
+    *storedBytes = 0;
+    for (BlockID first = 0; first < blocksN; first += chunkN) {
+        int64_t entriesN = blocksN - first < chunkN ? blocksN - first : chunkN;
+        readTable(storedSizes, entriesN*sizeof(uint32_t), context->storedSizesOffset + first*sizeof(uint32_t), context);
+        for (int64_t i = 0; i < entriesN; i++) {
+            if (storedSizes[i] != 0) {
+                compressedN++;
+                *storedBytes += storedSizes[i];
+            }
         }
-   
     }
-    saveDescriptor(descr, context);
-    return delta;
+    free(storedSizes);
+    return compressedN;
 }
 
-/** return: written size(in bytes). 0 means, that there is not enough space*/
-size_t writeTo(FileDescriptor *descr, const void *buf, size_t size, int offsetInFile, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    int blockIndex = offsetInFile / context->blockSize;
-    int offsetInBlock = offsetInFile % context->blockSize;
-
-    size_t portion;
-    if (offsetInBlock + size > context->blockSize) {
-        // manage writing with size > blockSize
-        portion = context->blockSize - offsetInBlock;
+/**
+ * Compact record takes the first free space, that fits it: run of free records or the end of a block.
+ * increments nlink
+ */
+void writeDirEntryTo(FileDescriptor *dirDescr, DirEntry *record, FSContext *context) {
+    int64_t offset = 0;
+    if (dirDescr->flags & FD_COMPACT_DIR) {
+        int nameLen = strlen(record->name);
+        int need = recordSize(nameLen);
+        DirCursor cursor;
+        openDirCursor(&cursor, dirDescr, NULL, 0, context->blockSize, context);
+        cursor.gapNeed = need;
+        // free records, that follow each other in one block
+        int64_t runStart = -1;
+        int runLen = 0;
+        int64_t recordOffset;
+        DirRecord *readRecord;
+        while ((readRecord = nextDirRecord(&cursor, &recordOffset, context)) != NULL && cursor.gapOffset == -1) {
+            if (readRecord->nameLen != 0) {
+                runStart = -1;
+                continue;
+            }
+            if (runStart == -1 || runStart + runLen != recordOffset
+                    || runStart / context->blockSize != recordOffset / context->blockSize) {
+                runStart = recordOffset;
+                runLen = 0;
+            }
+            runLen += readRecord->recordLen;
+            if (runLen >= need) {
+                break;
+            }
+        }
+        char buf[MAX_RECORD_LEN + sizeof(DirRecord)];
+        int size = need;
+        if (runStart != -1 && runLen >= need) {
+            offset = runStart;
+            if (runLen - need < (int)sizeof(DirRecord)) {
+                fillRecord((DirRecord *)buf, record->name, record->fdId, runLen);
+            } else {
+                // the rest of the run stays free
+                fillRecord((DirRecord *)buf, record->name, record->fdId, need);
+                fillRecord((DirRecord *)(buf + need), "", -1, runLen - need);
+                size += sizeof(DirRecord);
+            }
+        } else {
+            offset = cursor.gapOffset != -1 ? cursor.gapOffset : cursor.offset;
+            fillRecord((DirRecord *)buf, record->name, record->fdId, need);
+        }
+        closeDirCursor(&cursor);
+        writeTo(dirDescr, buf, size, offset, context);
     } else {
-        portion = size;
-    }
-    int blocksToAdd = blockIndex + (size - portion)/context->blockSize - descr->occupiedBlocks + 1;
-    size_t writtenSize;
-    if (blocksToAdd < numberOfFreeBlocks(context)) {
-        for (int i = 0; i < blocksToAdd; i++) {
-            addBlockFor(descr, context);
-        }
-        void *buffer = buf;
-        BlockID block = getBlockInChain(descr->firstBlock, blockIndex, context);
-        fseek(imgFile, context->dataOffset + block*context->blockSize + offsetInBlock, SEEK_SET);
-        writtenSize = fwrite(buffer, portion, 1, imgFile)*portion;
-        buffer = (void*)((char*) buffer + writtenSize);
-        size -= portion;
-        if (size > 0) {
-            // writing full block-sized info
-            while (size > context->blockSize) {
-               // picking next block
-               block = getBlockInChain(block, 1, context);
-               fseek(imgFile, context->dataOffset + block*context->blockSize, SEEK_SET);
-               size_t part = fwrite(buffer, context->blockSize, 1, imgFile)*context->blockSize;
-               writtenSize += part;
-               buffer = (void*)((char*) buffer + part);
-               size -= context->blockSize;
-            }
-            block = getBlockInChain(block, 1, context);
-            fseek(imgFile, context->dataOffset + block*context->blockSize, SEEK_SET);
-            writtenSize += fwrite(buffer, size, 1, imgFile)*size;
+        DirEntry readRecord;
+        readEntryAt(dirDescr, &readRecord, offset, NULL, context);
+        // first char = FFFF means that record is deleted; 0000 means EOF
+        while (readRecord.name[0] != -1 && readRecord.name[0] != 0) {
+            offset += sizeof(DirEntry);
+            readEntryAt(dirDescr, &readRecord, offset, NULL, context);
         }
+        writeTo(dirDescr, record, sizeof(DirEntry), offset, context);
+    }
+    if (record->fdId == dirDescr->fdId) {
+        // "." link: dirDescr is saved by the caller later, so it must stay up to date
+        dirDescr->nlink++;
+        saveDescriptor(dirDescr, context);
     } else {
-        writtenSize = 0;
+        FileDescriptor descr;
+        getDescriptor(&descr, record->fdId, context);
+        descr.nlink++;
+        // open file, that was unlinked, is linked again(ex. by linkat of its fd)
+        descr.flags &= ~FD_ORPHANED;
+        saveDescriptor(&descr, context);
     }
-    return writtenSize;
 }
 
-/** return: read size(in bytes). 0 means, that (offsetInFile+size) is beyond size of the file */
-size_t readFrom(FileDescriptor *descr, void *buf, size_t size, int offsetInFile, FSContext *context) {
-    FILE *imgFile = context->imgFile;
-    int blockIndex = offsetInFile / context->blockSize;
-    int offsetInBlock = offsetInFile % context->blockSize;
-    
-    // manage reading with size > blockSize
-    size_t portion;
-    if (offsetInBlock + size > context->blockSize) {
-        portion = context->blockSize - offsetInBlock;
-    } else {
-        portion = size;
+/**
+ * Appends entries to directory by one write. Unlike writeDirEntryTo, nlink of linked
+ * descriptors isn't changed: bulk builders count links themselves.
+ */
+void writeDirEntries(FileDescriptor *dirDescr, DirEntry *entries, int64_t entriesN, FSContext *context) {
+    if ((dirDescr->flags & FD_COMPACT_DIR) == 0) {
+        DirEntry readRecord;
+        int64_t offset = 0;
+        readEntryAt(dirDescr, &readRecord, offset, NULL, context);
+        while (readRecord.name[0] != 0) {
+            offset += sizeof(DirEntry);
+            readEntryAt(dirDescr, &readRecord, offset, NULL, context);
+        }
+        writeTo(dirDescr, entries, entriesN*sizeof(DirEntry), offset, context);
+        return;
     }
-    int lastReadBlockIndex  = blockIndex + (size - portion)/context->blockSize;
-    size_t readSize;
-    if (lastReadBlockIndex < descr->occupiedBlocks) {
-        // reading left tail
-        void *buffer = buf;
-        BlockID block = getBlockInChain(descr->firstBlock, blockIndex, context);
-        fseek(imgFile, context->dataOffset + block*context->blockSize + offsetInBlock, SEEK_SET);
-        readSize = fread(buffer, portion, 1, imgFile)*portion;
-        buffer = (void*)((char*) buffer + readSize);
-        size -= portion;
-        if (size > 0) {
-            // reading full block-sized info
-            while (size > context->blockSize) {
-               // picking next block
-               block = getBlockInChain(block, 1, context);
-               fseek(imgFile, context->dataOffset + block*context->blockSize, SEEK_SET);
-               size_t part = fread(buffer, context->blockSize, 1, imgFile)*context->blockSize;
-               readSize += part;
-               buffer = (void*)((char*) buffer + part);
-               size -= context->blockSize;
-            }
-            // reading right tail
-            block = getBlockInChain(block, 1, context);
-            fseek(imgFile, context->dataOffset + block*context->blockSize, SEEK_SET);
-            readSize += fread(buffer, size, 1, imgFile)*size;
+    // records are appended after the last one
+    DirCursor cursor;
+    openDirCursor(&cursor, dirDescr, NULL, 0, context->blockSize, context);
+    int64_t start = 0;
+    int64_t recordOffset;
+    DirRecord *readRecord;
+    while ((readRecord = nextDirRecord(&cursor, &recordOffset, context)) != NULL) {
+        start = recordOffset + readRecord->recordLen;
+    }
+    closeDirCursor(&cursor);
+    // records don't cross blocks, tails of blocks stay zeroed
+    int64_t end = start;
+    for (int64_t i = 0; i < entriesN; i++) {
+        int need = recordSize(strlen(entries[i].name));
+        if (end % context->blockSize + need > context->blockSize) {
+            end = (end / context->blockSize + 1)*context->blockSize;
         }
-    } else {
-        readSize = 0;
+        end += need;
     }
-    return readSize;
-}
-
-/** increments nlink */
-void writeDirEntryTo(FileDescriptor *dirDescr, DirEntry *record, FSContext *context) {
-    DirEntry readRecord;
-    int offset = 0;
-    readFrom(dirDescr, &readRecord, sizeof(DirEntry), offset, context);
-    // first char = FFFF means that record is deleted; 0000 means EOF
-    while (readRecord.name[0] != -1 && readRecord.name[0] != 0) {
-        offset += sizeof(DirEntry);
-        readFrom(dirDescr, &readRecord, sizeof(DirEntry), offset, context);
-    }
-    writeTo(dirDescr, record, sizeof(DirEntry), offset, context);
-    FileDescriptor descr;
-    getDescriptor(&descr, record->fdId, context);
-    descr.nlink++;
-    saveDescriptor(&descr, context);
+    ScratchMark mark = scratchMark();
+    char *buf = scratchAlloc(end - start);
+    memset(buf, 0, end - start);
+    int64_t offset = start;
+    for (int64_t i = 0; i < entriesN; i++) {
+        int need = recordSize(strlen(entries[i].name));
+        if (offset % context->blockSize + need > context->blockSize) {
+            offset = (offset / context->blockSize + 1)*context->blockSize;
+        }
+        fillRecord((DirRecord *)(buf + (offset - start)), entries[i].name, entries[i].fdId, need);
+        offset += need;
+    }
+    if (end > start) {
+        writeTo(dirDescr, buf, end - start, start, context);
+    }
+    scratchRelease(mark);
 }
 
 /** 
  * removes dir enrty by specified name in specified directory
  * return: 0 if succes, else -1.
- * decrements nlink and removes associated descriptor if nlink reaches 0.
+ * decrements nlink and removes associated descriptor if nlink reaches 0,
+ * open file is removed by its last close(see closeFile).
  */
-int deleteDirEntryIn(FileDescriptor *dirDescr, char name[MAX_FNAME_LEN], FSContext *context) {
-    long offset;
-    int fdId = findLinkIn(dirDescr, name, &offset, context);
+int deleteDirEntryIn(FileDescriptor *dirDescr, const char *name, FSContext *context) {
+    int64_t offset;
+    int fdId = findLinkIn(dirDescr, name, &offset, NULL, context);
     int rcode;
     if (fdId != -1) {
-        DirEntry record;
-        record.name[0] = -1;
-        writeTo(dirDescr, &record, sizeof(DirEntry), offset, context);
+        if (dirDescr->flags & FD_COMPACT_DIR) {
+            // record keeps its length, so it's reused by names, that fit it
+            DirRecord header;
+            readFrom(dirDescr, &header, sizeof(DirRecord), offset, context);
+            fillRecord(&header, "", -1, header.recordLen);
+            writeTo(dirDescr, &header, sizeof(DirRecord), offset, context);
+        } else {
+            DirEntry record;
+            record.name[0] = -1;
+            writeTo(dirDescr, &record, sizeof(DirEntry), offset, context);
+        }
         FileDescriptor descr;
+        pthread_mutex_lock(&context->openFilesLock);
         getDescriptor(&descr, fdId, context);
         descr.nlink--;
-        if (descr.nlink == 0) {
+        bool isOpen = getOpenFile(fdId, context) != NULL;
+        if (descr.nlink == 0 && isOpen) {
+            descr.flags |= FD_ORPHANED;
+        }
+        if (descr.nlink == 0 && !isOpen) {
             removeDescriptor(&descr, context);
+        } else {
+            saveDescriptor(&descr, context);
         }
+        pthread_mutex_unlock(&context->openFilesLock);
         rcode = 0;
     } else {
         rcode = -1;
@@ -511,14 +2985,23 @@ int deleteDirEntryIn(FileDescriptor *dirDescr, char name[MAX_FNAME_LEN], FSConte
 }
 
 void makeLink(FileDescriptor *descr, const char *path, FSContext *context) {
-    char *dirPath = malloc((strlen(path)+1)*sizeof(char));
-    DirEntry record;
-    record.fdId = descr->fdId;
-    detachName(path, dirPath, record.name);
+    ScratchMark mark = scratchMark();
+    char *dirPath = scratchAlloc((strlen(path)+1)*sizeof(char));
+    char name[MAX_FNAME_LEN];
+    detachName(path, dirPath, name);
     FileDescriptor dirDescr;
     getDescriptorByPath(&dirDescr, dirPath, context);
-    writeDirEntryTo(&dirDescr, &record, context);
-    free(dirPath);
+    makeLinkIn(&dirDescr, descr, name, context);
+    scratchRelease(mark);
+}
+
+/** links descr into dirDescr under specified name, increments nlink of descr */
+void makeLinkIn(FileDescriptor *dirDescr, FileDescriptor *descr, const char *name, FSContext *context) {
+    DirEntry record;
+    memset(&record, 0, sizeof(DirEntry));
+    strncpy(record.name, name, MAX_FNAME_LEN - 1);
+    record.fdId = descr->fdId;
+    writeDirEntryTo(dirDescr, &record, context);
 }
 
 /**
@@ -537,16 +3020,15 @@ int makeDefaultLinks(FileDescriptor *dirDescr, const char *path, FSContext *cont
             writeDirEntryTo(dirDescr, &record, context);
         } else {
             FileDescriptor parentDir;
-            char *parentPath = malloc((strlen(path)+1)*sizeof(char));
+            ScratchMark mark = scratchMark();
+            char *parentPath = scratchAlloc((strlen(path)+1)*sizeof(char));
             char name[MAX_FNAME_LEN];
             detachName(path, parentPath, name);
             getDescriptorByPath(&parentDir, parentPath, context);
-            free(parentPath);
+            scratchRelease(mark);
             record.fdId = parentDir.fdId;
             writeDirEntryTo(dirDescr, &record, context);
-            record.fdId = dirDescr->fdId;
-            strcpy(record.name, name);
-            writeDirEntryTo(&parentDir, &record, context);
+            makeLinkIn(&parentDir, dirDescr, name, context);
         }
         rcode = 0;
     } else {
@@ -555,14 +3037,37 @@ int makeDefaultLinks(FileDescriptor *dirDescr, const char *path, FSContext *cont
     return rcode;
 }
 
+/**
+ * makes "." and ".." links of dirDescr and links it into parentDir under specified name.
+ * return 0 if success, else -1 - dirDescr type is not FT_DIRECTORY
+ */
+int makeDefaultLinksIn(FileDescriptor *dirDescr, FileDescriptor *parentDir, const char *name, FSContext *context) {
+    if (dirDescr->type != FT_DIRECTORY) {
+        return -1;
+    }
+    DirEntry record;
+    memset(&record, 0, sizeof(DirEntry));
+    record.fdId = dirDescr->fdId;
+    strcpy(record.name, ".");
+    writeDirEntryTo(dirDescr, &record, context);
+    record.fdId = parentDir->fdId;
+    strcpy(record.name, "..");
+    writeDirEntryTo(dirDescr, &record, context);
+    // parentDir's nlink is changed by ".." link on the disk
+    getDescriptor(parentDir, parentDir->fdId, context);
+    makeLinkIn(parentDir, dirDescr, name, context);
+    return 0;
+}
+
 void removeLink(const char *path, FSContext *context) {
-    char *dirPath = malloc((strlen(path)+1)*sizeof(char));
+    ScratchMark mark = scratchMark();
+    char *dirPath = scratchAlloc((strlen(path)+1)*sizeof(char));
     char name[MAX_FNAME_LEN];
     detachName(path, dirPath, name);
     FileDescriptor dirDescr;
     getDescriptorByPath(&dirDescr, dirPath, context);
     deleteDirEntryIn(&dirDescr, name, context);
-    free(dirPath);
+    scratchRelease(mark);
 }
 
 /** ex: path = /dir/file => dirPath = /dir, lastName = file. */
@@ -583,25 +3088,147 @@ static void detachName(const char *path, char *dirPath, char *lastName) {
  * return: id of linked descriptor, or -1 if not found.
  *          and offset of DirEnry in deOffset param
  */
-static int findLinkIn(FileDescriptor *dirDescr, char name[MAX_FNAME_LEN], long *deOffset, FSContext *context) {
-    long offset = 0;
-    DirEntry readRecord;
-    readFrom(dirDescr, &readRecord, sizeof(DirEntry), offset, context);
-    // first char = 0000 means EOF
-    while (strcmp(readRecord.name, name) != 0 && readRecord.name[0] != 0) {
-        offset += sizeof(DirEntry);
-        readFrom(dirDescr, &readRecord, sizeof(DirEntry), offset, context);
+static int findLinkIn(FileDescriptor *dirDescr, const char *name, int64_t *deOffset, FileDescriptor *snapshot, FSContext *context) {
+    int nameLen = strlen(name);
+    uint32_t hash = crc32c(0, name, nameLen);
+    DirCursor cursor;
+    openDirCursor(&cursor, dirDescr, snapshot, 0, context->blockSize, context);
+    int fdId = -1;
+    int64_t offset;
+    DirRecord *record;
+    while ((record = nextDirRecord(&cursor, &offset, context)) != NULL) {
+        if (record->hash == hash && record->nameLen == nameLen && memcmp(record + 1, name, nameLen) == 0) {
+            fdId = record->fdId;
+            if (deOffset != NULL) {
+                *deOffset = offset;
+            }
+            break;
+        }
     }
-    int fdId;
-    if (readRecord.name[0] != 0) {
-        fdId = readRecord.fdId;
-        if (deOffset != NULL) {
-            *deOffset = offset;
+    closeDirCursor(&cursor);
+    return fdId;
+}
+
+/**
+ * windowSize is the size of reads: whole blocks for scans, one record for iteration by offsets.
+ * Cursor must be closed by the caller.
+ */
+static void openDirCursor(DirCursor *cursor, FileDescriptor *dirDescr, FileDescriptor *snapshot, int64_t offset,
+        int windowSize, FSContext *context) {
+    cursor->dirDescr = dirDescr;
+    cursor->snapshot = snapshot;
+    cursor->offset = offset;
+    cursor->windowSize = windowSize > (int)MAX_RECORD_LEN ? windowSize : (int)MAX_RECORD_LEN;
+    cursor->mark = scratchMark();
+    cursor->window = scratchAlloc(cursor->windowSize);
+    cursor->windowOffset = 0;
+    cursor->windowLen = 0;
+    cursor->gapNeed = 0;
+    cursor->gapOffset = -1;
+}
+
+/** window is released, buffers taken after openDirCursor must be released already */
+static void closeDirCursor(DirCursor *cursor) {
+    scratchRelease(cursor->mark);
+}
+
+/**
+ * return: the next record(free ones too), it stays valid until the next call. NULL means the end of directory.
+ * Records of directories without FD_COMPACT_DIR are converted from DirEntry.
+ */
+static DirRecord *nextDirRecord(DirCursor *cursor, int64_t *recordOffset, FSContext *context) {
+    int blockSize = context->blockSize;
+    if ((cursor->dirDescr->flags & FD_COMPACT_DIR) == 0) {
+        DirEntry entry;
+        readEntryAt(cursor->dirDescr, &entry, cursor->offset, cursor->snapshot, context);
+        if (entry.name[0] == 0) {
+            return NULL;
+        }
+        DirRecord *record = (DirRecord *)cursor->window;
+        entry.name[MAX_FNAME_LEN - 1] = 0;
+        fillRecord(record, entry.name[0] == -1 ? "" : entry.name, entry.fdId, sizeof(DirEntry));
+        *recordOffset = cursor->offset;
+        cursor->offset += sizeof(DirEntry);
+        return record;
+    }
+    while (true) {
+        int64_t offset = cursor->offset;
+        int64_t blockEnd = (offset / blockSize + 1)*blockSize;
+        if (blockEnd - offset < (int64_t)sizeof(DirRecord)) {
+            cursor->offset = blockEnd;
+            continue;
+        }
+        if (offset < cursor->windowOffset || offset + (int64_t)sizeof(DirRecord) > cursor->windowOffset + cursor->windowLen) {
+            if (!fillDirWindow(cursor, offset, context)) {
+                return NULL;
+            }
+        }
+        DirRecord *record = (DirRecord *)(cursor->window + (offset - cursor->windowOffset));
+        if (record->recordLen == 0) {
+            if (cursor->gapNeed > 0 && cursor->gapOffset == -1 && blockEnd - offset >= cursor->gapNeed) {
+                cursor->gapOffset = offset;
+            }
+            cursor->offset = blockEnd;
+            continue;
         }
+        if (offset + (int64_t)sizeof(DirRecord) + record->nameLen > cursor->windowOffset + cursor->windowLen) {
+            fillDirWindow(cursor, offset, context);
+            record = (DirRecord *)cursor->window;
+        }
+        *recordOffset = offset;
+        cursor->offset = offset + record->recordLen;
+        return record;
+    }
+}
+
+/** reads window from offset up to the end of its block. return: false at the end of directory */
+static bool fillDirWindow(DirCursor *cursor, int64_t offset, FSContext *context) {
+    int64_t blockEnd = (offset / context->blockSize + 1)*context->blockSize;
+    int size = blockEnd - offset < cursor->windowSize ? blockEnd - offset : cursor->windowSize;
+    memset(cursor->window, 0, size);
+    ssize_t readSize;
+    if (cursor->snapshot == NULL) {
+        readSize = readFrom(cursor->dirDescr, cursor->window, size, offset, context);
     } else {
-        fdId = -1;
+        readSize = readFromSnapshot(cursor->snapshot, cursor->dirDescr, cursor->window, size, offset, context);
+    }
+    if (readSize <= 0) {
+        return false;
+    }
+    // inline contents are shorter, zeroes after them end the records
+    cursor->windowOffset = offset;
+    cursor->windowLen = size;
+    return true;
+}
+
+/** return: size of compact record with name of nameLen chars */
+static int recordSize(int nameLen) {
+    return (sizeof(DirRecord) + nameLen + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+/** empty name makes free record. Name must fit record, that is followed by recordLen - sizeof(DirRecord) bytes */
+static void fillRecord(DirRecord *record, const char *name, int fdId, int recordLen) {
+    int nameLen = strlen(name);
+    record->fdId = fdId;
+    record->hash = nameLen > 0 ? crc32c(0, name, nameLen) : 0;
+    record->recordLen = recordLen;
+    record->nameLen = nameLen;
+    record->reserved = 0;
+    memcpy(record + 1, name, nameLen);
+}
+
+/** reads dir entry of live directory or directory of snapshot(if snapshot != NULL). */
+static void readEntryAt(FileDescriptor *dirDescr, DirEntry *entry, int64_t offset, FileDescriptor *snapshot, FSContext *context) {
+    ssize_t readSize;
+    if (snapshot == NULL) {
+        readSize = readFrom(dirDescr, entry, sizeof(DirEntry), offset, context);
+    } else {
+        readSize = readFromSnapshot(snapshot, dirDescr, entry, sizeof(DirEntry), offset, context);
+    }
+    if (readSize != sizeof(DirEntry)) {
+        // end of directory's blocks
+        entry->name[0] = 0;
     }
-    return fdId;
 }
 
 /** 
@@ -610,32 +3237,80 @@ static int findLinkIn(FileDescriptor *dirDescr, char name[MAX_FNAME_LEN], long *
  * return: id of linked descriptor, or -1 if not found.
  */
 int getDescriptorByPath(FileDescriptor *descr, const char *path, FSContext *context) {
+    return lookupPath(descr, path, NULL, context);
+}
+
+/** 
+ * The same as getDescriptorByPath, but path is resolved in the tree of snapshot.
+ */
+/** 
+ * searches hard link by name in directory and writes found descriptor in descr struct
+ * return: id of linked descriptor, or -1 if not found.
+ */
+int getDescriptorByName(FileDescriptor *descr, FileDescriptor *dirDescr, const char *name, FSContext *context) {
+    int fdId = findLinkIn(dirDescr, name, NULL, NULL, context);
+    if (fdId != -1) {
+        getDescriptor(descr, fdId, context);
+    }
+    return fdId;
+}
+
+/** The same as getDescriptorByName, but for directory of snapshot */
+int getDescriptorByNameIn(FileDescriptor *snapshot, FileDescriptor *descr, FileDescriptor *dirDescr, const char *name, FSContext *context) {
+    int fdId = findLinkIn(dirDescr, name, NULL, snapshot, context);
+    if (fdId != -1) {
+        getSnapshotDescriptor(snapshot, descr, fdId, context);
+    }
+    return fdId;
+}
+
+int getDescriptorByPathIn(FileDescriptor *snapshot, FileDescriptor *descr, const char *path, FSContext *context) {
+    return lookupPath(descr, path, snapshot, context);
+}
+
+static int lookupPath(FileDescriptor *descr, const char *path, FileDescriptor *snapshot, FSContext *context) {
     int fdId;
+    FileDescriptor currentDir;
+    if (snapshot == NULL) {
+        memcpy(&currentDir, context->root, sizeof(FileDescriptor));
+    } else {
+        getSnapshotDescriptor(snapshot, &currentDir, 0, context);
+    }
     if (strcmp(path, "/") == 0) {
-        memcpy(descr, context->root, sizeof(FileDescriptor));
+        memcpy(descr, &currentDir, sizeof(FileDescriptor));
         fdId = descr->fdId;
     } else {
         char delim[2] = "/";
         char *name;
-        char *pathCopy = malloc((strlen(path)+1)*sizeof(char));
+        char *savePtr;
+        ScratchMark mark = scratchMark();
+        char *pathCopy = scratchAlloc((strlen(path)+1)*sizeof(char));
         strcpy(pathCopy, path);
-        FileDescriptor currentDir;
-        memcpy(&currentDir, context->root, sizeof(FileDescriptor));
-        name = strtok(pathCopy, delim);
+        name = strtok_r(pathCopy, delim, &savePtr);
+        // path of slashes only(ex. "//") is the root, empty path names no file
+        fdId = -1;
+        if (name == NULL && path[0] == '/') {
+            memcpy(descr, &currentDir, sizeof(FileDescriptor));
+            fdId = descr->fdId;
+        }
         bool rightPath = true;
         while( name != NULL  && rightPath) {
-            fdId = findLinkIn(&currentDir, name, NULL, context);
+            fdId = findLinkIn(&currentDir, name, NULL, snapshot, context);
             if (fdId != -1) {
-                getDescriptor(descr, fdId, context);
+                if (snapshot == NULL) {
+                    getDescriptor(descr, fdId, context);
+                } else {
+                    getSnapshotDescriptor(snapshot, descr, fdId, context);
+                }
                 if (descr->type == FT_DIRECTORY) {
                     memcpy(&currentDir, descr, sizeof(FileDescriptor));
                 }
-                name = strtok(NULL, delim);
+                name = strtok_r(NULL, delim, &savePtr);
             } else {
                 rightPath = false;
             }
         }
-        free(pathCopy);
+        scratchRelease(mark);
     }
     return fdId;
 }
@@ -647,49 +3322,426 @@ int getDescriptorByPath(FileDescriptor *descr, const char *path, FSContext *cont
  */
 int getEntryFrom(FileDescriptor *dirDescr, DirEntry *entry, FSContext *context) {
     static FileDescriptor *descr;
-    static int offset;
+    static int64_t offset;
     if (dirDescr != NULL) {
         descr = dirDescr;
         offset = 0;
     }
-    readFrom(descr, entry, sizeof(DirEntry), offset, context);
-    while (entry->name[0] == -1 && entry->name[0] != 0) {
-        offset += sizeof(DirEntry);
-        readFrom(descr, entry, sizeof(DirEntry), offset, context);
+    return getSnapshotEntry(NULL, descr, entry, &offset, context);
+}
+
+/*
+ * Snapshot is a file in the directory of snapshots, that contains: number of
+ * descriptors(int64), copies of all descriptors, offsets of block lists in the
+ * snapshot(int64 per descriptor) and block lists of files. Blocks of files are
+ * shared with live filesystem, until it writes to them.
+ */
+#define SNAPSHOT_CHUNK (1024*1024)
+
+typedef struct {
+    FileDescriptor *snapshot;
+    char *buf;
+    size_t used;
+    int64_t offset;
+} SnapshotWriter;
+
+/** return: false if there is not enough space */
+static bool flushSnapshotWriter(SnapshotWriter *writer, FSContext *context) {
+    bool success = true;
+    if (writer->used > 0) {
+        success = writeTo(writer->snapshot, writer->buf, writer->used, writer->offset, context) == writer->used;
+        writer->offset += writer->used;
+        writer->used = 0;
+    }
+    return success;
+}
+
+/** return: false if there is not enough space */
+static bool appendToSnapshot(SnapshotWriter *writer, const void *data, size_t size, FSContext *context) {
+    const char *src = data;
+    bool success = true;
+    while (size > 0 && success) {
+        size_t part = SNAPSHOT_CHUNK - writer->used;
+        if (part > size) {
+            part = size;
+        }
+        memcpy(writer->buf + writer->used, src, part);
+        writer->used += part;
+        src += part;
+        size -= part;
+        if (writer->used == SNAPSHOT_CHUNK) {
+            success = flushSnapshotWriter(writer, context);
+        }
+    }
+    return success;
+}
+
+/** snapshot includes all files, except deleted, internal and unlinked(but still open) ones */
+static bool isInSnapshot(FileDescriptor *descr) {
+    return descr->type != FT_DELETED && (descr->flags & (FD_INTERNAL | FD_ORPHANED)) == 0;
+}
+
+/**
+ * Freezes current state of the filesystem under specified name.
+ * Descriptors and block lists of all files are copied, blocks themselves are shared.
+ * return: 0 if success,
+ *         -1 means, that there are no free blocks;
+ *         -2 means, that number of descriptors have reached its maximum;
+ *         -3 means, that name is taken or too long.
+ */
+int createSnapshot(const char *name, FSContext *context) {
+    if (strlen(name) >= MAX_FNAME_LEN) {
+        return -3;
+    }
+    FileDescriptor snapshotsDir;
+    if (getSnapshotsDir(&snapshotsDir, context) == -1) {
+        snapshotsDir.type = FT_DIRECTORY;
+        snapshotsDir.size = 0;
+        if (createDescriptor(&snapshotsDir, context) < 0) {
+            return -2;
+        }
+        snapshotsDir.flags = FD_INTERNAL | FD_COMPACT_DIR;
+        saveDescriptor(&snapshotsDir, context);
+        // "." and ".." of the directory point to itself, as it isn't linked anywhere
+        makeDefaultLinks(&snapshotsDir, "/", context);
+        context->snapshotsFdId = snapshotsDir.fdId;
+        fillHeaderIn(context);
+    }
+    if (findLinkIn(&snapshotsDir, name, NULL, NULL, context) != -1) {
+        return -3;
+    }
+    FileDescriptor snapshot;
+    snapshot.type = FT_REGULAR;
+    snapshot.size = 0;
+    if (createDescriptor(&snapshot, context) < 0) {
+        return -2;
+    }
+    snapshot.flags = FD_INTERNAL;
+    saveDescriptor(&snapshot, context);
+
+    int64_t descriptorsN = context->maxFileN;
+    int64_t *listOffsets = malloc(descriptorsN*sizeof(int64_t));
+    int64_t snapshotSize = sizeof(int64_t) + descriptorsN*(sizeof(FileDescriptor) + sizeof(int64_t));
+    int64_t maxBlocksN = 0;
+    FileDescriptor descr;
+    for (int fdId = 0; fdId < descriptorsN; fdId++) {
+        getDescriptor(&descr, fdId, context);
+        listOffsets[fdId] = snapshotSize;
+        if (isInSnapshot(&descr)) {
+            snapshotSize += descr.occupiedBlocks*sizeof(BlockID);
+            if (descr.occupiedBlocks > maxBlocksN) {
+                maxBlocksN = descr.occupiedBlocks;
+            }
+        }
+    }
+    bool success = snapshotSize/context->blockSize + 1 < numberOfFreeBlocks(context);
+    if (success) {
+        SnapshotWriter writer = { &snapshot, malloc(SNAPSHOT_CHUNK), 0, 0 };
+        appendToSnapshot(&writer, &descriptorsN, sizeof(int64_t), context);
+        for (int fdId = 0; fdId < descriptorsN; fdId++) {
+            getDescriptor(&descr, fdId, context);
+            if (!isInSnapshot(&descr)) {
+                descr.type = FT_DELETED;
+            }
+            appendToSnapshot(&writer, &descr, sizeof(FileDescriptor), context);
+        }
+        appendToSnapshot(&writer, listOffsets, descriptorsN*sizeof(int64_t), context);
+        BlockID *blocks = malloc((maxBlocksN > 0 ? maxBlocksN : 1)*sizeof(BlockID));
+        // files before sharedFdId share their blocks with the snapshot
+        int sharedFdId = 0;
+        while (sharedFdId < descriptorsN && success) {
+            getDescriptor(&descr, sharedFdId, context);
+            if (isInSnapshot(&descr) && descr.occupiedBlocks > 0) {
+                int64_t blocksN = getBlocksOf(&descr, blocks, context);
+                success = appendToSnapshot(&writer, blocks, blocksN*sizeof(BlockID), context);
+                if (success) {
+                    addSharedRefs(blocks, blocksN, 1, context);
+                }
+            }
+            if (success) {
+                sharedFdId++;
+            }
+        }
+        success = success && flushSnapshotWriter(&writer, context);
+        if (!success) {
+            // the snapshot file holds only its own blocks, references of shared ones are dropped here
+            for (int fdId = 0; fdId < sharedFdId; fdId++) {
+                getDescriptor(&descr, fdId, context);
+                if (isInSnapshot(&descr) && descr.occupiedBlocks > 0) {
+                    addSharedRefs(blocks, getBlocksOf(&descr, blocks, context), -1, context);
+                }
+            }
+        }
+        free(blocks);
+        free(writer.buf);
+    }
+    free(listOffsets);
+    if (!success) {
+        snapshot.size = snapshotSize;
+        saveDescriptor(&snapshot, context);
+        removeDescriptor(&snapshot, context);
+        return -1;
+    }
+    snapshot.size = snapshotSize;
+    saveDescriptor(&snapshot, context);
+    DirEntry record;
+    strcpy(record.name, name);
+    record.fdId = snapshot.fdId;
+    writeDirEntryTo(&snapshotsDir, &record, context);
+    return 0;
+}
+
+/**
+ * Drops snapshot: its blocks, that aren't used by live files or other snapshots, become free.
+ * return: 0 if success, -1 if there is no such snapshot.
+ */
+int removeSnapshot(const char *name, FSContext *context) {
+    FileDescriptor snapshotsDir;
+    FileDescriptor snapshot;
+    if (getSnapshot(&snapshot, name, context) == -1) {
+        return -1;
+    }
+    getSnapshotsDir(&snapshotsDir, context);
+    int64_t descriptorsN;
+    readFrom(&snapshot, &descriptorsN, sizeof(int64_t), 0, context);
+    int64_t offset = sizeof(int64_t) + descriptorsN*(sizeof(FileDescriptor) + sizeof(int64_t));
+    BlockID *blocks = malloc(SNAPSHOT_CHUNK);
+    while (offset < snapshot.size) {
+        size_t part = snapshot.size - offset < SNAPSHOT_CHUNK ? snapshot.size - offset : SNAPSHOT_CHUNK;
+        readFrom(&snapshot, blocks, part, offset, context);
+        for (size_t i = 0; i < part/sizeof(BlockID); i++) {
+            releaseBlock(blocks[i], context);
+        }
+        offset += part;
+    }
+    free(blocks);
+    // snapshot file is removed with its last link
+    deleteDirEntryIn(&snapshotsDir, name, context);
+    return 0;
+}
+
+/** return: fdId of directory of snapshots, or -1 if there are no snapshots yet */
+int getSnapshotsDir(FileDescriptor *dirDescr, FSContext *context) {
+    if (context->snapshotsFdId == 0) {
+        return -1;
+    }
+    getDescriptor(dirDescr, context->snapshotsFdId, context);
+    return context->snapshotsFdId;
+}
+
+/** return: fdId of snapshot file, or -1 if there is no such snapshot */
+int getSnapshot(FileDescriptor *snapshot, const char *name, FSContext *context) {
+    FileDescriptor snapshotsDir;
+    if (getSnapshotsDir(&snapshotsDir, context) == -1) {
+        return -1;
+    }
+    int fdId = findLinkIn(&snapshotsDir, name, NULL, NULL, context);
+    if (fdId != -1) {
+        getDescriptor(snapshot, fdId, context);
+        if (snapshot->type != FT_REGULAR) {
+            // "." or ".."
+            fdId = -1;
+        }
+    }
+    return fdId;
+}
+
+/** reads copy of descriptor, that was made by snapshot */
+void getSnapshotDescriptor(FileDescriptor *snapshot, FileDescriptor *descr, int fdId, FSContext *context) {
+    readFrom(snapshot, descr, sizeof(FileDescriptor), sizeof(int64_t) + (int64_t)fdId*sizeof(FileDescriptor), context);
+}
+
+/** 
+ * The same as readFrom, but for file of snapshot: blocks are taken from
+ * block list of the snapshot instead of FAT.
+ */
+ssize_t readFromSnapshot(FileDescriptor *snapshot, FileDescriptor *descr, void *buf, size_t size, int64_t offsetInFile, FSContext *context) {
+    if (descr->occupiedBlocks == 0) {
+        // inline data doesn't depend on FAT
+        return readFrom(descr, buf, size, offsetInFile, context);
+    }
+    int64_t blockIndex = offsetInFile / context->blockSize;
+    int offsetInBlock = offsetInFile % context->blockSize;
+    size_t portion;
+    if (offsetInBlock + size > context->blockSize) {
+        portion = context->blockSize - offsetInBlock;
+    } else {
+        portion = size;
+    }
+    int64_t lastReadBlockIndex  = blockIndex + (int64_t)((size - portion + context->blockSize - 1)/context->blockSize);
+    ssize_t readSize = 0;
+    if (lastReadBlockIndex < descr->occupiedBlocks) {
+        int64_t descriptorsN;
+        int64_t listOffset;
+        if (readFrom(snapshot, &descriptorsN, sizeof(int64_t), 0, context) != sizeof(int64_t)
+                || readFrom(snapshot, &listOffset, sizeof(int64_t), sizeof(int64_t)
+                    + descriptorsN*sizeof(FileDescriptor) + (int64_t)descr->fdId*sizeof(int64_t), context) != sizeof(int64_t)) {
+            return -1;
+        }
+        int64_t blocksN = lastReadBlockIndex - blockIndex + 1;
+        ScratchMark mark = scratchMark();
+        BlockID *blocks = scratchAlloc(blocksN*sizeof(BlockID));
+        if (readFrom(snapshot, blocks, blocksN*sizeof(BlockID), listOffset + blockIndex*sizeof(BlockID), context)
+                != blocksN*sizeof(BlockID)) {
+            readSize = -1;
+        }
+        BlockPart *parts = scratchAlloc(blocksN*sizeof(BlockPart));
+        char *buffer = buf;
+        for (int64_t i = 0; i < blocksN; i++) {
+            parts[i].block = blocks[i];
+            parts[i].offsetInBlock = offsetInBlock;
+            parts[i].buf = buffer;
+            parts[i].size = portion;
+            buffer += portion;
+            size -= portion;
+            offsetInBlock = 0;
+            portion = size > context->blockSize ? context->blockSize : size;
+        }
+        if (readSize != -1) {
+            readSize = readBlockParts(parts, blocksN, classOf(descr), context);
+        }
+        scratchRelease(mark);
+    }
+    return readSize;
+}
+
+/** 
+ * Iterates over entries of directory, *offset must be 0 for the first entry.
+ * Unlike getEntryFrom, several directories may be iterated at once.
+ * return: 0, or -1 if there are no entries
+ */
+int getEntryAt(FileDescriptor *dirDescr, DirEntry *entry, int64_t *offset, FSContext *context) {
+    return getSnapshotEntry(NULL, dirDescr, entry, offset, context);
+}
+
+/** 
+ * Iterates over entries of directory in snapshot(or live directory if snapshot is NULL),
+ * *offset must be 0 for the first entry.
+ * return: 0, or -1 if there are no entries
+ */
+int getSnapshotEntry(FileDescriptor *snapshot, FileDescriptor *dirDescr, DirEntry *entry, int64_t *offset, FSContext *context) {
+    DirCursor cursor;
+    openDirCursor(&cursor, dirDescr, snapshot, *offset, MAX_RECORD_LEN, context);
+    int64_t recordOffset;
+    DirRecord *record = nextDirRecord(&cursor, &recordOffset, context);
+    while (record != NULL && record->nameLen == 0) {
+        record = nextDirRecord(&cursor, &recordOffset, context);
     }
     int returnCode;
-    if (entry->name[0] != 0) {
-        offset += sizeof(DirEntry);
+    if (record != NULL) {
+        memcpy(entry->name, record + 1, record->nameLen);
+        entry->name[record->nameLen] = 0;
+        entry->fdId = record->fdId;
+        *offset = cursor.offset;
         returnCode = 0;
     } else {
         returnCode = -1;
     }
+    closeDirCursor(&cursor);
     return returnCode;
 }
 
+/**
+ * header: magic, version, devSize, blockSize, maxFileN, flags, snapshotsFdId, membersN, stripeBlocks,
+ * fatOffset, dataOffset, groupBlocks, fastSlotsN, generation, generationDevSize
+ */
 static void fillHeaderIn(FSContext *context) {
     FILE *imgFile = context->imgFile;
-    fseek(imgFile, HEADER_OFFSET, SEEK_SET);
-    fwrite(&(context->devSize), sizeof(long),1, imgFile);
-    fwrite(&(context->blockSize), sizeof(int),1, imgFile);
-    fwrite(&(context->maxFileN), sizeof(int),1, imgFile);
+    uint32_t magic = IMG_MAGIC, version = IMG_VERSION;
+    fseeko(imgFile, HEADER_OFFSET, SEEK_SET);
+    fwrite(&magic, sizeof(uint32_t), 1, imgFile);
+    fwrite(&version, sizeof(uint32_t), 1, imgFile);
+    fwrite(&(context->devSize), sizeof(int64_t), 1, imgFile);
+    fwrite(&(context->blockSize), sizeof(int32_t), 1, imgFile);
+    fwrite(&(context->maxFileN), sizeof(int32_t), 1, imgFile);
+    fwrite(&(context->flags), sizeof(uint32_t), 1, imgFile);
+    fwrite(&(context->snapshotsFdId), sizeof(int32_t), 1, imgFile);
+    fwrite(&(context->membersN), sizeof(int32_t), 1, imgFile);
+    fwrite(&(context->stripeBlocks), sizeof(int32_t), 1, imgFile);
+    int64_t fatOffset = context->fatOffset, dataOffset = context->dataOffset;
+    fwrite(&fatOffset, sizeof(int64_t), 1, imgFile);
+    fwrite(&dataOffset, sizeof(int64_t), 1, imgFile);
+    fwrite(&(context->groupBlocks), sizeof(int32_t), 1, imgFile);
+    fwrite(&(context->fastSlotsN), sizeof(int64_t), 1, imgFile);
+    fwrite(&(context->generation), sizeof(int64_t), 1, imgFile);
+    fwrite(&(context->generationDevSize), sizeof(int64_t), 1, imgFile);
 }
 
+/**
+ * Tables are placed right after descriptors, unless fatOffset is already known:
+ * image, that has grown, keeps them behind its data region (see growImgFile).
+ */
 static void defineOffsets(FSContext *context) {
-    context->descriptorsOffset = HEADER_OFFSET + 2*sizeof(int) + sizeof(long);
-    context->fatOffset = context->descriptorsOffset + context->maxFileN*sizeof(FileDescriptor)
-                        + sizeof(BlockID); // therefore, [fatOffset - sizeof(BlockID)] points to pointer to 1st free block
-    int fatSize = (context->devSize / context->blockSize)*sizeof(BlockID);
-    context->dataOffset = context->fatOffset + fatSize;
-}
-
-/** size in bytes */
-static void grindFile(FILE *file, long size) {
-    long kbs = size/1024;
-    int intsInKb = 1024/sizeof(int);
-    int *zeroes = malloc(intsInKb*(sizeof(int)));
-    for (int i = 1; i <= kbs; i++) {
-        fwrite(zeroes, sizeof(int), intsInKb, file);
-    }
-    free(zeroes);
+    context->descriptorsOffset = HEADER_OFFSET + HEADER_SIZE;
+    if (context->fatOffset != 0) {
+        defineTablesOffsets(context);
+        return;
+    }
+    BlockID blocksN = context->devSize / context->blockSize;
+    context->fatOffset = context->descriptorsOffset + (off_t)context->maxFileN*sizeof(FileDescriptor)
+                        + getGroupsN(blocksN, context)*sizeof(BlockID); // heads of free lists of groups
+    defineTablesOffsets(context);
+    context->dataOffset = context->descrChangesOffset + getDescrChangesSize(context);
+}
+
+/** per-block tables follow FAT */
+static void defineTablesOffsets(FSContext *context) {
+    BlockID blocksN = context->devSize / context->blockSize;
+    context->groupsN = getGroupsN(blocksN, context);
+    context->storedSizesOffset = context->fatOffset + blocksN*sizeof(BlockID);
+    // stored size of each block: 0 means, that block is stored raw
+    context->sharedRefsOffset = context->storedSizesOffset + blocksN*sizeof(uint32_t);
+    // number of snapshots, that share the block besides its owner
+    context->checksumsOffset = context->sharedRefsOffset + blocksN*sizeof(uint32_t);
+    // CRC32C of stored bytes of each block, there is no table without IMG_CHECKSUMS
+    context->tierTableOffset = context->checksumsOffset + ((context->flags & IMG_CHECKSUMS) ? blocksN*sizeof(uint32_t) : 0);
+    // blocks of fast slots, there is no table without fast tier
+    context->blockChangesOffset = context->tierTableOffset + context->fastSlotsN*sizeof(BlockID);
+    // changes of blocks and descriptors since the beginning of generation, there are no tables without tracking
+    context->descrChangesOffset = context->blockChangesOffset + getBlockChangesSize(blocksN, context);
+}
+
+/** return: end of data region in the first backing file, data region of the fast tier is its slots */
+static off_t getDataEnd(FSContext *context) {
+    int64_t blocksN = context->fastSlotsN > 0 ? context->fastSlotsN
+            : getMemberBlocks(context->devSize / context->blockSize, context);
+    return context->dataOffset + blocksN*(off_t)context->blockSize;
+}
+
+/** return: number of blocks, that each backing file with stripes keeps, when image has blocksN blocks */
+static int64_t getMemberBlocks(BlockID blocksN, FSContext *context) {
+    int64_t roundBlocks = (int64_t)context->stripeBlocks*getDataMembersN(context);
+    return (blocksN + roundBlocks - 1) / roundBlocks * context->stripeBlocks;
+}
+
+/** size in bytes. Extends file sparsely, so multi-terabyte images are created instantly */
+static void grindFile(FILE *file, int64_t size) {
+    fflush(file);
+    ftruncate(fileno(file), size);
+}
+
+/** the same as grindFile, but file is never shrunk */
+static void extendFile(FILE *file, off_t size) {
+    struct stat st;
+    fflush(file);
+    if (fstat(fileno(file), &st) == 0 && st.st_size < size) {
+        ftruncate(fileno(file), size);
+    }
+}
+
+/**
+ * copies size bytes of file from offset "from" to offset "to", ranges must not overlap.
+ * It goes around stdio buffers, as FAT is accessed that way.
+ */
+static bool copyRange(FILE *file, off_t from, off_t to, off_t size) {
+    char *buf = malloc(COPY_CHUNK);
+    bool success = true;
+    fflush(file);
+    for (off_t done = 0; done < size && success; done += COPY_CHUNK) {
+        size_t portion = size - done > COPY_CHUNK ? COPY_CHUNK : size - done;
+        success = pread(fileno(file), buf, portion, from + done) == portion
+                && pwrite(fileno(file), buf, portion, to + done) == portion;
+    }
+    free(buf);
+    return success;
 }
\ No newline at end of file
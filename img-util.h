@@ -4,22 +4,41 @@
 #define bool char
 #define true 1
 #define false 0
-     
+
 #define MAX_FNAME_LEN 128
+#define INLINE_DATA_SIZE 216 // descriptor record takes 256 bytes
+
+#define IMG_MAGIC 0x53464d49 // "IMFS"
+#define IMG_VERSION 5
+
+#define IMG_COMPRESSED 0x1 // new files are created with FD_COMPRESSED
+#define IMG_CHECKSUMS 0x2  // CRC32C of each block is kept and verified on read
 
+#define FD_COMPRESSED 0x1  // blocks are compressed on write
+#define FD_INTERNAL 0x2    // snapshot or directory of snapshots, they aren't included in snapshots
+#define FD_COMPACT_DIR 0x4 // directory keeps variable-length records, older ones keep DirEntry records
+#define FD_ORPHANED 0x8    // the last link is removed while file is open, it's released by the last close
+
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "blockio.h"
 
-typedef int BlockID;
+typedef int64_t BlockID;
 
 typedef enum { FT_DELETED=0, FT_REGULAR, FT_DIRECTORY, FT_SYMLINK} FileType;
 
 typedef struct {
     int fdId;
     FileType type;
-    int size;
+    int64_t size;
     int nlink;
+    int flags;
     BlockID firstBlock;
-    int occupiedBlocks;
+    int64_t occupiedBlocks;   // 0 means, that contents are stored in inlineData
+    char inlineData[INLINE_DATA_SIZE];
 } FileDescriptor;
 
 typedef struct {
@@ -27,41 +46,181 @@ typedef struct {
     int fdId;
 } DirEntry;
 
+/** State of an open file, that is shared by all its opens */
+typedef struct {
+    FileDescriptor descr;     // the latest descriptor, it's saved on flush
+    BlockID *blockMap;        // blocks of the file in chain order, NULL until the first access
+    int64_t mapCapacity;
+    bool dirty;               // descr has changes, that aren't saved yet
+    int refs;                 // number of opens
+} OpenFile;
+
+/** Run of file contents, that lies contiguously in one backing file */
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t size;
+} FileExtent;
+
+/** Block of file, as it's stored: it's read, verified and decompressed without img-util(see locateFileBlocks) */
+typedef struct {
+    int fd;
+    off_t offset;
+    uint32_t storedSize;       // compressed size, 0 means, that block is stored raw
+    uint32_t checksum;         // CRC32C of stored bytes, it's kept by image with IMG_CHECKSUMS only
+} StoredBlock;
+
+/** Range of blocks with its own free list, so writers of different groups don't contend */
+typedef struct {
+    pthread_mutex_t lock;     // guards the free list of the group
+    BlockID firstFree;        // -1 means, that group is full
+    int64_t freeBlocksN;
+} AllocGroup;
+
+/**
+ * Fast tier of image: slots behind the tables of the first backing file keep blocks, that are accessed
+ * often, in place of their stripes on the slow tier. Blocks are moved between tiers by migrateBlocks.
+ */
+typedef struct {
+    int64_t slotsN;
+    BlockID *slotBlocks;       // block, that each slot keeps, -1 for free slot
+    int32_t *blockSlots;       // slot of each block, -1 if block is kept by the slow tier
+    uint8_t *heat;             // recent accesses of each block, counts are approximate and decay on migration
+    int64_t freeSlotsN;
+    int64_t clockHand;         // slot, that is checked for eviction next
+    BlockID *candidates;       // blocks, that became hot since the last migration
+    int candidatesN;
+    pthread_mutex_t candidatesLock;
+    pthread_rwlock_t lock;     // I/O holds it shared, migration of a block holds it exclusively
+    pthread_t migrator;
+    bool migratorRunning;
+    int intervalMs;            // pause of migrator between passes
+    pthread_mutex_t stopLock;
+    pthread_cond_t stopCond;
+    bool stopping;
+} TierMap;
+
+/**
+ * Changes of image since the beginning of its generation: blocks(their contents or entries of tables)
+ * and descriptors, that were written. Bits are kept in memory and in tables of the image.
+ */
+typedef struct {
+    uint8_t *blockBits;        // CHANGED_ENTRIES and CHANGED_DATA bits of each block, 4 blocks per byte
+    uint8_t *descrBits;        // bit of each descriptor
+    pthread_mutex_t lock;      // orders saving of bits, that are set concurrently
+} ChangeMap;
+
 typedef struct {
     FILE *imgFile;
-    long devSize;
+    int membersN;              // number of backing files, data region is striped across them
+    int stripeBlocks;          // stripe unit(in blocks)
+    FILE **members;            // backing files, members[0] is imgFile, that keeps metadata
+    int64_t devSize;
     int blockSize;
     int maxFileN;
-    long descriptorsOffset;
-    long fatOffset;
-    long dataOffset;
+    uint32_t flags;
+    int snapshotsFdId;    // 0 means, that there are no snapshots yet
+    off_t descriptorsOffset;
+    off_t fatOffset;
+    off_t storedSizesOffset;
+    off_t sharedRefsOffset;
+    off_t checksumsOffset;
+    off_t dataOffset;
+    int groupBlocks;           // blocks per allocation group, 0 means one group for the whole image
+    int groupsN;
+    AllocGroup *groups;        // heads of free lists are kept on the disk in front of FAT
     FileDescriptor *root;
+    BlockIOEngine *ioEngine;   // NULL means synchronous I/O
+    int64_t fastSlotsN;        // 0 means, that image has no fast tier
+    off_t tierTableOffset;     // blocks of fast slots(block + 1, 0 for free slot)
+    TierMap *tiers;            // NULL if image has no fast tier
+    int64_t generation;        // number of exports of changes plus 1, 0 means, that changes aren't tracked
+    int64_t generationDevSize; // size of image, when the generation began
+    off_t blockChangesOffset;
+    off_t descrChangesOffset;
+    ChangeMap *changes;        // NULL if changes aren't tracked
+    const char *zeroBlock;     // blockSize zeroes, that are shared by all writers of zeroes
+    uint32_t zeroChecksum;     // CRC32C of zeroBlock
+    OpenFile **openFiles;      // indexed by fdId, NULL for files, that aren't open
+    uint32_t *fdGenerations;   // times each fdId was taken by a new file since opening, NULL if not counted
+    pthread_mutex_t openFilesLock;
 } FSContext;
 
-FSContext *createImgFile(char *imgPath, long devSize, int blockSize, int maxFileN);
+FSContext *createImgFile(char *imgPath, int64_t devSize, int blockSize, int maxFileN, uint32_t flags);
 void closeContext(FSContext *context);
 FSContext *openContext(char* imgPath);
+FSContext *createStripedImgFile(char **imgPaths, int membersN, int stripeBlocks, int64_t devSize,
+        int blockSize, int maxFileN, uint32_t flags);
+FSContext *createTieredImgFile(char **imgPaths, int membersN, int stripeBlocks, int64_t devSize, int64_t fastSize,
+        int blockSize, int maxFileN, uint32_t flags);
+FSContext *openStripedContext(char **imgPaths, int membersN);
+FSContext *openReadOnlyContext(char **imgPaths, int membersN);
+int upgradeImgFile(char *oldImgPath, char *newImgPath);
+void setQueueDepth(FSContext *context, int queueDepth);
+int growImgFile(FSContext *context, int64_t newDevSize);
 
 int createDescriptor(FileDescriptor *descr, FSContext *context);
+int createDescriptorFrom(FileDescriptor *descr, int firstFdId, FSContext *context);
 void removeDescriptor(FileDescriptor *descr, FSContext *context);
 void saveDescriptor(FileDescriptor *descr, FSContext *context);
 void getDescriptor(FileDescriptor *descr, int fdId, FSContext *context);
 int getAllDescriptors(FileDescriptor **descriptors, FSContext *context);
 
-int numberOfFreeBlocks(FSContext *context);
-int getFreeBlocks(BlockID *freeBlocks, FSContext *context);
-int getBlocksOf(FileDescriptor *descr, BlockID *blockArr, FSContext *context);
+OpenFile *openFile(int fdId, FSContext *context);
+void closeFile(OpenFile *file, FSContext *context);
+void flushFile(OpenFile *file, FSContext *context);
+size_t writeToFile(OpenFile *file, const void *buf, size_t size, int64_t offsetInFile, FSContext *context);
+int64_t mapFileRange(OpenFile *file, int64_t offsetInFile, size_t size, bool forWrite, FileExtent *extents, FSContext *context);
+void extendFileTo(OpenFile *file, int64_t newSize);
+int64_t allocateFileBlocks(OpenFile *file, int64_t blocksN, FSContext *context);
+int preallocateFile(OpenFile *file, int64_t offsetInFile, int64_t size, bool keepSize, FSContext *context);
+int punchHole(OpenFile *file, int64_t offsetInFile, int64_t size, FSContext *context);
+int syncContext(FSContext *context);
+void holdBlockLocations(FSContext *context);
+void releaseBlockLocations(FSContext *context);
 
-size_t writeTo(FileDescriptor *descr, const void *buf, size_t size, int offsetInFile, FSContext *context);
-size_t readFrom(FileDescriptor *descr, void *buf, size_t size, int offsetInFile, FSContext *context);
+int64_t migrateBlocks(FSContext *context);
+void startMigrator(FSContext *context, int intervalMs);
+void stopMigrator(FSContext *context);
+int64_t numberOfFastBlocks(FSContext *context);
+
+int64_t exportChanges(FSContext *context, int64_t sinceGeneration, FILE *delta);
+int importChanges(FSContext *context, FILE *delta);
+
+int64_t numberOfFreeBlocks(FSContext *context);
+int64_t getFreeBlocks(BlockID *freeBlocks, FSContext *context);
+int64_t getBlocksOf(FileDescriptor *descr, BlockID *blockArr, FSContext *context);
+int64_t locateFileBlocks(FileDescriptor *descr, StoredBlock *blocks, FSContext *context);
+int64_t getCompressionStats(int64_t *storedBytes, FSContext *context);
+int64_t scrubBlocks(BlockID *badBlocks, FSContext *context);
+
+size_t writeTo(FileDescriptor *descr, const void *buf, size_t size, int64_t offsetInFile, FSContext *context);
+ssize_t readFrom(FileDescriptor *descr, void *buf, size_t size, int64_t offsetInFile, FSContext *context);
 void writeDirEntryTo(FileDescriptor *dirDescr, DirEntry *record, FSContext *context);
+void writeDirEntries(FileDescriptor *dirDescr, DirEntry *entries, int64_t entriesN, FSContext *context);
 int getEntryFrom(FileDescriptor *dirDescr, DirEntry *entry, FSContext *context);
+int getEntryAt(FileDescriptor *dirDescr, DirEntry *entry, int64_t *offset, FSContext *context);
 
 int getDescriptorByPath(FileDescriptor *descr, const char *path, FSContext *context);
 void makeLink(FileDescriptor *from, const char *to, FSContext *context);
 int makeDefaultLinks(FileDescriptor *dirDescr, const char *path, FSContext *context);
 void removeLink(const char *path, FSContext *context);
 
-int changeSize(FileDescriptor *descr, int newSize, FSContext *context);
+int getDescriptorByName(FileDescriptor *descr, FileDescriptor *dirDescr, const char *name, FSContext *context);
+void makeLinkIn(FileDescriptor *dirDescr, FileDescriptor *descr, const char *name, FSContext *context);
+int makeDefaultLinksIn(FileDescriptor *dirDescr, FileDescriptor *parentDir, const char *name, FSContext *context);
+int deleteDirEntryIn(FileDescriptor *dirDescr, const char *name, FSContext *context);
+
+int64_t changeSize(FileDescriptor *descr, int64_t newSize, FSContext *context);
+
+int createSnapshot(const char *name, FSContext *context);
+int removeSnapshot(const char *name, FSContext *context);
+int getSnapshotsDir(FileDescriptor *dirDescr, FSContext *context);
+int getSnapshot(FileDescriptor *snapshot, const char *name, FSContext *context);
+void getSnapshotDescriptor(FileDescriptor *snapshot, FileDescriptor *descr, int fdId, FSContext *context);
+int getDescriptorByNameIn(FileDescriptor *snapshot, FileDescriptor *descr, FileDescriptor *dirDescr, const char *name, FSContext *context);
+int getDescriptorByPathIn(FileDescriptor *snapshot, FileDescriptor *descr, const char *path, FSContext *context);
+ssize_t readFromSnapshot(FileDescriptor *snapshot, FileDescriptor *descr, void *buf, size_t size, int64_t offsetInFile, FSContext *context);
+int getSnapshotEntry(FileDescriptor *snapshot, FileDescriptor *dirDescr, DirEntry *entry, int64_t *offset, FSContext *context);
 
 #endif
\ No newline at end of file
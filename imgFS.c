@@ -4,9 +4,11 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/falloc.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <string.h>
@@ -15,255 +17,1028 @@
 
 #include "img-util.h"
 #include "log.h"
+#include "pack.h"
+#include "ro-index.h"
+#include "scratch.h"
 
 FSContext *context;
 
-static int getattr_callback(const char *path, struct stat *stbuf) {
-//  stbuf->st_uid = getuid();
-//	stbuf->st_gid = getgid();
-//	stbuf->st_atime = time( NULL );
-//	stbuf->st_mtime = time( NULL );
+/** index of image, that is mounted with -o ro, otherwise NULL */
+static RoIndex *roIndex;
 
-    FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, path, context);
-    if (fdId != -1) {
-        if (descr.type == FT_DIRECTORY) {
-            stbuf->st_mode = S_IFDIR | 0777;
-        } else if (descr.type == FT_SYMLINK) {
-            stbuf->st_mode = S_IFLNK | 0777; 
-        } else {
-            stbuf->st_mode = S_IFREG | 0777;
-            stbuf->st_size = descr.size;
-            stbuf->st_nlink = descr.nlink;
+/** number of block I/Os of one request, that are executed concurrently */
+static int queueDepth = 1;
+
+/** pause(in ms) between passes of migration of blocks between tiers */
+static int migrateInterval = 1000;
+
+/*
+ * Inode number of a file is its fdId + 1, so root dir(fdId 0) gets FUSE_ROOT_ID.
+ * Files of snapshots keep fdId of the snapshot in high bits of inode number.
+ */
+#define INO_OF(snapshotFdId, fdId) ((fuse_ino_t)(((uint64_t)(snapshotFdId) << 32) | (uint64_t)((fdId) + 1)))
+#define INO_SNAPSHOT(ino) ((int)((uint64_t)(ino) >> 32))
+#define INO_FDID(ino) ((int)((uint64_t)(ino) & 0xffffffff) - 1)
+
+/*
+ * Snapshots are shown read-only in SNAPSHOTS_NAME dir, that isn't listed in the root.
+ * "mkdir SNAPSHOTS_NAME/name" takes a snapshot, "rmdir SNAPSHOTS_NAME/name" drops it.
+ * Its inode number follows inode numbers of all descriptors.
+ */
+#define SNAPSHOTS_NAME ".snapshots"
+#define SNAPSHOTS_INO INO_OF(0, context->maxFileN)
+#define SNAPSHOTS_ROOT -2
+
+/** seconds, during which kernel may cache looked up entries and attributes */
+#define ATTR_TIMEOUT 1.0
+
+/** handle of open live file is its OpenFile, files of snapshots and dirs have no handles */
+#define HANDLE_FILE(fi) ((OpenFile *)(uintptr_t)(fi)->fh)
+
+/**
+ * Finds file in live filesystem or in snapshot by inode number.
+ * snapshot->fdId is 0 for live files.
+ * return: fdId, SNAPSHOTS_ROOT for SNAPSHOTS_NAME dir itself, or -1 if there is no such file
+ */
+static int getInode(fuse_ino_t ino, FileDescriptor *snapshot, FileDescriptor *descr) {
+    snapshot->fdId = 0;
+    if (ino == SNAPSHOTS_INO) {
+        return SNAPSHOTS_ROOT;
+    }
+    int snapshotFdId = INO_SNAPSHOT(ino);
+    int fdId = INO_FDID(ino);
+    if (fdId < 0 || fdId >= context->maxFileN || snapshotFdId >= context->maxFileN) {
+        return -1;
+    }
+    if (snapshotFdId != 0) {
+        getDescriptor(snapshot, snapshotFdId, context);
+        if (snapshot->type != FT_REGULAR || (snapshot->flags & FD_INTERNAL) == 0) {
+            snapshot->fdId = 0;
+            return -1;
         }
+        memset(descr, 0, sizeof(FileDescriptor));
+        getSnapshotDescriptor(snapshot, descr, fdId, context);
+    } else {
+        getDescriptor(descr, fdId, context);
+    }
+    return descr->type != FT_DELETED ? fdId : -1;
+}
+
+/**
+ * Finds live directory, in which entry with specified name is created or removed.
+ * return: 0, or error code for fuse_reply_err
+ */
+static int getMutableDir(fuse_ino_t parent, const char *name, FileDescriptor *dirDescr) {
+    FileDescriptor snapshot;
+    int fdId = getInode(parent, &snapshot, dirDescr);
+    if (fdId == -1) {
+        return ENOENT;
+    } else if (fdId == SNAPSHOTS_ROOT || snapshot.fdId != 0) {
+        return EROFS;
+    } else if (dirDescr->type != FT_DIRECTORY) {
+        return ENOTDIR;
+    } else if (strlen(name) >= MAX_FNAME_LEN) {
+        return ENAMETOOLONG;
+    }
+    return 0;
+}
+
+static void fillStat(FileDescriptor *descr, mode_t permissions, struct stat *stbuf) {
+    if (descr->type == FT_DIRECTORY) {
+        stbuf->st_mode = S_IFDIR | permissions;
+    } else if (descr->type == FT_SYMLINK) {
+        stbuf->st_mode = S_IFLNK | permissions; 
+    } else {
+        stbuf->st_mode = S_IFREG | permissions;
+        stbuf->st_size = descr->size;
+        stbuf->st_nlink = descr->nlink;
+    }
+}
+
+/** fills stat of inode, that was found by getInode */
+static void statInode(fuse_ino_t ino, int fdId, FileDescriptor *snapshot, FileDescriptor *descr, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    if (fdId == SNAPSHOTS_ROOT) {
+        stbuf->st_mode = S_IFDIR | 0755;
+    } else if (snapshot->fdId != 0) {
+        fillStat(descr, descr->type == FT_DIRECTORY ? 0555 : 0444, stbuf);
+    } else {
+        fillStat(descr, 0777, stbuf);
+    }
+}
+
+/**
+ * Inode numbers are made of fdIds, that are reused by new files. Generation tells them apart,
+ * files of snapshot take generation of the snapshot.
+ */
+static uint64_t getGeneration(int fdId, FileDescriptor *snapshot) {
+    if (fdId == SNAPSHOTS_ROOT || context->fdGenerations == NULL) {
         return 0;
+    }
+    return context->fdGenerations[snapshot->fdId != 0 ? snapshot->fdId : fdId];
+}
+
+static void replyEntry(fuse_req_t req, fuse_ino_t ino, int fdId, FileDescriptor *snapshot, FileDescriptor *descr) {
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.ino = ino;
+    entry.generation = getGeneration(fdId, snapshot);
+    entry.attr_timeout = ATTR_TIMEOUT;
+    entry.entry_timeout = ATTR_TIMEOUT;
+    statInode(ino, fdId, snapshot, descr, &entry.attr);
+    fuse_reply_entry(req, &entry);
+}
+
+/** the same as replyEntry, but for just created or linked live file */
+static void replyLiveEntry(fuse_req_t req, int fdId) {
+    FileDescriptor snapshot;
+    FileDescriptor descr;
+    snapshot.fdId = 0;
+    getDescriptor(&descr, fdId, context);
+    replyEntry(req, INO_OF(0, fdId), fdId, &snapshot, &descr);
+}
+
+static void init_callback(void *userdata, struct fuse_conn_info *conn) {
+    // I/O threads are started here: FUSE may fork before the session loop
+    setQueueDepth(context, queueDepth);
+    if (roIndex == NULL) {
+        startMigrator(context, migrateInterval);
+    }
+    // raw blocks are spliced between the image and FUSE device(see replyMappedData)
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+}
+
+static void lookup_callback(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    FileDescriptor snapshot;
+    FileDescriptor dirDescr;
+    FileDescriptor descr;
+    int dirFdId = getInode(parent, &snapshot, &dirDescr);
+    int fdId = -1;
+    if (dirFdId == SNAPSHOTS_ROOT) {
+        if (getSnapshot(&snapshot, name, context) != -1) {
+            // snapshot is shown as its copy of root dir
+            fdId = context->root->fdId;
+            getSnapshotDescriptor(&snapshot, &descr, fdId, context);
+        }
+    } else if (dirFdId == -1 || dirDescr.type != FT_DIRECTORY) {
+        fuse_reply_err(req, dirFdId == -1 ? ENOENT : ENOTDIR);
+        return;
+    } else if (snapshot.fdId != 0) {
+        fdId = getDescriptorByNameIn(&snapshot, &descr, &dirDescr, name, context);
+    } else if (dirFdId == context->root->fdId && strcmp(name, SNAPSHOTS_NAME) == 0) {
+        replyEntry(req, SNAPSHOTS_INO, SNAPSHOTS_ROOT, &snapshot, &descr);
+        return;
+    } else {
+        fdId = getDescriptorByName(&descr, &dirDescr, name, context);
+    }
+    if (fdId != -1) {
+        replyEntry(req, INO_OF(snapshot.fdId, fdId), fdId, &snapshot, &descr);
     } else {
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
     }
 }
 
-static int open_callback(const char *path, struct fuse_file_info *fi) {
+/**
+ * Lookups aren't counted: descriptors are released by unlink and the last close, and their
+ * reused fdIds are replied with a new generation(see getGeneration).
+ */
+static void forget_callback(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    fuse_reply_none(req);
+}
+
+static void getattr_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FileDescriptor snapshot;
     FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, path, context);
+    int fdId = getInode(ino, &snapshot, &descr);
     if (fdId != -1) {
-       fi->fh = fdId;
-       return 0;
+        struct stat stbuf;
+        statInode(ino, fdId, &snapshot, &descr, &stbuf);
+        fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
     } else {
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
     }
 }
 
-static int release_callback(const char* path, struct fuse_file_info *fi) {
-    return 0;
+static void setattr_callback(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+        struct fuse_file_info *fi) {
+    FileDescriptor snapshot;
+    FileDescriptor descr;
+    int fdId = getInode(ino, &snapshot, &descr);
+    if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // only size is kept, other attributes are accepted and ignored
+    if ((to_set & FUSE_SET_ATTR_SIZE) != 0) {
+        if (fdId == SNAPSHOTS_ROOT || snapshot.fdId != 0) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+        // ftruncate changes the open file, so its block map stays valid
+        FileDescriptor *target = fi != NULL && fi->fh != 0 ? &HANDLE_FILE(fi)->descr : &descr;
+        changeSize(target, attr->st_size, context);
+        getDescriptor(&descr, fdId, context);
+    }
+    struct stat stbuf;
+    statInode(ino, fdId, &snapshot, &descr, &stbuf);
+    fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+static void open_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FileDescriptor snapshot;
+    FileDescriptor descr;
+    int fdId = getInode(ino, &snapshot, &descr);
+    if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+    } else if ((fdId == SNAPSHOTS_ROOT || snapshot.fdId != 0) && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EROFS);
+    } else {
+        // contents of snapshot never change
+        fi->keep_cache = snapshot.fdId != 0;
+        fi->fh = 0;
+        if (snapshot.fdId == 0 && descr.type == FT_REGULAR) {
+            fi->fh = (uintptr_t)openFile(fdId, context);
+        }
+        fuse_reply_open(req, fi);
+    }
 }
 
-int opendir_callback(const char* path, struct fuse_file_info* fi) {
-    return open_callback(path, fi);
+static void flush_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (fi->fh != 0) {
+        flushFile(HANDLE_FILE(fi), context);
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void fsync_callback(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    if (fi->fh != 0) {
+        flushFile(HANDLE_FILE(fi), context);
+    }
+    fuse_reply_err(req, syncContext(context) == 0 ? 0 : EIO);
 }
 
-static int releasedir_callback(const char* path, struct fuse_file_info *fi) {
-    return release_callback(path, fi);
+static void release_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (fi->fh != 0) {
+        closeFile(HANDLE_FILE(fi), context);
+    }
+    fuse_reply_err(req, 0);
 }
 
+static void opendir_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    open_callback(req, ino, fi);
+}
 
-static int readdir_callback(const char *path, void *buf, fuse_fill_dir_t filler,
-        off_t offset, struct fuse_file_info *fi) {
+static void releasedir_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, 0);
+}
+
+/** inode number of entry, that is listed in directory dirIno */
+static fuse_ino_t getEntryInode(fuse_ino_t dirIno, FileDescriptor *snapshot, DirEntry *entry) {
+    if (dirIno == SNAPSHOTS_INO) {
+        if (strcmp(entry->name, ".") == 0) {
+            return SNAPSHOTS_INO;
+        } else if (strcmp(entry->name, "..") == 0) {
+            return FUSE_ROOT_ID;
+        }
+        return INO_OF(entry->fdId, context->root->fdId);
+    }
+    return INO_OF(snapshot->fdId, entry->fdId);
+}
+
+/** offset of entry is offset of the next entry, so listing is continued from it */
+static void readdir_callback(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    FileDescriptor snapshot;
     FileDescriptor dirDescr;
-    getDescriptor(&dirDescr, fi->fh, context);
-    DirEntry entry;
-    int result = getEntryFrom(&dirDescr, &entry, context);
-    while (result != -1) {
-        filler(buf, entry.name, NULL, 0);
-        result = getEntryFrom(NULL, &entry, context);
+    int fdId = getInode(ino, &snapshot, &dirDescr);
+    if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    } else if (fdId != SNAPSHOTS_ROOT && dirDescr.type != FT_DIRECTORY) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
     }
-    return 0;
+    ScratchMark mark = scratchMark();
+    char *buf = scratchAlloc(size);
+    size_t filled = 0;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(struct stat));
+    if (fdId == SNAPSHOTS_ROOT && getSnapshotsDir(&dirDescr, context) == -1) {
+        // there are no snapshots yet
+        const char *names[] = {".", ".."};
+        const fuse_ino_t inodes[] = {SNAPSHOTS_INO, FUSE_ROOT_ID};
+        for (off_t i = offset; i < 2; i++) {
+            stbuf.st_ino = inodes[i];
+            size_t entrySize = fuse_add_direntry(req, buf + filled, size - filled, names[i], &stbuf, i + 1);
+            if (entrySize > size - filled) {
+                break;
+            }
+            filled += entrySize;
+        }
+    } else {
+        DirEntry entry;
+        int64_t entryOffset = offset;
+        while (getSnapshotEntry(snapshot.fdId != 0 ? &snapshot : NULL, &dirDescr, &entry, &entryOffset, context) != -1) {
+            stbuf.st_ino = getEntryInode(ino, &snapshot, &entry);
+            size_t entrySize = fuse_add_direntry(req, buf + filled, size - filled, entry.name, &stbuf, entryOffset);
+            if (entrySize > size - filled) {
+                break;
+            }
+            filled += entrySize;
+        }
+    }
+    fuse_reply_buf(req, buf, filled);
+    scratchRelease(mark);
+}
+
+/**
+ * Handle is stale, if descriptor of its file was removed under it, its fdId may belong
+ * to another file then. Unlinked files stay valid until their last close.
+ */
+static bool isStaleHandle(struct fuse_file_info *fi) {
+    return fi->fh != 0 && HANDLE_FILE(fi)->descr.type == FT_DELETED;
 }
 
-static int write_callback(const char *path, const char *buf, size_t size, off_t offset,
+static void write_callback(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi) {
-            
-    if (fi->fh != 0) {
-        FileDescriptor descr;
-        getDescriptor(&descr, fi->fh, context);
-        int result = writeTo(&descr, buf, size, offset, context);
-        descr.size += result;            // костыль
-        saveDescriptor(&descr, context);
-        return result;
+    if (fi->fh == 0 || isStaleHandle(fi)) {
+        // only live files are open for writing
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    size_t result = writeToFile(HANDLE_FILE(fi), buf, size, offset, context);
+    if (result == 0 && size > 0) {
+        fuse_reply_err(req, ENOSPC);
     } else {
-        return -ENOENT;
+        fuse_reply_write(req, result);
     }
 }
 
-static int truncate_callback (const char *path, off_t size) {
-    FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, path, context);
-    if (fdId != -1) {
-        if (size != 0) {  // костыль
-            changeSize(&descr, size, context);
+/** return: bufvec of (fd, offset) buffers for extents, it's taken from scratch memory */
+static struct fuse_bufvec *makeBufvec(FileExtent *extents, int64_t extentsN) {
+    struct fuse_bufvec *bufv = scratchAlloc(sizeof(struct fuse_bufvec) + extentsN*sizeof(struct fuse_buf));
+    bufv->count = extentsN;
+    bufv->idx = 0;
+    bufv->off = 0;
+    for (int64_t i = 0; i < extentsN; i++) {
+        bufv->buf[i].size = extents[i].size;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[i].mem = NULL;
+        bufv->buf[i].fd = extents[i].fd;
+        bufv->buf[i].pos = extents[i].offset;
+    }
+    return bufv;
+}
+
+/**
+ * Replies by runs of raw blocks in the image, so kernel splices them to FUSE device
+ * without copying through user space.
+ * return: false if the range can't be mapped, nothing is replied then
+ */
+static bool replyMappedData(fuse_req_t req, OpenFile *file, size_t size, off_t offset) {
+    ScratchMark mark = scratchMark();
+    FileExtent *extents = scratchAlloc((size/context->blockSize + 2)*sizeof(FileExtent));
+    // blocks of the fast tier aren't moved, until they are spliced
+    holdBlockLocations(context);
+    int64_t extentsN = mapFileRange(file, offset, size, false, extents, context);
+    if (extentsN == 0) {
+        fuse_reply_buf(req, NULL, 0);
+    } else if (extentsN > 0) {
+        struct fuse_bufvec *bufv = makeBufvec(extents, extentsN);
+        // splices bypass the engine, but they take its slots of data
+        int64_t submitted = admitIO(context->ioEngine, IO_DATA);
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        completeIO(context->ioEngine, IO_DATA, submitted);
+    }
+    releaseBlockLocations(context);
+    scratchRelease(mark);
+    return extentsN >= 0;
+}
+
+static void write_buf_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+        struct fuse_file_info *fi) {
+    if (fi->fh == 0 || isStaleHandle(fi)) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    OpenFile *file = HANDLE_FILE(fi);
+    size_t size = fuse_buf_size(bufv);
+    ScratchMark mark = scratchMark();
+    FileExtent *extents = scratchAlloc((size/context->blockSize + 2)*sizeof(FileExtent));
+    holdBlockLocations(context);
+    int64_t extentsN = mapFileRange(file, offset, size, true, extents, context);
+    if (extentsN == -2) {
+        releaseBlockLocations(context);
+        fuse_reply_err(req, ENOSPC);
+    } else if (extentsN >= 0) {
+        struct fuse_bufvec *dst = makeBufvec(extents, extentsN);
+        int64_t submitted = admitIO(context->ioEngine, IO_DATA);
+        ssize_t result = extentsN > 0 ? fuse_buf_copy(dst, bufv, 0) : 0;
+        completeIO(context->ioEngine, IO_DATA, submitted);
+        releaseBlockLocations(context);
+        if (result < 0) {
+            fuse_reply_err(req, -result);
+        } else {
+            extendFileTo(file, offset + result);
+            fuse_reply_write(req, result);
         }
-        return 0;
     } else {
-        return -ENOENT;
+        releaseBlockLocations(context);
+        // compressed or checksummed blocks need data in memory
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        mem.buf[0].mem = scratchAlloc(size);
+        ssize_t result = fuse_buf_copy(&mem, bufv, 0);
+        if (result < 0) {
+            fuse_reply_err(req, -result);
+        } else {
+            write_callback(req, ino, mem.buf[0].mem, result, offset, fi);
+        }
     }
+    scratchRelease(mark);
 }
 
-static int read_callback(const char *path, char *buf, size_t size, off_t offset,
+/** blocks are preallocated or zeroed in place, data is never moved */
+static void fallocate_callback(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
         struct fuse_file_info *fi) {
-    
-    if (fi->fh != 0) {
-        FileDescriptor descr;
-        getDescriptor(&descr, fi->fh, context);
-        int result = readFrom(&descr, buf, size, offset, context);
-        return result;
+    if (fi->fh == 0 || isStaleHandle(fi)) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    int result;
+    if (mode == 0 || mode == FALLOC_FL_KEEP_SIZE) {
+        result = preallocateFile(HANDLE_FILE(fi), offset, length, mode == FALLOC_FL_KEEP_SIZE, context);
+    } else if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        result = punchHole(HANDLE_FILE(fi), offset, length, context);
+    } else {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    fuse_reply_err(req, result == 0 ? 0 : ENOSPC);
+}
+
+static void read_callback(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    if (isStaleHandle(fi)) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    if (fi->fh != 0 && replyMappedData(req, HANDLE_FILE(fi), size, offset)) {
+        return;
+    }
+    FileDescriptor snapshot;
+    FileDescriptor descr;
+    int fdId = fi->fh != 0 ? HANDLE_FILE(fi)->descr.fdId : getInode(ino, &snapshot, &descr);
+    if (fdId == SNAPSHOTS_ROOT) {
+        fuse_reply_err(req, EISDIR);
+    } else if (fdId != -1) {
+        // readFrom isn't cut by the end of the file: inline area and the last block are read whole
+        int64_t fileSize = fi->fh != 0 ? HANDLE_FILE(fi)->descr.size : descr.size;
+        if (offset >= fileSize) {
+            fuse_reply_buf(req, NULL, 0);
+            return;
+        }
+        if (offset + (int64_t)size > fileSize) {
+            size = fileSize - offset;
+        }
+        ScratchMark mark = scratchMark();
+        char *buf = scratchAlloc(size);
+        ssize_t result;
+        if (fi->fh != 0) {
+            result = readFrom(&HANDLE_FILE(fi)->descr, buf, size, offset, context);
+        } else if (snapshot.fdId != 0) {
+            result = readFromSnapshot(&snapshot, &descr, buf, size, offset, context);
+        } else {
+            result = readFrom(&descr, buf, size, offset, context);
+        }
+        if (result == -1) {
+            fuse_reply_err(req, EIO);
+        } else {
+            fuse_reply_buf(req, buf, result);
+        }
+        scratchRelease(mark);
     } else {
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
     }
 }
 
-static int symlink_callback(const char* to, const char* from) {
+static void symlink_callback(fuse_req_t req, const char *to, fuse_ino_t parent, const char *name) {
+    FileDescriptor dirDescr;
+    int err = getMutableDir(parent, name, &dirDescr);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
     FileDescriptor descr;
     descr.type = FT_SYMLINK;
     descr.size = strlen(to) + 1;
     int fdId = createDescriptor(&descr, context);
     if (fdId == -2) {
-        return -ENFILE;
+        fuse_reply_err(req, ENFILE);
     } else if (fdId == -1) {
-        return -EOVERFLOW;
+        fuse_reply_err(req, EOVERFLOW);
     } else {
-        makeLink(&descr, from, context);
+        // target is written first: makeLinkIn changes nlink of the saved descriptor
         writeTo(&descr, to, strlen(to) + 1, 0, context);
-        return 0;
+        makeLinkIn(&dirDescr, &descr, name, context);
+        replyLiveEntry(req, fdId);
     }
-    
 }
 
-static int readlink_callback(const char* path, char* buf, size_t size) {
+static void readlink_callback(fuse_req_t req, fuse_ino_t ino) {
+    FileDescriptor snapshot;
     FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, path, context);
-    if (fdId != -1) {
-        if (descr.type != FT_SYMLINK) {
-            return -EINVAL;
+    int fdId = getInode(ino, &snapshot, &descr);
+    if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+    } else if (fdId == SNAPSHOTS_ROOT || descr.type != FT_SYMLINK) {
+        fuse_reply_err(req, EINVAL);
+    } else {
+        ScratchMark mark = scratchMark();
+        char *buf = scratchAlloc(descr.size + 1);
+        ssize_t result;
+        if (snapshot.fdId != 0) {
+            result = readFromSnapshot(&snapshot, &descr, buf, descr.size, 0, context);
         } else {
-            readFrom(&descr, buf, size, 0, context);
-            return 0;
+            result = readFrom(&descr, buf, descr.size, 0, context);
         }
-    } else {
-        return -ENOENT;
+        if (result == -1) {
+            fuse_reply_err(req, EIO);
+        } else {
+            buf[result] = '\0';
+            fuse_reply_readlink(req, buf);
+        }
+        scratchRelease(mark);
     }
 }
 
-static int link_callback(const char* from, const char* to) {
+static void link_callback(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    FileDescriptor dirDescr;
+    int err = getMutableDir(newparent, newname, &dirDescr);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    FileDescriptor snapshot;
     FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, from, context);
-    if (fdId != -1) {
-        if (descr.type == FT_DIRECTORY) {
-            return -EPERM;
-        } else {
-            makeLink(&descr, to ,context);
-            return 0;
-        }
+    int fdId = getInode(ino, &snapshot, &descr);
+    if (fdId == SNAPSHOTS_ROOT || snapshot.fdId != 0) {
+        fuse_reply_err(req, EROFS);
+    } else if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+    } else if (descr.type == FT_DIRECTORY) {
+        fuse_reply_err(req, EPERM);
     } else {
-        return -ENOENT;
+        makeLinkIn(&dirDescr, &descr, newname, context);
+        replyLiveEntry(req, fdId);
     }
 }
 
-static int unlink_callback(const char* path) {
+static void unlink_callback(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    FileDescriptor dirDescr;
+    int err = getMutableDir(parent, name, &dirDescr);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
     FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, path, context);
-    if (fdId != -1) {
-        if (descr.type == FT_DIRECTORY) {
-            return -EISDIR;
-        } else {
-            removeLink(path, context);
-            return 0;
-        }
+    int fdId = getDescriptorByName(&descr, &dirDescr, name, context);
+    if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+    } else if (descr.type == FT_DIRECTORY) {
+        fuse_reply_err(req, EISDIR);
     } else {
-        return -ENOENT;
+        deleteDirEntryIn(&dirDescr, name, context);
+        fuse_reply_err(req, 0);
     }
 }
 
-static int rmdir_callback(const char* path) {
+static void rmdir_callback(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    if (parent == SNAPSHOTS_INO) {
+        fuse_reply_err(req, removeSnapshot(name, context) == 0 ? 0 : ENOENT);
+        return;
+    }
+    FileDescriptor dirDescr;
+    int err = getMutableDir(parent, name, &dirDescr);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
     FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, path, context);
-    if (fdId != -1) {
-        DirEntry record;
-        int result = getEntryFrom(&descr, &record, context);
-        bool isEmpty = true;
-        while (result != -1 && isEmpty) {
-            if (strcmp(record.name, ".") != 0 && strcmp(record.name, "..") != 0) {
-                isEmpty = false;
-            }
-            result = getEntryFrom(NULL, &record, context);
-        }
-        if (isEmpty) {
-            removeLink(path, context);
-            removeDescriptor(&descr, context);
-            return 0;
-        } else {
-            return -ENOTEMPTY;
+    int fdId = getDescriptorByName(&descr, &dirDescr, name, context);
+    if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    } else if (descr.type != FT_DIRECTORY) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    DirEntry record;
+    int64_t offset = 0;
+    bool isEmpty = true;
+    while (isEmpty && getEntryAt(&descr, &record, &offset, context) != -1) {
+        if (strcmp(record.name, ".") != 0 && strcmp(record.name, "..") != 0) {
+            isEmpty = false;
         }
+    }
+    if (isEmpty) {
+        deleteDirEntryIn(&dirDescr, name, context);
+        getDescriptor(&descr, fdId, context);
+        removeDescriptor(&descr, context);
+        fuse_reply_err(req, 0);
     } else {
-        return -ENOENT;
+        fuse_reply_err(req, ENOTEMPTY);
     }
-    
 }
 
-static int mkdir_callback(const char* path, mode_t mode) {
+static void mkdir_callback(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    if (parent == SNAPSHOTS_INO) {
+        FileDescriptor snapshot;
+        FileDescriptor descr;
+        int result = createSnapshot(name, context);
+        if (result == -1) {
+            fuse_reply_err(req, ENOSPC);
+        } else if (result == -2) {
+            fuse_reply_err(req, ENFILE);
+        } else if (result == -3) {
+            fuse_reply_err(req, EEXIST);
+        } else {
+            getSnapshot(&snapshot, name, context);
+            getSnapshotDescriptor(&snapshot, &descr, context->root->fdId, context);
+            replyEntry(req, INO_OF(snapshot.fdId, context->root->fdId), context->root->fdId, &snapshot, &descr);
+        }
+        return;
+    }
+    FileDescriptor dirDescr;
+    int err = getMutableDir(parent, name, &dirDescr);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
     FileDescriptor descr;
     descr.type = FT_DIRECTORY;
     descr.size = 0;
     int fdId = createDescriptor(&descr, context);
     if (fdId == -2) {
-        return -ENFILE;
+        fuse_reply_err(req, ENFILE);
     } else if (fdId == -1) {
-        return -EOVERFLOW;
+        fuse_reply_err(req, EOVERFLOW);
     } else {
-        makeDefaultLinks(&descr, path, context);
-        return 0;
+        makeDefaultLinksIn(&descr, &dirDescr, name, context);
+        replyLiveEntry(req, fdId);
     }
 }
 
-static int create_callback(const char* path, mode_t mode, struct fuse_file_info *fi) {
-    if (strstr(path, "/.") == NULL) {
-        int result = open_callback(path, fi);
-        if (result != 0) {
-            FileDescriptor descr;
-            descr.type = FT_REGULAR;
-            descr.size = 0;
-            int fdId = createDescriptor(&descr, context);
-            if (fdId == -2) {
-                return -ENFILE;
-            } else if (fdId == -1) {
-                return -EOVERFLOW;
-            } else {
-                makeLink(&descr, path, context);
-                fi->fh = fdId;
-            }
+static void create_callback(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+        struct fuse_file_info *fi) {
+    FileDescriptor dirDescr;
+    int err = getMutableDir(parent, name, &dirDescr);
+    if (err == 0 && name[0] == '.') {
+        err = ENOENT;
+    }
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    FileDescriptor descr;
+    int fdId = getDescriptorByName(&descr, &dirDescr, name, context);
+    if (fdId != -1 && descr.type != FT_REGULAR) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    } else if (fdId == -1) {
+        descr.type = FT_REGULAR;
+        descr.size = 0;
+        fdId = createDescriptor(&descr, context);
+        if (fdId == -2) {
+            fuse_reply_err(req, ENFILE);
+            return;
+        } else if (fdId == -1) {
+            fuse_reply_err(req, EOVERFLOW);
+            return;
         }
-        return 0;
+        makeLinkIn(&dirDescr, &descr, name, context);
+        getDescriptor(&descr, fdId, context);
+    }
+    fi->fh = (uintptr_t)openFile(fdId, context);
+    struct fuse_entry_param entry;
+    FileDescriptor snapshot;
+    snapshot.fdId = 0;
+    memset(&entry, 0, sizeof(entry));
+    entry.ino = INO_OF(0, fdId);
+    entry.generation = getGeneration(fdId, &snapshot);
+    entry.attr_timeout = ATTR_TIMEOUT;
+    entry.entry_timeout = ATTR_TIMEOUT;
+    statInode(entry.ino, fdId, &snapshot, &descr, &entry.attr);
+    fuse_reply_create(req, &entry, fi);
+}
+
+/** "1" turns on compression of blocks, that are written to the file later, "0" turns it off */
+#define COMPRESS_XATTR "user.imgfs.compress"
+/** size of image in MB, it's kept by the root. Setting of larger size grows mounted image */
+#define SIZE_XATTR "user.imgfs.size"
+/** queues and latencies of metadata and data I/O, they are kept by the root(only with --queue-depth) */
+#define IOSTATS_XATTR "user.imgfs.iostats"
+
+static void setSizeXattr(fuse_req_t req, const char *value, size_t size) {
+    char number[32];
+    if (size == 0 || size >= sizeof(number)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    memcpy(number, value, size);
+    number[size] = '\0';
+    int result = growImgFile(context, atoll(number)*1024*1024);
+    if (result == -1) {
+        fuse_reply_err(req, EINVAL);
+    } else if (result == -2) {
+        fuse_reply_err(req, EIO);
     } else {
-        return -ENOENT;
+        fuse_reply_err(req, 0);
     }
 }
 
-static int rename_callback(const char* from, const char* to) {
+static void setxattr_callback(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+        size_t size, int flags) {
+    if (strcmp(name, SIZE_XATTR) == 0 && ino == FUSE_ROOT_ID) {
+        setSizeXattr(req, value, size);
+        return;
+    }
+    if (strcmp(name, COMPRESS_XATTR) != 0) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
+    FileDescriptor snapshot;
+    FileDescriptor descr;
+    int fdId = getInode(ino, &snapshot, &descr);
+    if (fdId == SNAPSHOTS_ROOT || snapshot.fdId != 0) {
+        fuse_reply_err(req, EROFS);
+    } else if (fdId != -1) {
+        if (size == 1 && value[0] == '1') {
+            descr.flags |= FD_COMPRESSED;
+        } else if (size == 1 && value[0] == '0') {
+            descr.flags &= ~FD_COMPRESSED;
+        } else {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        saveDescriptor(&descr, context);
+        fuse_reply_err(req, 0);
+    } else {
+        fuse_reply_err(req, ENOENT);
+    }
+}
+
+/** one line per class: queued, in flight and completed requests, average and maximal latency in us */
+static void getIOStatsXattr(fuse_req_t req, size_t size) {
+    if (context->ioEngine == NULL) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+    const char *names[IO_CLASSES] = { "meta", "data" };
+    char text[256];
+    int length = 0;
+    for (int ioClass = 0; ioClass < IO_CLASSES; ioClass++) {
+        IOClassStats stats;
+        getIOStats(context->ioEngine, ioClass, &stats);
+        length += snprintf(text + length, sizeof(text) - length,
+                "%s: queued %" PRId64 ", in flight %" PRId64 ", done %" PRId64 ", latency %" PRId64 " us, max %" PRId64 " us\n",
+                names[ioClass], stats.queued, stats.inFlight, stats.completed,
+                stats.completed > 0 ? stats.totalLatencyNs / stats.completed / 1000 : 0, stats.maxLatencyNs / 1000);
+    }
+    if (size == 0) {
+        fuse_reply_xattr(req, length);
+    } else if (size < (size_t)length) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, text, length);
+    }
+}
+
+static void getxattr_callback(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    if (strcmp(name, IOSTATS_XATTR) == 0 && ino == FUSE_ROOT_ID) {
+        getIOStatsXattr(req, size);
+        return;
+    }
+    if (strcmp(name, SIZE_XATTR) == 0 && ino == FUSE_ROOT_ID) {
+        char number[32];
+        int length = snprintf(number, sizeof(number), "%" PRId64, context->devSize/(1024*1024));
+        if (size == 0) {
+            fuse_reply_xattr(req, length);
+        } else if (size < (size_t)length) {
+            fuse_reply_err(req, ERANGE);
+        } else {
+            fuse_reply_buf(req, number, length);
+        }
+        return;
+    }
+    if (strcmp(name, COMPRESS_XATTR) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+    FileDescriptor snapshot;
     FileDescriptor descr;
-    int fdId = getDescriptorByPath(&descr, from, context);
+    int fdId = getInode(ino, &snapshot, &descr);
+    if (fdId == SNAPSHOTS_ROOT) {
+        fuse_reply_err(req, ENODATA);
+    } else if (fdId == -1) {
+        fuse_reply_err(req, ENOENT);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, 1);
+    } else {
+        char value = (descr.flags & FD_COMPRESSED) ? '1' : '0';
+        fuse_reply_buf(req, &value, 1);
+    }
+}
+
+static void rename_callback(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t newparent, const char *newname) {
+    FileDescriptor dirDescr;
+    FileDescriptor newDirDescr;
+    int err = getMutableDir(parent, name, &dirDescr);
+    if (err == 0) {
+        err = getMutableDir(newparent, newname, &newDirDescr);
+    }
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    FileDescriptor descr;
+    int fdId = getDescriptorByName(&descr, &dirDescr, name, context);
     if (fdId != -1) {
-        makeLink(&descr, to ,context);
-        removeLink(from, context);
-        return 0;
+        makeLinkIn(&newDirDescr, &descr, newname, context);
+        // new link might be written to the same dir
+        getDescriptor(&dirDescr, dirDescr.fdId, context);
+        deleteDirEntryIn(&dirDescr, name, context);
+        fuse_reply_err(req, 0);
     } else {
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
     }
 }
 
-static void destroy_callback(void* private_data) {
+static void destroy_callback(void *userdata) {
     closeContext(context);
 }
 
-static struct fuse_operations fuse_example_operations = {
+/*
+ * Read-only serving(-o ro): callbacks answer from RoIndex, that doesn't change after mount,
+ * so any number of FUSE threads serve them without locks. Snapshots aren't shown.
+ */
+
+/** contents never change, so kernel may cache them long */
+#define RO_ATTR_TIMEOUT 3600.0
+
+/** return: live file by inode number, or NULL if there is no such */
+static RoFile *getRoInode(fuse_ino_t ino) {
+    if (INO_SNAPSHOT(ino) != 0) {
+        return NULL;
+    }
+    return getRoFile(roIndex, INO_FDID(ino));
+}
+
+static void statRoFile(fuse_ino_t ino, RoFile *file, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    fillStat(&file->descr, file->descr.type == FT_DIRECTORY ? 0555 : 0444, stbuf);
+}
+
+static void ro_lookup_callback(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    RoFile *dir = getRoInode(parent);
+    if (dir == NULL || dir->descr.type != FT_DIRECTORY) {
+        fuse_reply_err(req, dir == NULL ? ENOENT : ENOTDIR);
+        return;
+    }
+    int fdId = lookupRoEntry(dir, name);
+    RoFile *file = getRoFile(roIndex, fdId);
+    if (file == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.ino = INO_OF(0, fdId);
+    entry.attr_timeout = RO_ATTR_TIMEOUT;
+    entry.entry_timeout = RO_ATTR_TIMEOUT;
+    statRoFile(entry.ino, file, &entry.attr);
+    fuse_reply_entry(req, &entry);
+}
+
+static void ro_getattr_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    RoFile *file = getRoInode(ino);
+    if (file == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct stat stbuf;
+    statRoFile(ino, file, &stbuf);
+    fuse_reply_attr(req, &stbuf, RO_ATTR_TIMEOUT);
+}
+
+static void ro_open_callback(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    RoFile *file = getRoInode(ino);
+    if (file == NULL) {
+        fuse_reply_err(req, ENOENT);
+    } else if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EROFS);
+    } else {
+        fi->keep_cache = 1;
+        fi->fh = 0;
+        fuse_reply_open(req, fi);
+    }
+}
+
+/** offset of entry is the index of the next one in the sorted entries */
+static void ro_readdir_callback(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    RoFile *dir = getRoInode(ino);
+    if (dir == NULL || dir->descr.type != FT_DIRECTORY) {
+        fuse_reply_err(req, dir == NULL ? ENOENT : ENOTDIR);
+        return;
+    }
+    ScratchMark mark = scratchMark();
+    char *buf = scratchAlloc(size);
+    size_t filled = 0;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(struct stat));
+    for (int64_t i = offset; i < dir->entriesN; i++) {
+        stbuf.st_ino = INO_OF(0, dir->entries[i].fdId);
+        size_t entrySize = fuse_add_direntry(req, buf + filled, size - filled, dir->entries[i].name, &stbuf, i + 1);
+        if (entrySize > size - filled) {
+            break;
+        }
+        filled += entrySize;
+    }
+    fuse_reply_buf(req, buf, filled);
+    scratchRelease(mark);
+}
+
+/** raw contents are spliced by extents of the index, others are read through readRoFile */
+static void ro_read_callback(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    RoFile *file = getRoInode(ino);
+    if (file == NULL || file->descr.type != FT_REGULAR) {
+        fuse_reply_err(req, file == NULL ? ENOENT : EISDIR);
+        return;
+    }
+    ScratchMark mark = scratchMark();
+    FileExtent *extents = scratchAlloc((size/context->blockSize + 2)*sizeof(FileExtent));
+    int64_t extentsN = mapRoRange(file, offset, size, extents);
+    if (extentsN == 0) {
+        fuse_reply_buf(req, NULL, 0);
+    } else if (extentsN > 0) {
+        struct fuse_bufvec *bufv = makeBufvec(extents, extentsN);
+        // as in replyMappedData, splices take slots of data
+        int64_t submitted = admitIO(context->ioEngine, IO_DATA);
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        completeIO(context->ioEngine, IO_DATA, submitted);
+    } else {
+        char *buf = scratchAlloc(size);
+        ssize_t result = readRoFile(roIndex, file, buf, size, offset);
+        if (result == -1) {
+            fuse_reply_err(req, EIO);
+        } else {
+            fuse_reply_buf(req, buf, result);
+        }
+    }
+    scratchRelease(mark);
+}
+
+static void ro_readlink_callback(fuse_req_t req, fuse_ino_t ino) {
+    RoFile *file = getRoInode(ino);
+    if (file == NULL) {
+        fuse_reply_err(req, ENOENT);
+    } else if (file->descr.type != FT_SYMLINK) {
+        fuse_reply_err(req, EINVAL);
+    } else {
+        fuse_reply_readlink(req, file->target);
+    }
+}
+
+static void ro_destroy_callback(void *userdata) {
+    destroyRoIndex(roIndex);
+    closeContext(context);
+}
+
+static struct fuse_lowlevel_ops fuse_ro_operations = {
+  .init = init_callback,
+  .lookup = ro_lookup_callback,
+  .forget = forget_callback,
+  .getattr = ro_getattr_callback,
+  .open = ro_open_callback,
+  .release = release_callback,
+  .opendir = ro_open_callback,
+  .releasedir = releasedir_callback,
+  .readdir = ro_readdir_callback,
+  .read = ro_read_callback,
+  .readlink = ro_readlink_callback,
+  .destroy = ro_destroy_callback
+};
+
+static struct fuse_lowlevel_ops fuse_example_operations = {
+  .init = init_callback,
+  .lookup = lookup_callback,
+  .forget = forget_callback,
   .getattr = getattr_callback,
+  .setattr = setattr_callback,
   .open = open_callback,
   .release = release_callback,
   .opendir = opendir_callback,
@@ -271,7 +1046,10 @@ static struct fuse_operations fuse_example_operations = {
   .readdir = readdir_callback,
   .read = read_callback,
   .write = write_callback,
-  .truncate = truncate_callback,
+  .write_buf = write_buf_callback,
+  .fallocate = fallocate_callback,
+  .flush = flush_callback,
+  .fsync = fsync_callback,
   .symlink = symlink_callback,
   .readlink = readlink_callback,
   .link = link_callback,
@@ -280,6 +1058,8 @@ static struct fuse_operations fuse_example_operations = {
   .mkdir = mkdir_callback,
   .create = create_callback,
   .rename = rename_callback,
+  .setxattr = setxattr_callback,
+  .getxattr = getxattr_callback,
   .destroy = destroy_callback
 };
 
@@ -308,20 +1088,296 @@ void someTst(FSContext *context) {
     writeDirEntryTo(context->root, &record, context);
 }
 
+#define QUEUE_DEPTH_OPT "--queue-depth="
+#define MIGRATE_INTERVAL_OPT "--migrate-interval="
+
+/** backing files of striped image are listed through commas, ex: /disk1/fs.img,/disk2/fs.img */
+#define MAX_MEMBERS 64
+#define STRIPE_OPT "stripe="
+#define FAST_OPT "fast="
+#define DEFAULT_STRIPE_KB 64
+#define THREADS_OPT "threads="
+#define DEFAULT_PACK_THREADS 8
+#define SINCE_OPT "--since"
+
+/** return: number of backing files, paths are split in place */
+static int splitPaths(char *paths, char **imgPaths) {
+    int membersN = 0;
+    char *path = strtok(paths, ",");
+    while (path != NULL && membersN < MAX_MEMBERS) {
+        imgPaths[membersN++] = path;
+        path = strtok(NULL, ",");
+    }
+    return membersN;
+}
+
+/** readOnly image mustn't be changed through the context */
+static FSContext *openImage(char *paths, bool readOnly) {
+    char *imgPaths[MAX_MEMBERS];
+    int membersN = splitPaths(paths, imgPaths);
+    if (membersN == 0) {
+        return NULL;
+    }
+    return readOnly ? openReadOnlyContext(imgPaths, membersN) : openStripedContext(imgPaths, membersN);
+}
+
+/** return: true if FUSE options(-o opt1,opt2 or -oopt1,opt2) contain "ro" */
+static bool hasReadOnlyOption(int argc, char *argv[]) {
+    bool found = false;
+    for (int i = 1; i < argc && !found; i++) {
+        char *options = NULL;
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options = argv[++i];
+        } else if (strncmp(argv[i], "-o", 2) == 0) {
+            options = argv[i] + 2;
+        }
+        if (options != NULL) {
+            char *copy = strdup(options);
+            for (char *option = strtok(copy, ","); option != NULL && !found; option = strtok(NULL, ",")) {
+                found = strcmp(option, "ro") == 0;
+            }
+            free(copy);
+        }
+    }
+    return found;
+}
+
+/**
+ * Creates image by arguments of crImg: argv[2] are paths of backing files, argv[3] is size(in MB),
+ * argv[4] is block size(in KB), argv[5] is maximal number of files, options follow them.
+ */
+static FSContext *createImage(int argc, char *argv[]) {
+    uint32_t flags = 0;
+    int stripeKB = DEFAULT_STRIPE_KB;
+    int64_t fastMB = 0;
+    for (int i = 6; i < argc; i++) {
+        if (strcmp(argv[i], "compress") == 0) {
+            flags |= IMG_COMPRESSED;
+        } else if (strcmp(argv[i], "checksum") == 0) {
+            flags |= IMG_CHECKSUMS;
+        } else if (strncmp(argv[i], STRIPE_OPT, strlen(STRIPE_OPT)) == 0) {
+            stripeKB = atoi(argv[i] + strlen(STRIPE_OPT));
+        } else if (strncmp(argv[i], FAST_OPT, strlen(FAST_OPT)) == 0) {
+            fastMB = atoll(argv[i] + strlen(FAST_OPT));
+        }
+    }
+    char *imgPaths[MAX_MEMBERS];
+    int membersN = splitPaths(argv[2], imgPaths);
+    int blockSize = atoi(argv[4])*1024;
+    FSContext *created = createTieredImgFile(imgPaths, membersN, (int)((int64_t)stripeKB*1024/blockSize),
+            atoll(argv[3])*1024*1024, fastMB*1024*1024, blockSize, atoi(argv[5]), flags);
+    if (created == NULL) {
+        fprintf(stderr, "Can't create %s\n", imgPaths[0]);
+    }
+    return created;
+}
+
+/** return: number of threads, that copy contents by pack and unpack */
+static int getThreadsN(int argc, char *argv[], int firstOpt) {
+    int threadsN = DEFAULT_PACK_THREADS;
+    for (int i = firstOpt; i < argc; i++) {
+        if (strncmp(argv[i], THREADS_OPT, strlen(THREADS_OPT)) == 0) {
+            threadsN = atoi(argv[i] + strlen(THREADS_OPT));
+        }
+    }
+    return threadsN > 0 ? threadsN : 1;
+}
 
 int main(int argc, char *argv[]) {
     if (strcmp(argv[1],"crImg") == 0) {
-        context = createImgFile(argv[2],atoi(argv[3])*1024*1024,atoi(argv[4])*1024,atoi(argv[5]));
+        context = createImage(argc, argv);
+        if (context == NULL) {
+            return 1;
+        }
         someTst(context);
         dumpFS(context);
         closeContext(context);
         return 0;
+    } else if (strcmp(argv[1],"pack") == 0) {
+        // arguments of crImg follow the source directory
+        context = createImage(argc - 1, argv + 1);
+        if (context == NULL) {
+            return 1;
+        }
+        int result = packTree(argv[2], context, getThreadsN(argc, argv, 7));
+        if (result == -1) {
+            fprintf(stderr, "Can't pack %s: some file can't be read or its name is too long\n", argv[2]);
+        } else if (result == -2) {
+            fprintf(stderr, "Can't pack %s: too many files\n", argv[2]);
+        } else if (result == -3) {
+            fprintf(stderr, "Can't pack %s: not enough space\n", argv[2]);
+        }
+        closeContext(context);
+        return result == 0 ? 0 : 1;
+    } else if (strcmp(argv[1],"unpack") == 0) {
+        context = openImage(argv[2], true);
+        if (context == NULL) {
+            fprintf(stderr, "Can't open %s: not an image of version %d, try upgrade\n", argv[2], IMG_VERSION);
+            return 1;
+        }
+        int result = unpackTree(context, argv[3], getThreadsN(argc, argv, 4));
+        if (result != 0) {
+            fprintf(stderr, "Can't unpack %s into %s\n", argv[2], argv[3]);
+        }
+        closeContext(context);
+        return result == 0 ? 0 : 1;
+    } else if (strcmp(argv[1],"upgrade") == 0) {
+        if (upgradeImgFile(argv[2], argv[3]) != 0) {
+            fprintf(stderr, "Can't upgrade %s: not an image of older version\n", argv[2]);
+            return 1;
+        }
+        return 0;
+    } else if (strcmp(argv[1],"grow") == 0) {
+        context = openImage(argv[2], false);
+        if (context == NULL) {
+            fprintf(stderr, "Can't open %s: not an image of version %d, try upgrade\n", argv[2], IMG_VERSION);
+            return 1;
+        }
+        int result = growImgFile(context, atoll(argv[3])*1024*1024);
+        if (result == -1) {
+            fprintf(stderr, "Can't grow %s: new size must be larger than %" PRId64 " MB\n", argv[2],
+                    context->devSize/(1024*1024));
+        } else if (result == -2) {
+            fprintf(stderr, "Can't grow %s: I/O error\n", argv[2]);
+        }
+        closeContext(context);
+        return result == 0 ? 0 : 1;
+    } else if (strcmp(argv[1],"scrub") == 0) {
+        context = openImage(argv[2], false);
+        if (context == NULL) {
+            fprintf(stderr, "Can't open %s: not an image of version %d, try upgrade\n", argv[2], IMG_VERSION);
+            return 1;
+        }
+        BlockID *badBlocks = malloc((context->devSize/context->blockSize)*sizeof(BlockID));
+        int64_t badN = scrubBlocks(badBlocks, context);
+        if (badN == -1) {
+            fprintf(stderr, "Can't scrub %s: image has no checksums\n", argv[2]);
+        } else {
+            printf("Corrupted blocks: %" PRId64 "\n", badN);
+            for (int64_t i = 0; i < badN; i++) {
+                printf("%" PRId64 "\n", badBlocks[i]);
+            }
+        }
+        free(badBlocks);
+        closeContext(context);
+        return badN == 0 ? 0 : 1;
+    } else if (strcmp(argv[1],"export") == 0) {
+        // export <image> <delta or -> --since <generation>
+        if (argc < 6 || strcmp(argv[4], SINCE_OPT) != 0) {
+            fprintf(stderr, "Usage: %s export <path to image> <path to delta> %s <generation>\n", argv[0], SINCE_OPT);
+            return 1;
+        }
+        context = openImage(argv[2], false);
+        if (context == NULL) {
+            fprintf(stderr, "Can't open %s: not an image of version %d, try upgrade\n", argv[2], IMG_VERSION);
+            return 1;
+        }
+        bool toStdout = strcmp(argv[3], "-") == 0;
+        FILE *delta = toStdout ? stdout : fopen(argv[3], "wb");
+        int64_t changedN = -2;
+        if (delta != NULL) {
+            changedN = exportChanges(context, atoll(argv[5]), delta);
+        }
+        if (changedN == -1 && context->generation == 0) {
+            fprintf(stderr, "Can't export %s: image doesn't track changes\n", argv[2]);
+        } else if (changedN == -1) {
+            fprintf(stderr, "Can't export %s: image is at generation %" PRId64 "\n", argv[2], context->generation);
+        } else if (changedN == -2) {
+            fprintf(stderr, "Can't export %s: I/O error\n", argv[2]);
+        } else {
+            // delta may go to stdout
+            fprintf(toStdout ? stderr : stdout, "Changed blocks: %" PRId64 ", generation: %" PRId64 "\n",
+                    changedN, context->generation);
+        }
+        if (delta != NULL && !toStdout) {
+            fclose(delta);
+        }
+        closeContext(context);
+        return changedN >= 0 ? 0 : 1;
+    } else if (strcmp(argv[1],"import") == 0) {
+        // import <image> <delta or ->..., deltas are applied in order
+        context = openImage(argv[2], false);
+        if (context == NULL) {
+            fprintf(stderr, "Can't open %s: not an image of version %d, try upgrade\n", argv[2], IMG_VERSION);
+            return 1;
+        }
+        int result = 0;
+        for (int i = 3; i < argc && result == 0; i++) {
+            bool fromStdin = strcmp(argv[i], "-") == 0;
+            FILE *delta = fromStdin ? stdin : fopen(argv[i], "rb");
+            result = delta != NULL ? importChanges(context, delta) : -1;
+            if (result == -1) {
+                fprintf(stderr, "Can't import %s: delta is damaged or made of other image\n", argv[i]);
+            } else if (result == -2) {
+                fprintf(stderr, "Can't import %s: image is at generation %" PRId64 "\n", argv[i], context->generation);
+            }
+            if (delta != NULL && !fromStdin) {
+                fclose(delta);
+            }
+        }
+        if (result == 0) {
+            printf("Generation: %" PRId64 "\n", context->generation);
+        }
+        closeContext(context);
+        return result == 0 ? 0 : 1;
     } else {
-        context = openContext(argv[argc-2]);
+        // --queue-depth=N and --migrate-interval=N aren't passed to FUSE
+        for (int i = 1; i < argc; i++) {
+            bool isQueueDepth = strncmp(argv[i], QUEUE_DEPTH_OPT, strlen(QUEUE_DEPTH_OPT)) == 0;
+            bool isMigrateInterval = strncmp(argv[i], MIGRATE_INTERVAL_OPT, strlen(MIGRATE_INTERVAL_OPT)) == 0;
+            if (isQueueDepth || isMigrateInterval) {
+                if (isQueueDepth) {
+                    queueDepth = atoi(argv[i] + strlen(QUEUE_DEPTH_OPT));
+                } else {
+                    migrateInterval = atoi(argv[i] + strlen(MIGRATE_INTERVAL_OPT));
+                }
+                memmove(&argv[i], &argv[i + 1], (argc - i)*sizeof(char *));
+                argc--;
+                i--;
+            }
+        }
+        bool readOnly = hasReadOnlyOption(argc, argv);
+        context = openImage(argv[argc-2], readOnly);
+        if (context == NULL) {
+            fprintf(stderr, "Can't open %s: not an image of version %d, try upgrade\n", argv[argc-2], IMG_VERSION);
+            return 1;
+        }
         dumpFS(context);
-        //closeContext(context);
+        if (readOnly) {
+            roIndex = buildRoIndex(context);
+        }
         argv[argc-2] = argv[argc-1];
         argc--;
-        return fuse_main(argc, argv, &fuse_example_operations, NULL);
+        struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+        char *mountpoint;
+        int multithreaded;
+        int foreground;
+        int err = -1;
+        if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) {
+            if (multithreaded && !readOnly) {
+                // directories and open files of read-write mounts aren't locked
+                fprintf(stderr, "Read-write image is served by one thread, only -o ro mounts may use many\n");
+                multithreaded = 0;
+            }
+            struct fuse_chan *chan = fuse_mount(mountpoint, &args);
+            if (chan != NULL) {
+                struct fuse_session *session = fuse_lowlevel_new(&args,
+                        readOnly ? &fuse_ro_operations : &fuse_example_operations, sizeof(fuse_example_operations), NULL);
+                if (session != NULL) {
+                    if (fuse_set_signal_handlers(session) != -1) {
+                        fuse_session_add_chan(session, chan);
+                        fuse_daemonize(foreground);
+                        err = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                        fuse_remove_signal_handlers(session);
+                        fuse_session_remove_chan(chan);
+                    }
+                    fuse_session_destroy(session);
+                }
+                fuse_unmount(mountpoint, chan);
+            }
+            free(mountpoint);
+        }
+        fuse_opt_free_args(&args);
+        return err == 0 ? 0 : 1;
     }
-}
\ No newline at end of file
+}
@@ -1,33 +1,59 @@
+#include <inttypes.h>
 #include <stdlib.h>
 
 #include "log.h"
 
-static void printBlockIDArray(BlockID *blockArr, int blockN);
+static void printBlockIDArray(BlockID *blockArr, int64_t blockN);
 
 void dumpFS(FSContext *context) {
     printf("<<<<<<<<<<<Img_FS>>>>>>>>>>>\n");
-    printf("Dev size = %d Mbs\n", context->devSize/(1024*1024));
+    printf("Dev size = %" PRId64 " Mbs\n", context->devSize/(1024*1024));
     printf("Block size = %d Kbs\n", context->blockSize/1024);
     printf("Maximum file number = %d\n", context->maxFileN);
+    printf("Compression of new files: %s\n", (context->flags & IMG_COMPRESSED) ? "on" : "off");
+    printf("Block checksums: %s\n", (context->flags & IMG_CHECKSUMS) ? "on" : "off");
+    if (context->fastSlotsN > 0) {
+        printf("Fast tier: %" PRId64 " of %" PRId64 " blocks are taken\n", numberOfFastBlocks(context), context->fastSlotsN);
+    }
+    if (context->generation > 0) {
+        printf("Generation of changes: %" PRId64 "\n", context->generation);
+    }
+    if (context->membersN > 1) {
+        printf("Striped across %d files by %d Kbs\n", context->membersN, context->stripeBlocks*context->blockSize/1024);
+    }
+    if (context->groupBlocks > 0) {
+        printf("Allocation groups: %d by %d blocks\n", context->groupsN, context->groupBlocks);
+    }
     printf("--------------------------\n");
     int maxFileN = context->maxFileN;
     FileDescriptor **descriptors = malloc(maxFileN*sizeof(FileDescriptor*));
     for (int i = 0; i < maxFileN; i++) {
-        descriptors[i] = malloc(context->maxFileN*sizeof(FileDescriptor));
+        descriptors[i] = malloc(sizeof(FileDescriptor));
     }
     int descriptorsN = getAllDescriptors(descriptors, context);
     BlockID *blocksArr = malloc((context->devSize/context->blockSize)*sizeof(BlockID));
-    int blocksN;
+    int64_t blocksN;
     for (int i = 0; i < descriptorsN; i++) {
         printDescriptor(descriptors[i]);
-        blocksN = getBlocksOf(descriptors[i], blocksArr, context);
-        printf("Blocks: ");
-        printBlockIDArray(blocksArr, blocksN);
+        if (descriptors[i]->occupiedBlocks == 0) {
+            printf("Blocks: inline\n");
+        } else {
+            blocksN = getBlocksOf(descriptors[i], blocksArr, context);
+            printf("Blocks: ");
+            printBlockIDArray(blocksArr, blocksN);
+        }
+    }
+    int64_t storedBytes;
+    int64_t compressedN = getCompressionStats(&storedBytes, context);
+    if (compressedN > 0) {
+        printf("--------------------------\n");
+        printf("Compressed blocks: %" PRId64 ", stored in %" PRId64 " Kbs, ratio = %.2f\n", compressedN,
+                storedBytes/1024, (double)(compressedN*context->blockSize)/storedBytes);
     }
     blocksN = getFreeBlocks(blocksArr, context);
     printf("--------------------------\n");
-    printf("Free blocks(%d): ", blocksN);
-    printBlockIDArray(blocksArr, 20);
+    printf("Free blocks(%" PRId64 "): ", blocksN);
+    printBlockIDArray(blocksArr, blocksN < 20 ? blocksN : 20);
     for (int i = 0; i < maxFileN; i++) {
         free(descriptors[i]);
     }
@@ -35,17 +61,19 @@ void dumpFS(FSContext *context) {
     free(blocksArr); 
 }
 
-static void printBlockIDArray(BlockID *blockArr, int blockN) {
-    printf("%d", blockArr[0]);
-    for (int i = 1; i < blockN; i++) {
-        printf(", %d", blockArr[i]);
+static void printBlockIDArray(BlockID *blockArr, int64_t blockN) {
+    if (blockN > 0) {
+        printf("%" PRId64, blockArr[0]);
+    }
+    for (int64_t i = 1; i < blockN; i++) {
+        printf(", %" PRId64, blockArr[i]);
     }
     printf("\n");
 }
 
 void printDescriptor(FileDescriptor *descr) {
     printf("FD #%d of type %s\n", descr->fdId, fileTypeToStr(descr->type));
-    printf("size = %d, nlink = %d\n", descr->size, descr->nlink);
+    printf("size = %" PRId64 ", nlink = %d\n", descr->size, descr->nlink);
 }
 
 char *fileTypeToStr(FileType ft) {
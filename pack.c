@@ -0,0 +1,472 @@
+#define _GNU_SOURCE // copy_file_range
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pack.h"
+
+#define PACK_CHUNK (1024*1024) // contents, that go through img-util at once
+
+/** Contents of one file, that are copied between the host and the image */
+typedef struct {
+    char *path;             // file on the host
+    OpenFile *file;
+    int64_t size;
+    FileExtent *extents;    // runs of raw blocks, that workers copy
+    int64_t extentsN;       // -1 means, that contents are copied through img-util
+} CopyJob;
+
+/** Host file with several hard links, that is already packed */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int fdId;
+} PackedInode;
+
+typedef struct {
+    FSContext *context;
+    CopyJob *jobs;
+    int64_t jobsN;
+    int64_t jobsCapacity;
+    int64_t nextJob;        // job, that is taken by the next free worker
+    bool toImage;
+    bool failed;
+    pthread_mutex_t lock;
+    PackedInode *inodes;    // pack: host inodes with several links
+    int64_t inodesN;
+    int64_t inodesCapacity;
+    char **linkPaths;       // unpack: first path of each descriptor with several links
+    int nextFdId;
+} Packer;
+
+static void initPacker(Packer *packer, FSContext *context, bool toImage);
+static void addJob(Packer *packer, const char *path, OpenFile *file, int64_t size);
+static int runJobs(Packer *packer, int threadsN);
+static bool copyThroughImage(Packer *packer, CopyJob *job);
+static void *copyWorker(void *arg);
+static bool copyData(int fromFd, off_t from, int toFd, off_t to, size_t size);
+static char *joinPath(const char *dir, const char *name);
+
+static int packDir(Packer *packer, const char *srcPath, FileDescriptor *dirDescr, int parentFdId);
+static int packFile(Packer *packer, const char *srcPath, struct stat *st);
+static int packSymlink(Packer *packer, const char *srcPath);
+static int unpackDir(Packer *packer, FileDescriptor *dirDescr, const char *dstPath);
+static int unpackFile(Packer *packer, FileDescriptor *descr, const char *dstPath);
+
+/**
+ * Builds contents of fresh image from host directory: each file is laid out by one run of blocks,
+ * directories are written by one write each. Contents of raw files are copied by threadsN threads
+ * right between host files and the image.
+ * Only directories, regular files and symlinks are packed.
+ * return: 0 if success,
+ *         -1 means, that some source can't be read or has too long name;
+ *         -2 means, that number of descriptors have reached its maximum;
+ *         -3 means, that there are no free blocks.
+ */
+int packTree(const char *srcDir, FSContext *context, int threadsN) {
+    Packer packer;
+    initPacker(&packer, context, true);
+    FileDescriptor root;
+    getDescriptor(&root, context->root->fdId, context);
+    int rcode = packDir(&packer, srcDir, &root, root.fdId);
+    int copyRcode = runJobs(&packer, threadsN);
+    getDescriptor(context->root, root.fdId, context);
+    free(packer.inodes);
+    return rcode != 0 ? rcode : copyRcode;
+}
+
+/**
+ * Extracts live files of the image into host directory, which is created if needed.
+ * Contents of raw files are copied by threadsN threads.
+ * return: 0 if success, -1 means, that some file can't be written or read from the image.
+ */
+int unpackTree(FSContext *context, const char *dstDir, int threadsN) {
+    Packer packer;
+    initPacker(&packer, context, false);
+    packer.linkPaths = calloc(context->maxFileN, sizeof(char *));
+    int rcode = -1;
+    if (mkdir(dstDir, 0755) == 0 || errno == EEXIST) {
+        FileDescriptor root;
+        getDescriptor(&root, context->root->fdId, context);
+        rcode = unpackDir(&packer, &root, dstDir);
+    }
+    int copyRcode = runJobs(&packer, threadsN);
+    for (int fdId = 0; fdId < context->maxFileN; fdId++) {
+        free(packer.linkPaths[fdId]);
+    }
+    free(packer.linkPaths);
+    return rcode != 0 ? rcode : copyRcode;
+}
+
+static void initPacker(Packer *packer, FSContext *context, bool toImage) {
+    memset(packer, 0, sizeof(Packer));
+    packer->context = context;
+    packer->toImage = toImage;
+    packer->nextFdId = context->root->fdId + 1;
+}
+
+/** return: fdId of created directory, or error code of packTree */
+static int packDir(Packer *packer, const char *srcPath, FileDescriptor *dirDescr, int parentFdId) {
+    DIR *dir = opendir(srcPath);
+    if (dir == NULL) {
+        return -1;
+    }
+    int64_t entriesN = 0, capacity = 16;
+    DirEntry *entries = calloc(capacity, sizeof(DirEntry));
+    if (dirDescr->fdId != packer->context->root->fdId) {
+        // root has its "." and ".." since the image is created
+        strcpy(entries[0].name, ".");
+        entries[0].fdId = dirDescr->fdId;
+        strcpy(entries[1].name, "..");
+        entries[1].fdId = parentFdId;
+        entriesN = 2;
+    }
+    int subdirsN = 0;
+    int rcode = 0;
+    struct dirent *dirent;
+    while (rcode == 0 && (dirent = readdir(dir)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+            continue;
+        }
+        if (strlen(dirent->d_name) >= MAX_FNAME_LEN) {
+            rcode = -1;
+            break;
+        }
+        char *childPath = joinPath(srcPath, dirent->d_name);
+        struct stat st;
+        int fdId = -1;
+        if (lstat(childPath, &st) != 0) {
+            rcode = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            FileDescriptor childDir;
+            childDir.type = FT_DIRECTORY;
+            childDir.size = 0;
+            fdId = createDescriptorFrom(&childDir, packer->nextFdId, packer->context);
+            if (fdId < 0) {
+                rcode = -2;
+            } else {
+                packer->nextFdId = fdId + 1;
+                // "." and the link from this directory, ".." links of subdirectories are added by packDir
+                childDir.nlink = 2;
+                saveDescriptor(&childDir, packer->context);
+                rcode = packDir(packer, childPath, &childDir, dirDescr->fdId);
+                subdirsN++;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            fdId = packFile(packer, childPath, &st);
+        } else if (S_ISLNK(st.st_mode)) {
+            fdId = packSymlink(packer, childPath);
+        }
+        if (rcode == 0 && fdId < -1) {
+            rcode = fdId;
+        } else if (rcode == 0 && fdId >= 0) {
+            if (entriesN == capacity) {
+                capacity *= 2;
+                entries = realloc(entries, capacity*sizeof(DirEntry));
+            }
+            memset(&entries[entriesN], 0, sizeof(DirEntry));
+            strcpy(entries[entriesN].name, dirent->d_name);
+            entries[entriesN].fdId = fdId;
+            entriesN++;
+        }
+        free(childPath);
+    }
+    closedir(dir);
+    writeDirEntries(dirDescr, entries, entriesN, packer->context);
+    free(entries);
+    getDescriptor(dirDescr, dirDescr->fdId, packer->context);
+    dirDescr->nlink += subdirsN;
+    saveDescriptor(dirDescr, packer->context);
+    return rcode;
+}
+
+/**
+ * Blocks of the file are allocated at once, its contents are copied later by runJobs.
+ * return: fdId, or error code of packTree
+ */
+static int packFile(Packer *packer, const char *srcPath, struct stat *st) {
+    FSContext *context = packer->context;
+    FileDescriptor descr;
+    if (st->st_nlink > 1) {
+        for (int64_t i = 0; i < packer->inodesN; i++) {
+            if (packer->inodes[i].dev == st->st_dev && packer->inodes[i].ino == st->st_ino) {
+                getDescriptor(&descr, packer->inodes[i].fdId, context);
+                descr.nlink++;
+                saveDescriptor(&descr, context);
+                return descr.fdId;
+            }
+        }
+    }
+    descr.type = FT_REGULAR;
+    descr.size = 0;
+    int fdId = createDescriptorFrom(&descr, packer->nextFdId, context);
+    if (fdId < 0) {
+        return -2;
+    }
+    packer->nextFdId = fdId + 1;
+    descr.nlink = 1;
+    saveDescriptor(&descr, context);
+    if (st->st_nlink > 1) {
+        if (packer->inodesN == packer->inodesCapacity) {
+            packer->inodesCapacity = packer->inodesCapacity > 0 ? packer->inodesCapacity*2 : 16;
+            packer->inodes = realloc(packer->inodes, packer->inodesCapacity*sizeof(PackedInode));
+        }
+        PackedInode *inode = &packer->inodes[packer->inodesN++];
+        inode->dev = st->st_dev;
+        inode->ino = st->st_ino;
+        inode->fdId = fdId;
+    }
+    if (st->st_size > 0) {
+        OpenFile *file = openFile(fdId, context);
+        int64_t blocksN = st->st_size <= INLINE_DATA_SIZE ? 0
+                : (st->st_size + context->blockSize - 1) / context->blockSize;
+        if (allocateFileBlocks(file, blocksN, context) < blocksN) {
+            closeFile(file, context);
+            return -3;
+        }
+        extendFileTo(file, st->st_size);
+        addJob(packer, srcPath, file, st->st_size);
+    }
+    return fdId;
+}
+
+/** target is kept like symlink_callback does: with terminating zero. return: fdId, or error code of packTree */
+static int packSymlink(Packer *packer, const char *srcPath) {
+    char target[PATH_MAX];
+    ssize_t length = readlink(srcPath, target, sizeof(target) - 1);
+    if (length < 0) {
+        return -1;
+    }
+    target[length] = '\0';
+    FileDescriptor descr;
+    descr.type = FT_SYMLINK;
+    descr.size = length + 1;
+    int fdId = createDescriptorFrom(&descr, packer->nextFdId, packer->context);
+    if (fdId < 0) {
+        return -2;
+    }
+    packer->nextFdId = fdId + 1;
+    descr.nlink = 1;
+    if (writeTo(&descr, target, length + 1, 0, packer->context) == 0) {
+        return -3;
+    }
+    return fdId;
+}
+
+static int unpackDir(Packer *packer, FileDescriptor *dirDescr, const char *dstPath) {
+    FSContext *context = packer->context;
+    DirEntry entry;
+    int64_t offset = 0;
+    int rcode = 0;
+    while (getEntryAt(dirDescr, &entry, &offset, context) == 0) {
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+            continue;
+        }
+        char *childPath = joinPath(dstPath, entry.name);
+        FileDescriptor descr;
+        getDescriptor(&descr, entry.fdId, context);
+        if (descr.type == FT_DIRECTORY) {
+            if (mkdir(childPath, 0755) == 0 || errno == EEXIST) {
+                if (unpackDir(packer, &descr, childPath) != 0) {
+                    rcode = -1;
+                }
+            } else {
+                rcode = -1;
+            }
+        } else if (descr.type == FT_SYMLINK) {
+            char *target = calloc(descr.size + 1, 1);
+            readFrom(&descr, target, descr.size, 0, context);
+            if (symlink(target, childPath) != 0) {
+                rcode = -1;
+            }
+            free(target);
+        } else if (descr.type == FT_REGULAR && unpackFile(packer, &descr, childPath) != 0) {
+            rcode = -1;
+        }
+        free(childPath);
+    }
+    return rcode;
+}
+
+/** hard links of the image become hard links on the host. return: 0, or -1 on error */
+static int unpackFile(Packer *packer, FileDescriptor *descr, const char *dstPath) {
+    char *linkPath = packer->linkPaths[descr->fdId];
+    if (linkPath != NULL) {
+        return link(linkPath, dstPath);
+    }
+    int fd = open(dstPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    int rcode = ftruncate(fd, descr->size);
+    close(fd);
+    if (descr->nlink > 1) {
+        packer->linkPaths[descr->fdId] = strdup(dstPath);
+    }
+    if (rcode == 0 && descr->size > 0) {
+        addJob(packer, dstPath, openFile(descr->fdId, packer->context), descr->size);
+    }
+    return rcode;
+}
+
+static void addJob(Packer *packer, const char *path, OpenFile *file, int64_t size) {
+    if (packer->jobsN == packer->jobsCapacity) {
+        packer->jobsCapacity = packer->jobsCapacity > 0 ? packer->jobsCapacity*2 : 64;
+        packer->jobs = realloc(packer->jobs, packer->jobsCapacity*sizeof(CopyJob));
+    }
+    CopyJob *job = &packer->jobs[packer->jobsN++];
+    job->path = strdup(path);
+    job->file = file;
+    job->size = size;
+    job->extents = NULL;
+    job->extentsN = -1;
+}
+
+/**
+ * Files are mapped to runs of raw blocks here, as img-util is used by one thread.
+ * Files, that can't be mapped(inline, compressed or checksummed), are copied through img-util
+ * right away, others are copied by workers. Handles of all files are closed afterwards.
+ * return: 0, or -1 if some file isn't copied
+ */
+static int runJobs(Packer *packer, int threadsN) {
+    FSContext *context = packer->context;
+    for (int64_t i = 0; i < packer->jobsN; i++) {
+        CopyJob *job = &packer->jobs[i];
+        job->extents = malloc((job->size/context->blockSize + 2)*sizeof(FileExtent));
+        job->extentsN = mapFileRange(job->file, 0, job->size, false, job->extents, context);
+        if (job->extentsN < 0 && !copyThroughImage(packer, job)) {
+            packer->failed = true;
+        }
+    }
+    if (threadsN > packer->jobsN) {
+        threadsN = packer->jobsN;
+    }
+    pthread_mutex_init(&packer->lock, NULL);
+    pthread_t *threads = malloc((threadsN > 0 ? threadsN : 1)*sizeof(pthread_t));
+    for (int i = 0; i < threadsN; i++) {
+        pthread_create(&threads[i], NULL, copyWorker, packer);
+    }
+    for (int i = 0; i < threadsN; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&packer->lock);
+    for (int64_t i = 0; i < packer->jobsN; i++) {
+        CopyJob *job = &packer->jobs[i];
+        closeFile(job->file, context);
+        free(job->extents);
+        free(job->path);
+    }
+    free(packer->jobs);
+    return packer->failed ? -1 : 0;
+}
+
+/** contents are written by whole blocks, so partial writes don't read blocks, that aren't written yet. return: false on error */
+static bool copyThroughImage(Packer *packer, CopyJob *job) {
+    FSContext *context = packer->context;
+    int fd = open(job->path, packer->toImage ? O_RDONLY : O_WRONLY);
+    if (fd == -1) {
+        return false;
+    }
+    size_t chunk = PACK_CHUNK > context->blockSize ? PACK_CHUNK / context->blockSize * context->blockSize
+                                                   : context->blockSize;
+    char *buf = malloc(chunk);
+    bool success = true;
+    for (int64_t offset = 0; offset < job->size && success; offset += chunk) {
+        size_t portion = job->size - offset < chunk ? job->size - offset : chunk;
+        if (packer->toImage) {
+            ssize_t readSize = pread(fd, buf, portion, offset);
+            success = readSize >= 0;
+            if (success && job->file->descr.occupiedBlocks > 0) {
+                size_t padded = (portion + context->blockSize - 1) / context->blockSize * context->blockSize;
+                memset(buf + readSize, 0, padded - readSize);
+                portion = padded;
+            }
+            success = success && writeTo(&job->file->descr, buf, portion, offset, context) == portion;
+        } else {
+            success = readFrom(&job->file->descr, buf, portion, offset, context) == portion
+                    && pwrite(fd, buf, portion, offset) == portion;
+        }
+    }
+    free(buf);
+    close(fd);
+    return success;
+}
+
+static void *copyWorker(void *arg) {
+    Packer *packer = arg;
+    while (true) {
+        pthread_mutex_lock(&packer->lock);
+        int64_t index = packer->nextJob++;
+        pthread_mutex_unlock(&packer->lock);
+        if (index >= packer->jobsN) {
+            break;
+        }
+        CopyJob *job = &packer->jobs[index];
+        if (job->extentsN <= 0) {
+            // copied through img-util already
+            continue;
+        }
+        int fd = open(job->path, packer->toImage ? O_RDONLY : O_WRONLY);
+        bool success = fd != -1;
+        off_t offsetInFile = 0;
+        for (int64_t i = 0; i < job->extentsN && success; i++) {
+            FileExtent *extent = &job->extents[i];
+            success = packer->toImage ? copyData(fd, offsetInFile, extent->fd, extent->offset, extent->size)
+                                      : copyData(extent->fd, extent->offset, fd, offsetInFile, extent->size);
+            offsetInFile += extent->size;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        if (!success) {
+            pthread_mutex_lock(&packer->lock);
+            packer->failed = true;
+            pthread_mutex_unlock(&packer->lock);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Kernel copies data between files by itself, if it can. Source, that ends earlier, isn't an error.
+ * return: false on error
+ */
+static bool copyData(int fromFd, off_t from, int toFd, off_t to, size_t size) {
+    while (size > 0) {
+        ssize_t copied = copy_file_range(fromFd, &from, toFd, &to, size, 0);
+        if (copied == 0) {
+            return true;
+        } else if (copied < 0) {
+            break;
+        }
+        size -= copied;
+    }
+    char *buf = size > 0 ? malloc(PACK_CHUNK) : NULL;
+    bool success = true;
+    while (size > 0 && success) {
+        ssize_t readSize = pread(fromFd, buf, size < PACK_CHUNK ? size : PACK_CHUNK, from);
+        if (readSize == 0) {
+            break;
+        }
+        success = readSize > 0 && pwrite(toFd, buf, readSize, to) == readSize;
+        from += readSize;
+        to += readSize;
+        size -= readSize;
+    }
+    free(buf);
+    return success;
+}
+
+static char *joinPath(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
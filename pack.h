@@ -0,0 +1,9 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include "img-util.h"
+
+int packTree(const char *srcDir, FSContext *context, int threadsN);
+int unpackTree(FSContext *context, const char *dstDir, int threadsN);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "crc32c.h"
+#include "ro-index.h"
+#include "scratch.h"
+
+static void indexDir(RoFile *file, FSContext *context);
+static void indexContents(RoFile *file, FSContext *context);
+static bool readStoredBlock(StoredBlock *block, char *stored, char *raw, int blockSize, bool verify);
+static int compareEntries(const void *a, const void *b);
+
+/**
+ * Reads all descriptors, directories and block maps of the image, that must not change afterwards
+ * (ex. opened by openReadOnlyContext). Snapshots aren't indexed.
+ */
+RoIndex *buildRoIndex(FSContext *context) {
+    RoIndex *index = malloc(sizeof(RoIndex));
+    index->context = context;
+    index->files = calloc(context->maxFileN, sizeof(RoFile));
+    for (int fdId = 0; fdId < context->maxFileN; fdId++) {
+        RoFile *file = &index->files[fdId];
+        getDescriptor(&file->descr, fdId, context);
+        if (file->descr.flags & FD_INTERNAL) {
+            file->descr.type = FT_DELETED;
+        }
+        if (file->descr.type == FT_DIRECTORY) {
+            indexDir(file, context);
+        } else if (file->descr.type == FT_REGULAR) {
+            indexContents(file, context);
+        } else if (file->descr.type == FT_SYMLINK) {
+            file->target = calloc(file->descr.size + 1, 1);
+            readFrom(&file->descr, file->target, file->descr.size, 0, context);
+        }
+    }
+    return index;
+}
+
+void destroyRoIndex(RoIndex *index) {
+    for (int fdId = 0; fdId < index->context->maxFileN; fdId++) {
+        RoFile *file = &index->files[fdId];
+        free(file->extents);
+        free(file->extentStarts);
+        free(file->blocks);
+        free(file->entries);
+        free(file->target);
+    }
+    free(index->files);
+    free(index);
+}
+
+/** return: file, or NULL if there is no such */
+RoFile *getRoFile(RoIndex *index, int fdId) {
+    if (fdId < 0 || fdId >= index->context->maxFileN || index->files[fdId].descr.type == FT_DELETED) {
+        return NULL;
+    }
+    return &index->files[fdId];
+}
+
+/** return: fdId of the entry, or -1 if there is no such */
+int lookupRoEntry(RoFile *dir, const char *name) {
+    DirEntry key;
+    strncpy(key.name, name, MAX_FNAME_LEN - 1);
+    key.name[MAX_FNAME_LEN - 1] = 0;
+    DirEntry *entry = bsearch(&key, dir->entries, dir->entriesN, sizeof(DirEntry), compareEntries);
+    return entry != NULL ? entry->fdId : -1;
+}
+
+/**
+ * The same as mapFileRange for reading: range is cut by the end of the file.
+ * extents points to size >= (size/blockSize + 2)*sizeof(FileExtent)
+ * return: number of extents, -1 means, that file has no extents(see readRoFile)
+ */
+int64_t mapRoRange(RoFile *file, int64_t offsetInFile, size_t size, FileExtent *extents) {
+    if (file->extents == NULL) {
+        return -1;
+    }
+    if (offsetInFile >= file->descr.size) {
+        return 0;
+    }
+    if (offsetInFile + (int64_t)size > file->descr.size) {
+        size = file->descr.size - offsetInFile;
+    }
+    // the last extent, that starts at offsetInFile or before it
+    int64_t low = 0, high = file->extentsN - 1;
+    while (low < high) {
+        int64_t middle = (low + high + 1) / 2;
+        if (file->extentStarts[middle] <= offsetInFile) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    int64_t extentsN = 0;
+    for (int64_t i = low; i < file->extentsN && size > 0; i++) {
+        int64_t offsetInExtent = offsetInFile - file->extentStarts[i];
+        size_t portion = file->extents[i].size - offsetInExtent;
+        portion = portion < size ? portion : size;
+        extents[extentsN].fd = file->extents[i].fd;
+        extents[extentsN].offset = file->extents[i].offset + offsetInExtent;
+        extents[extentsN].size = portion;
+        extentsN++;
+        offsetInFile += portion;
+        size -= portion;
+    }
+    return extentsN;
+}
+
+/**
+ * Reads file, that has no extents: inline contents are copied from the index,
+ * compressed or checksummed blocks are read by their locations in the index and verified
+ * or decompressed by the calling thread.
+ * return: read size, or -1 if some block can't be read(see readBlockParts of img-util)
+ */
+ssize_t readRoFile(RoIndex *index, RoFile *file, void *buf, size_t size, int64_t offsetInFile) {
+    if (offsetInFile >= file->descr.size) {
+        return 0;
+    }
+    if (offsetInFile + (int64_t)size > file->descr.size) {
+        size = file->descr.size - offsetInFile;
+    }
+    if (file->descr.occupiedBlocks == 0) {
+        memcpy(buf, file->descr.inlineData + offsetInFile, size);
+        return size;
+    }
+    int blockSize = index->context->blockSize;
+    bool verify = (index->context->flags & IMG_CHECKSUMS) != 0;
+    ScratchMark mark = scratchMark();
+    char *stored = scratchAlloc(blockSize);
+    char *raw = scratchAlloc(blockSize);
+    ssize_t readSize = 0;
+    while (readSize < (ssize_t)size) {
+        int64_t blockIndex = (offsetInFile + readSize) / blockSize;
+        int offsetInBlock = (offsetInFile + readSize) % blockSize;
+        if (blockIndex >= file->blocksN) {
+            break;
+        }
+        if (!readStoredBlock(&file->blocks[blockIndex], stored, raw, blockSize, verify)) {
+            readSize = -1;
+            break;
+        }
+        size_t portion = blockSize - offsetInBlock < size - readSize ? blockSize - offsetInBlock : size - readSize;
+        memcpy((char *)buf + readSize, raw + offsetInBlock, portion);
+        readSize += portion;
+    }
+    scratchRelease(mark);
+    return readSize;
+}
+
+/** raw gets contents of the block, stored is the buffer for its compressed bytes. return: true if success */
+static bool readStoredBlock(StoredBlock *block, char *stored, char *raw, int blockSize, bool verify) {
+    char *target = block->storedSize != 0 ? stored : raw;
+    ssize_t targetSize = block->storedSize != 0 ? block->storedSize : blockSize;
+    if (pread(block->fd, target, targetSize, block->offset) != targetSize) {
+        return false;
+    }
+    if (verify && crc32c(0, target, targetSize) != block->checksum) {
+        return false;
+    }
+    return block->storedSize == 0 || decompressBlock(stored, block->storedSize, raw, blockSize) == blockSize;
+}
+
+static void indexDir(RoFile *file, FSContext *context) {
+    int64_t capacity = 16;
+    file->entries = malloc(capacity*sizeof(DirEntry));
+    DirEntry entry;
+    int64_t offset = 0;
+    while (getEntryAt(&file->descr, &entry, &offset, context) == 0) {
+        if (file->entriesN == capacity) {
+            capacity *= 2;
+            file->entries = realloc(file->entries, capacity*sizeof(DirEntry));
+        }
+        file->entries[file->entriesN++] = entry;
+    }
+    qsort(file->entries, file->entriesN, sizeof(DirEntry), compareEntries);
+}
+
+/**
+ * Raw contents are mapped to extents once, so reads don't walk FAT. Compressed or checksummed
+ * blocks are located with their stored sizes and checksums instead.
+ */
+static void indexContents(RoFile *file, FSContext *context) {
+    if (file->descr.occupiedBlocks == 0 || file->descr.size == 0) {
+        return;
+    }
+    FileExtent *extents = malloc((file->descr.size/context->blockSize + 2)*sizeof(FileExtent));
+    OpenFile *handle = openFile(file->descr.fdId, context);
+    int64_t extentsN = mapFileRange(handle, 0, file->descr.size, false, extents, context);
+    closeFile(handle, context);
+    if (extentsN <= 0) {
+        free(extents);
+        if (extentsN == -1) {
+            file->blocks = malloc(file->descr.occupiedBlocks*sizeof(StoredBlock));
+            file->blocksN = locateFileBlocks(&file->descr, file->blocks, context);
+        }
+        return;
+    }
+    file->extents = realloc(extents, extentsN*sizeof(FileExtent));
+    file->extentStarts = malloc(extentsN*sizeof(int64_t));
+    file->extentsN = extentsN;
+    int64_t start = 0;
+    for (int64_t i = 0; i < extentsN; i++) {
+        file->extentStarts[i] = start;
+        start += file->extents[i].size;
+    }
+}
+
+static int compareEntries(const void *a, const void *b) {
+    return strcmp(((const DirEntry *)a)->name, ((const DirEntry *)b)->name);
+}
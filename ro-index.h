@@ -0,0 +1,32 @@
+#ifndef _RO_INDEX_H_
+#define _RO_INDEX_H_
+
+#include "img-util.h"
+
+/** File of read-only image, it never changes after the index is built */
+typedef struct {
+    FileDescriptor descr;
+    FileExtent *extents;      // raw runs of contents in file order, NULL if contents are read through img-util
+    int64_t *extentStarts;    // offsets of extents in the file
+    int64_t extentsN;
+    StoredBlock *blocks;      // blocks of contents, that have no extents(compressed or checksummed)
+    int64_t blocksN;
+    DirEntry *entries;        // entries of directory sorted by name
+    int64_t entriesN;
+    char *target;             // target of symlink
+} RoFile;
+
+/** Immutable indexes of image, so any number of threads read it without locks */
+typedef struct {
+    FSContext *context;
+    RoFile *files;            // indexed by fdId, free descriptors and snapshots have type FT_DELETED
+} RoIndex;
+
+RoIndex *buildRoIndex(FSContext *context);
+void destroyRoIndex(RoIndex *index);
+RoFile *getRoFile(RoIndex *index, int fdId);
+int lookupRoEntry(RoFile *dir, const char *name);
+int64_t mapRoRange(RoFile *file, int64_t offsetInFile, size_t size, FileExtent *extents);
+ssize_t readRoFile(RoIndex *index, RoFile *file, void *buf, size_t size, int64_t offsetInFile);
+
+#endif
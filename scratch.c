@@ -0,0 +1,123 @@
+#define SCRATCH_CHUNK (1024*1024) // bigger chunks are freed on release, so one huge request isn't kept
+#define SCRATCH_ALIGN 16
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "scratch.h"
+
+/** Memory of the arena, chunks after the top one are empty */
+typedef struct ScratchChunk {
+    struct ScratchChunk *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(SCRATCH_ALIGN)));
+} ScratchChunk;
+
+typedef struct {
+    ScratchChunk *first;
+    ScratchChunk *top;      // chunk, that serves allocations now, NULL if nothing is taken
+} Scratch;
+
+static pthread_key_t scratchKey;
+static pthread_once_t scratchOnce = PTHREAD_ONCE_INIT;
+static int64_t allocationsN;
+
+static void destroyScratch(void *arg) {
+    Scratch *scratch = arg;
+    ScratchChunk *chunk = scratch->first;
+    while (chunk != NULL) {
+        ScratchChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(scratch);
+}
+
+static void createScratchKey(void) {
+    pthread_key_create(&scratchKey, destroyScratch);
+}
+
+/** return: arena of the calling thread, it's freed when the thread exits */
+static Scratch *getScratch(void) {
+    pthread_once(&scratchOnce, createScratchKey);
+    Scratch *scratch = pthread_getspecific(scratchKey);
+    if (scratch == NULL) {
+        scratch = calloc(1, sizeof(Scratch));
+        pthread_setspecific(scratchKey, scratch);
+    }
+    return scratch;
+}
+
+/** return: position, that is passed to scratchRelease to drop everything taken after it */
+ScratchMark scratchMark(void) {
+    Scratch *scratch = getScratch();
+    ScratchMark mark = { scratch->top, scratch->top != NULL ? scratch->top->used : 0 };
+    return mark;
+}
+
+/**
+ * Takes memory, that lives until scratchRelease of a mark taken before it. Marks are released
+ * in reverse order, so callees take and release their buffers inside buffers of the caller.
+ * Chunks stay with the thread, so in the steady state nothing is allocated.
+ */
+void *scratchAlloc(size_t size) {
+    Scratch *scratch = getScratch();
+    size = (size + SCRATCH_ALIGN - 1) / SCRATCH_ALIGN * SCRATCH_ALIGN;
+    ScratchChunk *last = NULL;
+    ScratchChunk *chunk = scratch->top != NULL ? scratch->top : scratch->first;
+    while (chunk != NULL && chunk->used + size > chunk->size) {
+        last = chunk;
+        chunk = chunk->next;
+    }
+    if (chunk == NULL) {
+        size_t chunkSize = size > SCRATCH_CHUNK ? size : SCRATCH_CHUNK;
+        chunk = malloc(sizeof(ScratchChunk) + chunkSize);
+        chunk->next = NULL;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        if (last != NULL) {
+            last->next = chunk;
+        } else {
+            scratch->first = chunk;
+        }
+        __sync_fetch_and_add(&allocationsN, 1);
+    }
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    scratch->top = chunk;
+    return memory;
+}
+
+void scratchRelease(ScratchMark mark) {
+    Scratch *scratch = getScratch();
+    ScratchChunk *prev = mark.chunk;
+    ScratchChunk *chunk;
+    if (prev != NULL) {
+        prev->used = mark.used;
+        chunk = prev->next;
+    } else {
+        chunk = scratch->first;
+    }
+    while (chunk != NULL) {
+        ScratchChunk *next = chunk->next;
+        if (chunk->size > SCRATCH_CHUNK) {
+            free(chunk);
+            if (prev != NULL) {
+                prev->next = next;
+            } else {
+                scratch->first = next;
+            }
+        } else {
+            chunk->used = 0;
+            prev = chunk;
+        }
+        chunk = next;
+    }
+    scratch->top = mark.chunk;
+}
+
+/** return: number of chunks, that were allocated by arenas of all threads */
+int64_t scratchAllocations(void) {
+    return __sync_fetch_and_add(&allocationsN, 0);
+}
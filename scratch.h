@@ -0,0 +1,18 @@
+#ifndef _SCRATCH_H_
+#define _SCRATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Position in the scratch arena of the calling thread */
+typedef struct {
+    void *chunk;
+    size_t used;
+} ScratchMark;
+
+ScratchMark scratchMark(void);
+void *scratchAlloc(size_t size);
+void scratchRelease(ScratchMark mark);
+int64_t scratchAllocations(void);
+
+#endif